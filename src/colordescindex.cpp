@@ -19,6 +19,7 @@
    License along with cbird; if not, see
    <https://www.gnu.org/licenses/>.  */
 #include "colordescindex.h"
+#include "ioutil.h"
 #include "qtutil.h"
 
 #include <cfloat>
@@ -27,11 +28,133 @@
 #include <QtSql/QSqlError>
 #include <QtSql/QSqlQuery>
 
+static QString cacheFile(const QString& cachePath) { return cachePath + qq("/colordesc.cache"); }
+
+// header written to cache file, the payload is mediaId[] then descriptors[]
+static QString cacheHeader() {
+  static constexpr int version = 1;
+  return QStringLiteral("cbird color desc index:%1:%2:%3")
+      .arg(version)
+      .arg(sizeof(uint32_t))
+      .arg(sizeof(ColorDescriptor));
+}
+
+namespace {
+
+enum {
+  NumColors = ColorDescriptor::NUM_DESC_COLORS,
+  Block = 16,  // items per call to blockDistance()
+};
+
+// decompressed needle colors
+struct Needle {
+  int numColors;
+  float l[NumColors], u[NumColors], v[NumColors];
+  float box[6];  // min l,u,v, max l,u,v
+
+  explicit Needle(const ColorDescriptor& d) : numColors(d.numColors) {
+    box[0] = box[1] = box[2] = FLT_MAX;
+    box[3] = box[4] = box[5] = -FLT_MAX;
+    for (int i = 0; i < numColors; ++i) {
+      d.colors[i].get(l[i], u[i], v[i]);
+      box[0] = std::min(box[0], l[i]);
+      box[1] = std::min(box[1], u[i]);
+      box[2] = std::min(box[2], v[i]);
+      box[3] = std::max(box[3], l[i]);
+      box[4] = std::max(box[4], u[i]);
+      box[5] = std::max(box[5], v[i]);
+    }
+  }
+};
+
+// distance from x to the interval [lo,hi], never more than distance to any x in it
+inline float gap(float x, float lo, float hi) {
+  const float g = std::max(lo - x, x - hi);
+  return g > 0 ? g : 0;
+}
+
+/**
+ * ColorDescriptor::distance() from needle to a block of items with n colors
+ * @param cand cand[c*3+ch] points to channel ch of color c of the first item
+ * @details The loops over items are innermost so they can be vectorized. The
+ *          minimum is taken before sqrt, which is the same since sqrt is monotonic.
+ */
+void blockDistance(const Needle& a, const float* const* cand, int n, int count, float* out) {
+  float best[Block];
+  for (int k = 0; k < count; ++k) out[k] = 1;
+
+  // the outer loop is over the descriptor with more colors, like distance()
+  if (a.numColors >= n) {
+    for (int i = 0; i < a.numColors; ++i) {
+      for (int k = 0; k < count; ++k) best[k] = FLT_MAX;
+      for (int j = 0; j < n; ++j) {
+        const float *l = cand[j * 3], *u = cand[j * 3 + 1], *v = cand[j * 3 + 2];
+        for (int k = 0; k < count; ++k) {
+          const float dl = a.l[i] - l[k], du = a.u[i] - u[k], dv = a.v[i] - v[k];
+          const float d = dl * dl + du * du + dv * dv;
+          best[k] = d < best[k] ? d : best[k];
+        }
+      }
+      for (int k = 0; k < count; ++k) out[k] += sqrtf(best[k]);
+    }
+  } else {
+    for (int i = 0; i < n; ++i) {
+      const float *l = cand[i * 3], *u = cand[i * 3 + 1], *v = cand[i * 3 + 2];
+      for (int k = 0; k < count; ++k) best[k] = FLT_MAX;
+      for (int j = 0; j < a.numColors; ++j)
+        for (int k = 0; k < count; ++k) {
+          const float dl = l[k] - a.l[j], du = u[k] - a.u[j], dv = v[k] - a.v[j];
+          const float d = dl * dl + du * du + dv * dv;
+          best[k] = d < best[k] ? d : best[k];
+        }
+      for (int k = 0; k < count; ++k) out[k] += sqrtf(best[k]);
+    }
+  }
+}
+
+/**
+ * Lower bound of blockDistance(), nearest color is replaced by the
+ * bounding box of the other descriptor's colors
+ * @param box box[0..5] points to the bounding box of the first item
+ */
+void blockLowerBound(const Needle& a,
+                     const float* const* cand,
+                     const float* const* box,
+                     int n,
+                     int count,
+                     float* out) {
+  for (int k = 0; k < count; ++k) out[k] = 1;
+
+  if (a.numColors >= n) {
+    for (int i = 0; i < a.numColors; ++i)
+      for (int k = 0; k < count; ++k) {
+        const float gl = gap(a.l[i], box[0][k], box[3][k]);
+        const float gu = gap(a.u[i], box[1][k], box[4][k]);
+        const float gv = gap(a.v[i], box[2][k], box[5][k]);
+        out[k] += sqrtf(gl * gl + gu * gu + gv * gv);
+      }
+  } else {
+    for (int i = 0; i < n; ++i) {
+      const float *l = cand[i * 3], *u = cand[i * 3 + 1], *v = cand[i * 3 + 2];
+      for (int k = 0; k < count; ++k) {
+        const float gl = gap(l[k], a.box[0], a.box[3]);
+        const float gu = gap(u[k], a.box[1], a.box[4]);
+        const float gv = gap(v[k], a.box[2], a.box[5]);
+        out[k] += sqrtf(gl * gl + gu * gu + gv * gv);
+      }
+    }
+  }
+}
+
+} // namespace
+
 ColorDescIndex::ColorDescIndex() : Index() {
   _id = SearchParams::AlgoColor;
   _count = 0;
+  _numRemoved = 0;
   _mediaId = nullptr;
   _descriptors = nullptr;
+  _mapped = nullptr;
 }
 
 ColorDescIndex::~ColorDescIndex() { unload(); }
@@ -84,12 +207,60 @@ void ColorDescIndex::removeRecords(QSqlDatabase& db, const QVector<int>& mediaId
 }
 
 void ColorDescIndex::unload() {
-  free(_mediaId);
-  free(_descriptors);
+  if (_mapped)
+    delete _mapped; // also unmaps
+  else {
+    free(_mediaId);
+    free(_descriptors);
+  }
+  clearBuckets();
 
   _count = 0;
+  _numRemoved = 0;
   _mediaId = nullptr;
   _descriptors = nullptr;
+  _mapped = nullptr;
+}
+
+void ColorDescIndex::detach() {
+  // arrays are about to be resized, move them off of the cache file
+  if (!_mapped) return;
+
+  uint32_t* mediaId = strict_malloc(mediaId, _count);
+  ColorDescriptor* descriptors = strict_malloc(descriptors, _count);
+  memcpy(mediaId, _mediaId, sizeof(*mediaId) * size_t(_count));
+  memcpy(descriptors, _descriptors, sizeof(*descriptors) * size_t(_count));
+
+  delete _mapped;
+  _mapped = nullptr;
+  _mediaId = mediaId;
+  _descriptors = descriptors;
+}
+
+bool ColorDescIndex::loadCache(const QString& path) {
+  auto* f = new QFile(path);
+  qint64 len = 0;
+  uchar* ptr = mapCacheFile(*f, cacheHeader(), &len);
+
+  // media ids first, so both arrays are aligned
+  const size_t itemSize = sizeof(*_mediaId) + sizeof(*_descriptors);
+  if (!ptr || len % itemSize != 0 || size_t(len) / itemSize > INT_MAX) {
+    qWarning() << "invalid cache file, removing" << path;
+    if (!f->remove()) qWarning() << "failed to remove cache file:" << f->errorString();
+    delete f;
+    return false;
+  }
+
+  _mapped = f;
+  _count = int(size_t(len) / itemSize);
+  _mediaId = reinterpret_cast<uint32_t*>(ptr);
+  _descriptors = reinterpret_cast<ColorDescriptor*>(ptr + sizeof(*_mediaId) * size_t(_count));
+
+  _numRemoved = 0;
+  for (int i = 0; i < _count; ++i)
+    if (_mediaId[i] == 0) _numRemoved++;
+
+  return true;
 }
 
 bool ColorDescIndex::isLoaded() const { return _count > 0; }
@@ -98,18 +269,62 @@ int ColorDescIndex::count() const { return _count; }
 
 size_t ColorDescIndex::memoryUsage() const {
   size_t num = size_t(count());
-  return sizeof(ColorDescriptor) * num + sizeof(int) * num;
+  size_t bytes = sizeof(ColorDescriptor) * num + sizeof(int) * num;
+  for (const Bucket& b : _buckets) {
+    bytes += VECTOR_SIZE(b.index) + VECTOR_SIZE(b.colors);
+    for (const auto& c : b.colors) bytes += c.capacity() * sizeof(float);
+    for (const auto& c : b.box) bytes += c.capacity() * sizeof(float);
+  }
+  return bytes;
+}
+
+size_t ColorDescIndex::memoryWasted() const {
+  // removed items stay in the buckets too, assume they are average
+  if (_count <= 0) return 0;
+  return memoryUsage() / size_t(_count) * size_t(_numRemoved);
+}
+
+void ColorDescIndex::clearBuckets() {
+  for (Bucket& b : _buckets) b = Bucket();
+}
+
+void ColorDescIndex::addToBuckets(int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    const ColorDescriptor& d = _descriptors[i];
+    const int n = std::min(int(d.numColors), int(NumColors));
+    if (n <= 0) continue;  // never matches anything
+
+    Bucket& b = _buckets[n];
+    b.colors.resize(size_t(n) * 3);
+    b.index.push_back(uint32_t(i));
+
+    float box[6] = {FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (int c = 0; c < n; ++c) {
+      float luv[3];
+      d.colors[c].get(luv[0], luv[1], luv[2]);
+      for (int ch = 0; ch < 3; ++ch) {
+        b.colors[size_t(c) * 3 + size_t(ch)].push_back(luv[ch]);
+        box[ch] = std::min(box[ch], luv[ch]);
+        box[ch + 3] = std::max(box[ch + 3], luv[ch]);
+      }
+    }
+    for (int j = 0; j < 6; ++j) b.box[j].push_back(box[j]);
+  }
 }
 
 void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
-  // hashes are always loaded from database, no caching
-  (void)cachePath;
   (void)dataPath;
 
   if (isLoaded()) return;
 
   unload();
 
+  const QString path = cacheFile(cachePath);
+  if (!DBHelper::isCacheFileStale(db, path) && loadCache(path)) {
+    addToBuckets(0, _count);
+    return;
+  }
+
   QSqlQuery query(db);
 
   // item count for memory allocation
@@ -150,12 +365,33 @@ void ColorDescIndex::load(QSqlDatabase& db, const QString& cachePath, const QStr
 
   } while (query.next());
   pl.end();
+
+  addToBuckets(0, _count);
+
+  save(db, cachePath);
 }
 
 void ColorDescIndex::save(QSqlDatabase& db, const QString& cachePath) {
-  // no caching
-  (void)db;
-  (void)cachePath;
+  if (!isLoaded()) return;
+
+  const QString path = cacheFile(cachePath);
+
+  if (!DBHelper::isCacheFileStale(db, path)) return;
+
+  // if we are mapped, the file is about to be replaced
+  detach();
+
+  // no reason to keep removed items in the cache
+  if (_numRemoved > 0) compact();
+
+  qInfo() << "writing cache file";
+  writeFileAtomically(path, [this](QFile& f) {
+    writeCacheHeader(f, cacheHeader());
+    qint64 len = qint64(sizeof(*_mediaId)) * _count;
+    if (len != f.write(reinterpret_cast<const char*>(_mediaId), len)) throw f.errorString();
+    len = qint64(sizeof(*_descriptors)) * _count;
+    if (len != f.write(reinterpret_cast<const char*>(_descriptors), len)) throw f.errorString();
+  });
 }
 
 QSet<mediaid_t> ColorDescIndex::mediaIds(QSqlDatabase& db,
@@ -190,6 +426,8 @@ QSet<mediaid_t> ColorDescIndex::mediaIds(QSqlDatabase& db,
 }
 
 void ColorDescIndex::add(const MediaGroup& media) {
+  detach();
+
   int end = _count;
   _count += media.count();
 
@@ -201,21 +439,52 @@ void ColorDescIndex::add(const MediaGroup& media) {
     _mediaId[i + end] = uint32_t(m.id());
     _descriptors[i + end] = m.colorDescriptor();
   }
+
+  addToBuckets(end, _count);
 }
 
 void ColorDescIndex::remove(const QVector<int>& toRemove) {
   if (!isLoaded()) return;
 
-  // rather than realloc the index we can nullify the removed items
-  // TODO: track the amount of wasted space and compact at some point
+  // rather than realloc the index we can nullify the removed items,
+  // and compact when enough of it is wasted
   QSet<int> ids;
   for (int id : toRemove) ids.insert(id);
 
   for (int i = 0; i < _count; i++)
-    if (ids.contains(int(_mediaId[i]))) {
+    if (_mediaId[i] && ids.contains(int(_mediaId[i]))) {
       _mediaId[i] = 0;
       _descriptors[i].clear();
+      _numRemoved++;
+    }
+
+  if (_numRemoved > 0 && _numRemoved * 100LL >= _count * qint64(CompactPercent)) compact();
+}
+
+void ColorDescIndex::compact() {
+  detach();
+
+  int j = 0;
+  for (int i = 0; i < _count; ++i)
+    if (_mediaId[i]) {
+      _mediaId[j] = _mediaId[i];
+      _descriptors[j] = _descriptors[i];
+      j++;
     }
+
+  qDebug("removed %d items, %d remaining", _count - j, j);
+
+  _count = j;
+  _numRemoved = 0;
+  if (_count > 0) {
+    _mediaId = strict_realloc(_mediaId, _count);
+    _descriptors = strict_realloc(_descriptors, _count);
+
+    // positions changed
+    clearBuckets();
+    addToBuckets(0, _count);
+  } else
+    unload();
 }
 
 bool ColorDescIndex::findIndexData(Media& m) const {
@@ -243,36 +512,134 @@ Index* ColorDescIndex::slice(const QSet<uint32_t>& mediaIds) const {
       j++;
     }
   chunk->_count = j;
+  chunk->addToBuckets(0, chunk->_count);
 
   return chunk;
 }
 
-QVector<Index::Match> ColorDescIndex::find(const Media& m, const SearchParams& p) {
-  (void)p;
-
-  // TODO: search tree for histograms
-
-  QVector<Index::Match> results;
-
-  ColorDescriptor target = m.colorDescriptor();
+bool ColorDescIndex::needleDescriptor(const Media& m, ColorDescriptor& target) const {
+  target = m.colorDescriptor();
   if (target.numColors <= 0) {
     Media tmp = m;
     if (findIndexData(tmp))
       target = tmp.colorDescriptor();
     else
       qWarning() << "needle has no color descriptor" << m.id() << m.path();
-
-    if (target.numColors <= 0) return results;
   }
+  return target.numColors > 0;
+}
+
+template<typename Fn>
+void ColorDescIndex::forEachBucket(const ColorDescriptor& target, const Fn& fn) const {
+  // distance() is FLT_MAX if the number of colors differs by more than 2,
+  // nearest buckets first since they are likely to have the best matches
+  const int n = std::min(int(target.numColors), int(NumColors));
+  for (int delta : {0, -1, 1, -2, 2})
+    if (n + delta > 0 && n + delta <= NumColors) fn(_buckets[n + delta], n + delta);
+}
+
+QVector<Index::Match> ColorDescIndex::find(const Media& m, const SearchParams& p) {
+  (void)p;
+
+  QVector<Index::Match> results;
 
-  for (int i = 0; i < _count; i++) {
-    float distance = ColorDescriptor::distance(target, _descriptors[i]);
+  ColorDescriptor target;
+  if (!needleDescriptor(m, target)) return results;
 
-    if (distance < FLT_MAX) {
-      uint32_t id = _mediaId[i];
-      if (id != 0) results.append(Index::Match(id, int(distance)));
+  const Needle needle(target);
+  float dist[Block];
+  const float* cols[NumColors * 3];
+
+  forEachBucket(target, [&](const Bucket& b, int n) {
+    const size_t size = b.index.size();
+    for (size_t begin = 0; begin < size; begin += Block) {
+      const int count = int(std::min(size_t(Block), size - begin));
+      for (int c = 0; c < n * 3; ++c) cols[c] = b.colors[size_t(c)].data() + begin;
+
+      blockDistance(needle, cols, n, count, dist);
+
+      for (int k = 0; k < count; ++k) {
+        uint32_t id = _mediaId[b.index[begin + size_t(k)]];
+        if (id != 0) results.append(Index::Match(id, int(dist[k])));
+      }
     }
-  }
+  });
 
   return results;
 }
+
+bool ColorDescIndex::findNearest(const Media& m,
+                                 int k,
+                                 const SearchParams& p,
+                                 QVector<Index::Match>& matches) {
+  (void)p;
+
+  matches.clear();
+
+  ColorDescriptor target;
+  if (k <= 0 || !needleDescriptor(m, target)) return true;
+
+  const Needle needle(target);
+  float dist[Block], bound[Block];
+  const float* cols[NumColors * 3];
+  const float* box[6];
+
+  // survivors of the lower bound are copied here to compute the distance
+  float survivors[NumColors * 3][Block];
+  const float* survivorCols[NumColors * 3];
+  for (int c = 0; c < NumColors * 3; ++c) survivorCols[c] = survivors[c];
+  uint32_t survivorIds[Block];
+
+  // max-heap of the best k, once full the top is the score to beat
+  std::vector<Index::Match> heap;
+  heap.reserve(size_t(k));
+  auto consider = [&](uint32_t id, int score) {
+    if (int(heap.size()) < k) {
+      heap.push_back(Index::Match(id, score));
+      std::push_heap(heap.begin(), heap.end());
+    } else if (score < heap.front().score) {
+      std::pop_heap(heap.begin(), heap.end());
+      heap.back() = Index::Match(id, score);
+      std::push_heap(heap.begin(), heap.end());
+    }
+  };
+
+  forEachBucket(target, [&](const Bucket& b, int n) {
+    const size_t size = b.index.size();
+    for (size_t begin = 0; begin < size; begin += Block) {
+      const int count = int(std::min(size_t(Block), size - begin));
+      for (int c = 0; c < n * 3; ++c) cols[c] = b.colors[size_t(c)].data() + begin;
+
+      if (int(heap.size()) < k) {
+        blockDistance(needle, cols, n, count, dist);
+        for (int j = 0; j < count; ++j) {
+          uint32_t id = _mediaId[b.index[begin + size_t(j)]];
+          if (id != 0) consider(id, int(dist[j]));
+        }
+        continue;
+      }
+
+      // bound <= distance, so int(bound) >= score to beat can't be better; shave
+      // the bound a little since fp contraction (fma) can round it up an ulp
+      for (int j = 0; j < 6; ++j) box[j] = b.box[j].data() + begin;
+      blockLowerBound(needle, cols, box, n, count, bound);
+
+      const int cutoff = heap.front().score;
+      int numSurvivors = 0;
+      for (int j = 0; j < count; ++j) {
+        uint32_t id = _mediaId[b.index[begin + size_t(j)]];
+        if (id == 0 || int(bound[j] * 0.9999f) >= cutoff) continue;
+        for (int c = 0; c < n * 3; ++c) survivors[c][numSurvivors] = cols[c][j];
+        survivorIds[numSurvivors++] = id;
+      }
+      if (numSurvivors == 0) continue;
+
+      blockDistance(needle, survivorCols, n, numSurvivors, dist);
+      for (int j = 0; j < numSurvivors; ++j) consider(survivorIds[j], int(dist[j]));
+    }
+  });
+
+  std::sort_heap(heap.begin(), heap.end());
+  for (const Index::Match& match : heap) matches.append(match);
+  return true;
+}
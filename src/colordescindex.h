@@ -28,6 +28,8 @@
  * Detects images with similar colors
  */
 class ColorDescIndex : public Index {
+  friend class TestColorDescIndex;
+
   Q_DISABLE_COPY_MOVE(ColorDescIndex)
 
  public:
@@ -40,6 +42,7 @@ class ColorDescIndex : public Index {
 
   bool isLoaded() const override;
   size_t memoryUsage() const override;
+  size_t memoryWasted() const override;
   int count() const override;
 
   void load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) override;
@@ -53,14 +56,46 @@ class ColorDescIndex : public Index {
   void remove(const QVector<int>& id) override;
 
   QVector<Index::Match> find(const Media& m, const SearchParams& p) override;
+  bool findNearest(const Media& m, int k, const SearchParams& p,
+                   QVector<Index::Match>& matches) override;
   bool findIndexData(Media& m) const override;
 
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
  private:
+  enum {
+    CompactPercent = 10, // percent of removed items that triggers compact()
+  };
+
+  /**
+   * Descriptors with the same number of colors, stored structure-of-arrays
+   * so distances to a block of items can be vectorized
+   */
+  struct Bucket {
+    std::vector<uint32_t> index;             // position in _descriptors
+    std::vector<std::vector<float>> colors;  // [color*3+channel][item], decompressed luv
+    std::vector<float> box[6];               // [min l,u,v, max l,u,v][item] of all colors
+  };
+
   void unload();
+  void compact();
+  bool loadCache(const QString& path);
+  void detach();
+  void addToBuckets(int begin, int end);
+  void clearBuckets();
+
+  /// call fn(bucket) for each bucket that could be within distance of target
+  template<typename Fn>
+  void forEachBucket(const ColorDescriptor& target, const Fn& fn) const;
+
+  bool needleDescriptor(const Media& m, ColorDescriptor& target) const;
 
   int _count; // FIXME: use size_t
+  int _numRemoved; // number of zeroed items
   uint32_t* _mediaId;
   ColorDescriptor* _descriptors;
+  QFile* _mapped; // if non-null, _mediaId/_descriptors point into the cache file
+
+  // index of _descriptors by numColors, removed items are not removed
+  Bucket _buckets[ColorDescriptor::NUM_DESC_COLORS + 1];
 };
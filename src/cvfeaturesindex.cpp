@@ -24,6 +24,7 @@
 #include "ioutil.h"
 #include "profile.h"
 #include "qtutil.h"
+#include "tree/lsh.h"
 
 #include "opencv2/features2d.hpp"
 
@@ -33,16 +34,18 @@
 #include <QtSql/QSqlError>
 #include <QtSql/QSqlQuery>
 
-// there is a breaking change to flann interface at some point
-#if !(CV_VERSION_EPOCH == 2 && CV_VERSION_MAJOR >= 4 && CV_VERSION_MINOR >= 13)
-#  error OpenCV 2.4.13+ is required
-#endif
-
 static QString cacheFile(const QString& cachePath) { return cachePath + qq("/cvfeatures.touch"); }
 
+static QString lshFile(const QString& cachePath) { return cachePath + qq("/cvfeatures.lsh"); }
+
+static void saveLsh(const OrbLsh& index, const QString& cachePath) {
+  writeFileAtomically(lshFile(cachePath), [&index](QFile& f) { index.write(f); });
+}
+
 CvFeaturesIndex::CvFeaturesIndex() {
   _id = SearchParams::AlgoCVFeatures;
   _index = nullptr;
+  _removedRows = 0;
 }
 
 CvFeaturesIndex::~CvFeaturesIndex() { delete _index; }
@@ -101,26 +104,29 @@ void CvFeaturesIndex::removeRecords(QSqlDatabase& db, const QVector<int>& mediaI
 
 bool CvFeaturesIndex::isLoaded() const { return _index != nullptr; }
 
-int CvFeaturesIndex::count() const { return _descriptors.rows; }
+int CvFeaturesIndex::count() const { return _descriptors.rows(); }
 
 size_t CvFeaturesIndex::memoryUsage() const {
-  if (_descriptors.rows <= 0) return 0;
-
-  size_t mem = 0;
-  const cv::Mat& d = _descriptors;
+  if (_descriptors.rows() <= 0) return 0;
 
-  mem += uint(d.rows * d.cols) * d.elemSize();
+  size_t mem = _descriptors.memoryUsage();
 
-  // don't really know how much lsh index uses
-  mem *= 2;
+  if (_index) mem += _index->memoryUsage();
 
   // fixme:also memory for lookup trees
 
   return mem;
 }
 
+size_t CvFeaturesIndex::memoryWasted() const {
+  if (_descriptors.rows() <= 0) return 0;
+
+  // descriptor and one position in each lsh table
+  return size_t(_removedRows) * (OrbLsh::DescBytes + OrbLsh::NumTables * sizeof(uint32_t));
+}
+
 void CvFeaturesIndex::add(const MediaGroup& media) {
-  cv::Mat addedDescriptors;
+  int addedRows = 0;
 
   for (const Media& m : media) {
     const KeyPointDescriptors& desc = m.keyPointDescriptors();
@@ -131,7 +137,7 @@ void CvFeaturesIndex::add(const MediaGroup& media) {
       continue;
     }
     uint32_t mid = uint32_t(m.id());
-    uint32_t numDesc = uint32_t(_descriptors.rows);
+    uint32_t numDesc = uint32_t(_descriptors.rows());
     _idMap[mid] = numDesc;
     _indexMap[numDesc] = mid;
 
@@ -139,14 +145,11 @@ void CvFeaturesIndex::add(const MediaGroup& media) {
     _idMap[UINT32_MAX] = numDesc;
     _indexMap[numDesc] = 0;
 
-    for (int j = 0; j < desc.rows; j++) {
-      _descriptors.push_back(desc.row(j));
-      addedDescriptors.push_back(desc.row(j));
-    }
+    _descriptors.append(desc);
+    addedRows += desc.rows;
   }
 
-  if (addedDescriptors.rows > 0)
-    buildIndex(addedDescriptors);
+  if (addedRows > 0) buildIndex(addedRows);
 }
 
 void CvFeaturesIndex::remove(const QVector<int>& ids) {
@@ -156,12 +159,52 @@ void CvFeaturesIndex::remove(const QVector<int>& ids) {
     if (it != constIdMap.end()) {
       uint32_t index = it->second;
       auto it2 = _indexMap.find(index);
-      if (it2 != _indexMap.end()) {
+      if (it2 != _indexMap.end() && it2->second != 0) {
         Q_ASSERT(int(it2->second) == id);
         it2->second = 0;
+        _removedRows += int(std::next(it2)->first - it2->first);
       }
     }
   }
+
+  // the lsh index is rebuilt by compaction, wait until it is worth it
+  if (_removedRows > 0 && _removedRows * 100LL >= _descriptors.rows() * qint64(CompactPercent))
+    compact();
+}
+
+void CvFeaturesIndex::compact() {
+  // copy the live ranges, in the same order so _idMap stays ascending
+  Descriptors descriptors;
+  std::map<uint32_t, uint32_t> idMap, indexMap;
+  uint32_t numDesc = 0;
+
+  for (auto it = _indexMap.begin(); it != _indexMap.end(); ++it) {
+    const uint32_t mediaId = it->second;
+    if (!mediaId) continue;  // removed or trailer
+
+    const auto next = std::next(it);
+    Q_ASSERT(next != _indexMap.end());  // not possible since trailer is added
+    descriptors.append(_descriptors.rowRange(int(it->first), int(next->first)));
+
+    idMap[mediaId] = numDesc;
+    indexMap[numDesc] = mediaId;
+    numDesc += next->first - it->first;
+  }
+
+  qDebug("removed %d descriptors, %d remaining", _descriptors.rows() - int(numDesc),
+         int(numDesc));
+
+  idMap[UINT32_MAX] = numDesc;
+  indexMap[numDesc] = 0;
+
+  _descriptors = std::move(descriptors);
+  _idMap.swap(idMap);
+  _indexMap.swap(indexMap);
+  _removedRows = 0;
+
+  delete _index;
+  _index = nullptr;
+  buildIndex(0);
 }
 
 void CvFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
@@ -172,7 +215,7 @@ void CvFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QSt
   bool stale = DBHelper::isCacheFileStale(db, cacheFile(cachePath));
 
   if (!_index || stale) {
-    _descriptors = cv::Mat();
+    _descriptors = Descriptors();
     delete _index;
     _index = nullptr;
 
@@ -218,9 +261,8 @@ void CvFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QSt
             continue;
           }
 
-          // smoosh all features into one big cv::Mat
-          for (int j = 0; j < desc.rows; j++)
-            _descriptors.push_back(desc.row(j));
+          // smoosh all features into one big matrix
+          _descriptors.append(desc);
 
           // maps to get back to the media or descriptors associated with media
           _idMap[id] = numDesc;
@@ -232,20 +274,26 @@ void CvFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QSt
         pl.stepRateLimited(currentRow++);
       }
       pl.end();
-      Q_ASSERT(_descriptors.rows == int(numDesc));
+      Q_ASSERT(_descriptors.rows() == int(numDesc));
 
-      // build flann index
-      buildIndex({});
+      // build lsh index
+      buildIndex(0);
 
       saveIndex(cachePath);
     }
 
     // trailing values to get length of last value
-    _idMap[UINT32_MAX] = uint32_t(_descriptors.rows);
-    _indexMap[uint32_t(_descriptors.rows)] = 0;
+    _idMap[UINT32_MAX] = uint32_t(_descriptors.rows());
+    _indexMap[uint32_t(_descriptors.rows())] = 0;
+
+    // the cache could have removed items
+    _removedRows = 0;
+    for (auto it = _indexMap.begin(); it != _indexMap.end(); ++it)
+      if (it->second == 0 && std::next(it) != _indexMap.end())
+        _removedRows += int(std::next(it)->first - it->first);
   }
 
-  qInfo("%d descriptors %dMB %dms", _descriptors.rows, int(memoryUsage() / 1000000),
+  qInfo("%d descriptors %dMB %dms", _descriptors.rows(), int(memoryUsage() / 1000000),
         int(QDateTime::currentMSecsSinceEpoch() - then));
 }
 
@@ -292,7 +340,7 @@ Index* CvFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
   for (uint32_t id : values) {
     cv::Mat desc = descriptorsForMediaId(id);
     if (desc.rows > 0) {
-      for (int j = 0; j < desc.rows; j++) chunk->_descriptors.push_back(desc.row(j));
+      chunk->_descriptors.append(desc);
       chunk->_idMap[id] = numDesc;
       chunk->_indexMap[numDesc] = id;
       numDesc += uint(desc.rows);
@@ -301,9 +349,9 @@ Index* CvFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
   chunk->_idMap[UINT32_MAX] = numDesc;
   chunk->_indexMap[numDesc] = 0;
 
-  Q_ASSERT(chunk->_descriptors.rows == int(numDesc));
+  Q_ASSERT(chunk->_descriptors.rows() == int(numDesc));
 
-  chunk->buildIndex({});
+  chunk->buildIndex(0);
 
   return chunk;
 }
@@ -314,79 +362,40 @@ void CvFeaturesIndex::save(QSqlDatabase& db, const QString& cachePath) {
   if (DBHelper::isCacheFileStale(db, cacheFile(cachePath))) saveIndex(cachePath);
 }
 
-void CvFeaturesIndex::buildIndex(const cv::Mat& addedDescriptors) {
+void CvFeaturesIndex::buildIndex(int addedRows) {
   qint64 ms = QDateTime::currentMSecsSinceEpoch();
 
-  if (_descriptors.rows <= 0) {
+  if (_descriptors.rows() <= 0) {
     qWarning("no descriptors");
     return;
   }
 
-  //
-  // The bucket size roughly determines the query
-  // performance since that part is linear time whereas the hashing
-  // part is constant time.
-  //
-  // The key size (K) determines the bucket sizes since the descriptors
-  // are sorted into 2^K buckets, the bucket size on average is around N / 2^K
-  //
-  // If the bucket size is too small, many hashes will miss and it takes
-  // a long time to build the index. If it is too big, the index build is fast,
-  // but query performance suffers.
-  //
-  // This first attempt is to associate the bytes or memory/cache needed
-  // for each bucket and find a key size based on that.
-  //
-  int tables = 1;
-  const int descSize = 32;  // OpenCV ORB default descriptor size (bytes)
-
-  // verify descriptor size
-  if (_descriptors.cols > 0)
-    Q_ASSERT(descSize == int(_descriptors.elemSize() * uint(_descriptors.cols)));
-
-  int bytesPerBucket = 4096;
-  int descPerBucket = bytesPerBucket / descSize;
-  int keySize = int(log2(_descriptors.rows / descPerBucket));
-  int numBuckets = 2 << keySize;
-  descPerBucket = _descriptors.rows / numBuckets;
-  int kbPerBucket = descPerBucket * descSize / 1024;
-
-  int indexKb = tables * numBuckets * descPerBucket * descSize / 1024;
-
-  qDebug("descSize=%d keySize=%d buckets=%d descriptors/bucket=%d kb/bucket=%d indexKb=%d",
-         descSize, keySize, numBuckets, descPerBucket, kbPerBucket, indexKb);
-
-  cv::flann::LshIndexParams indexParams(tables, keySize, 1);
+  // OrbLsh reads the rows directly, they must be ORB descriptors
+  static_assert(Descriptors::BlockRows == 1 << OrbLsh::BlockShift, "block size mismatch");
+  if (_descriptors.type() != CV_8U || _descriptors.cols() != OrbLsh::DescBytes) {
+    qWarning("unsupported descriptor type=%d cols=%d", _descriptors.type(), _descriptors.cols());
+    delete _index;
+    _index = nullptr;
+    return;
+  }
 
   // update with added descriptors, faster than full rebuild
-  if (_index && addedDescriptors.rows > 0) {
-    _index->build(_descriptors, addedDescriptors, indexParams);
+  if (_index && addedRows > 0) {
+    _index->append(_descriptors.blocks(), size_t(_descriptors.rows()));
   } else {
-    delete _index;
-    //_index = new cv::flann::Index(_descriptors, indexParams); // non-incremental build
-    _index = new cv::flann::Index;
-
-    // build the index incrementally, it is a quite faster
-    // somehow, and does not seem to affect accuracy
-    PROGRESS_LOGGER(pl, "<PL>%percent %step descriptors", _descriptors.rows);
-
-    for (int i = 0; i < _descriptors.rows; i += 10000) {
-      int upper = std::min(i + 10000, _descriptors.rows);
-      _index->build(_descriptors.rowRange(0, upper), _descriptors.rowRange(i, upper), indexParams);
-      pl.step(i+upper);
-    }
-    pl.end();
+    if (!_index) _index = new OrbLsh;
+    _index->build(_descriptors.blocks(), size_t(_descriptors.rows()));
   }
 
   ms = QDateTime::currentMSecsSinceEpoch() - ms;
 
-  qDebug("%d descriptors, %d added, %dms %.2fus/desc", _descriptors.rows, addedDescriptors.rows,
-         int(ms), ms * 1000.0 / _descriptors.rows);
+  qDebug("%d descriptors, %d added, %dms %.2fus/desc", _descriptors.rows(), addedRows, int(ms),
+         ms * 1000.0 / _descriptors.rows());
 }
 
 void CvFeaturesIndex::loadIndex(const QString& path) {
   uint64_t then = nanoTime();
-  loadMatrix(path + "/cvfeatures.mat", _descriptors);
+  _descriptors.load(path + "/cvfeatures.mat");
   loadMap(_idMap, path + "/cvfeatures_idmap.map");
   loadMap(_indexMap, path + "/cvfeatures_indexmap.map");
 
@@ -394,8 +403,25 @@ void CvFeaturesIndex::loadIndex(const QString& path) {
   uint64_t nsLoad = now - then;
   then = now;
 
-  auto addedDescriptors = cv::Mat();
-  buildIndex(addedDescriptors);
+  // the tables were saved with the matrix, only rebuild if they are missing or invalid
+  delete _index;
+  _index = new OrbLsh;
+  const bool valid =
+      _descriptors.rows() > 0 && _descriptors.type() == CV_8U &&
+      _descriptors.cols() == OrbLsh::DescBytes &&
+      _index->read(lshFile(path), _descriptors.blocks(), size_t(_descriptors.rows()));
+
+  if (!valid) {
+    delete _index;
+    _index = nullptr;
+
+    buildIndex(0);
+
+    if (_index) {
+      qWarning() << "invalid cache file, rebuilt" << lshFile(path);
+      saveLsh(*_index, path);
+    }
+  }
 
   now = nanoTime();
   uint64_t nsBuild = now - then;
@@ -405,11 +431,15 @@ void CvFeaturesIndex::loadIndex(const QString& path) {
 
 void CvFeaturesIndex::saveIndex(const QString& cachePath) {
   qInfo() << "<PL>writing descriptors...";
-  saveMatrix(_descriptors, cachePath + "/cvfeatures.mat");
+  _descriptors.save(cachePath + "/cvfeatures.mat");
   qInfo() << "<PL>writing ids...        ";
   saveMap(_idMap, cachePath + "/cvfeatures_idmap.map");
   qInfo() << "<PL>writing indices...    ";
   saveMap(_indexMap, cachePath + "/cvfeatures_indexmap.map");
+  if (_index) {
+    qInfo() << "<PL>writing lsh tables... ";
+    saveLsh(*_index, cachePath);
+  }
   qInfo() << "<PL>writing marker...     ";
   writeFileAtomically(cacheFile(cachePath), [](QFile& f) {
     QByteArray mark("this file indicates index was saved successfully");
@@ -418,6 +448,64 @@ void CvFeaturesIndex::saveIndex(const QString& cachePath) {
   qInfo() << "<PL>writing complete      ";
 }
 
+void CvFeaturesIndex::Descriptors::append(const cv::Mat& m) {
+  if (m.rows <= 0) return;
+
+  if (_rows == 0) {
+    _cols = m.cols;
+    _type = m.type();
+  }
+  Q_ASSERT(m.cols == _cols && m.type() == _type);
+
+  const size_t rowLen = size_t(_cols) * m.elemSize();
+  for (int i = 0; i < m.rows; ++i) {
+    const int row = _rows % BlockRows;
+    if (row == 0) {
+      _blocks.push_back(cv::Mat(BlockRows, _cols, _type));
+      _data.push_back(_blocks.back().data);
+    }
+    memcpy(_blocks.back().ptr(row), m.ptr(i), rowLen);
+    _rows++;
+  }
+}
+
+cv::Mat CvFeaturesIndex::Descriptors::rowRange(int first, int last) const {
+  Q_ASSERT(first >= 0 && first <= last && last <= _rows);
+  if (first == last) return cv::Mat();
+
+  const int block = first / BlockRows;
+  if ((last - 1) / BlockRows == block)
+    return _blocks[size_t(block)].rowRange(first % BlockRows, (last - 1) % BlockRows + 1);
+
+  // spans blocks, rare since they are large
+  cv::Mat m(last - first, _cols, _type);
+  for (int i = first; i < last; ++i)
+    _blocks[size_t(i / BlockRows)].row(i % BlockRows).copyTo(m.row(i - first));
+  return m;
+}
+
+size_t CvFeaturesIndex::Descriptors::memoryUsage() const {
+  size_t bytes = _data.capacity() * sizeof(const uint8_t*);
+  for (const cv::Mat& m : _blocks) bytes += m.total() * m.elemSize();
+  return bytes;
+}
+
+void CvFeaturesIndex::Descriptors::load(const QString& path) {
+  _rows = loadMatrixBlocks(path, BlockRows, _blocks);
+  _cols = _blocks.empty() ? 0 : _blocks[0].cols;
+  _type = _blocks.empty() ? 0 : _blocks[0].type();
+  _data.clear();
+  for (const cv::Mat& m : _blocks) _data.push_back(m.data);
+}
+
+void CvFeaturesIndex::Descriptors::save(const QString& path) const {
+  // only the used rows of the last block
+  std::vector<cv::Mat> used(_blocks);
+  if (!used.empty() && _rows % BlockRows)
+    used.back() = used.back().rowRange(0, _rows % BlockRows);
+  saveMatrixBlocks(used, path);
+}
+
 cv::Mat CvFeaturesIndex::descriptorsForMediaId(uint32_t mediaId) const {
   auto it = _idMap.find(mediaId);
   if (it == _idMap.end()) return cv::Mat();
@@ -429,8 +517,8 @@ cv::Mat CvFeaturesIndex::descriptorsForMediaId(uint32_t mediaId) const {
 
   Q_ASSERT(it->first > mediaId);
   Q_ASSERT(firstRow < lastRow);
-  Q_ASSERT(lastRow <= _descriptors.rows);
-  Q_ASSERT(firstRow < _descriptors.rows);
+  Q_ASSERT(lastRow <= _descriptors.rows());
+  Q_ASSERT(firstRow < _descriptors.rows());
 
   return _descriptors.rowRange(firstRow, lastRow);
 }
@@ -448,12 +536,22 @@ QVector<Index::Match> CvFeaturesIndex::find(const Media& needle, const SearchPar
     return {};
   }
 
-  if (_descriptors.rows <= 0) {
+  if (_descriptors.rows() <= 0) {
     qWarning("empty index");
     return {};
   }
 
-  Q_ASSERT(_index != nullptr); // not possible if we have descriptors
+  if (!_index) {
+    qWarning("index was not built");
+    return {};
+  }
+
+  // needle must have the same layout as the index
+  if (descriptors.type() != _descriptors.type() || descriptors.cols != _descriptors.cols()) {
+    qWarning() << "needle has incompatible descriptors" << needle.id() << needle.path();
+    return {};
+  }
+  if (!descriptors.isContinuous()) descriptors = descriptors.clone();
 
   // if we copied the features from db, we will have
   // a lot more than we need, reduce them while trying
@@ -492,43 +590,37 @@ QVector<Index::Match> CvFeaturesIndex::find(const Media& needle, const SearchPar
 
   // for every descriptor in the needle, find the 10 nearest in the index
   // TODO: how many do we actually have to find (should it be a parameter?)
-  cv::Mat flannIndices;
-  cv::Mat flannDists;
-  _index->knnSearch(descriptors, flannIndices, flannDists, 10);
-
-  for (int i = 0; i < flannIndices.rows; i++)
-    for (int j = 0; j < flannIndices.cols; j++) {
-      int index = flannIndices.at<int>(i, j);
-
-      if (index < 0) {
-        // qWarning("zero index\n");
-        continue;
-      }
+  const int knn = 10;
+  std::vector<OrbLsh::Match> nearest;
+  _index->knnSearch(_descriptors.blocks(), descriptors.ptr<uint8_t>(0),
+                    size_t(descriptors.rows), knn, params.cvThresh, nearest);
 
-      int distance = flannDists.at<int>(i, j);
+  for (const OrbLsh::Match& m : nearest) {
+    // unused slot, or a bad match (distance >= cvThresh)
+    if (m.index == UINT32_MAX) continue;
 
-      // ignore bad matches
-      if (distance >= params.cvThresh) continue;
+    const uint32_t index = m.index;
+    const int distance = m.distance;
 
-      uint32_t mediaId = 0;
-      auto it = _indexMap.upper_bound(uint32_t(index));
-      it--;
-      mediaId = it->second;
+    uint32_t mediaId = 0;
+    auto it = _indexMap.upper_bound(uint32_t(index));
+    it--;
+    mediaId = it->second;
 
-      // we found a deleted/removed item (mediaId == 0)
-      if (!mediaId) continue;
+    // we found a deleted/removed item (mediaId == 0)
+    if (!mediaId) continue;
 
-      auto& match = matches[mediaId];
+    auto& match = matches[mediaId];
 
-      match.count++;
-      match.scores.push_back(distance);
+    match.count++;
+    match.scores.push_back(distance);
 
-      //        match.minScore = std::min(distance, match.minScore);
-      //        match.maxScore = std::max(distance, match.maxScore);
-      //        match.totalScore += distance;
+    //        match.minScore = std::min(distance, match.minScore);
+    //        match.maxScore = std::max(distance, match.maxScore);
+    //        match.totalScore += distance;
 
-      maxMatches = std::max(match.count, maxMatches);
-    }
+    maxMatches = std::max(match.count, maxMatches);
+  }
 
   now = nanoTime();
   uint64_t nsFwd = now - then;
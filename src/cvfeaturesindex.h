@@ -25,9 +25,8 @@
 
 #include "opencv2/core.hpp"
 
-namespace cv::flann {
-class Index;
-}
+class OrbLsh;
+
 /**
  * @class CvFeaturesIndex
  * @brief Index for OpenCV feature descriptors
@@ -52,6 +51,7 @@ class CvFeaturesIndex : public Index {
   bool isLoaded() const override;
   int count() const override;
   size_t memoryUsage() const override;
+  size_t memoryWasted() const override;
 
   void load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) override;
   void save(QSqlDatabase& db, const QString& cachePath) override;
@@ -64,14 +64,50 @@ class CvFeaturesIndex : public Index {
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
  private:
-  void buildIndex(const cv::Mat& addedDescriptors);
+  enum {
+    CompactPercent = 25, // percent of removed descriptors that triggers compact()
+  };
+
+  /// Descriptor rows stored in blocks of fixed size, appending never copies existing rows
+  class Descriptors {
+   public:
+    enum {
+      BlockRows = 65536,  // must be 2^OrbLsh::BlockShift
+    };
+
+    int rows() const { return _rows; }
+    int cols() const { return _cols; }
+    int type() const { return _type; }
+
+    /// Add all rows of m, m must have the same cols and type as other rows
+    void append(const cv::Mat& m);
+
+    /// Rows [first,last), a copy if they are not in the same block
+    cv::Mat rowRange(int first, int last) const;
+
+    /// Address of each block, for OrbLsh
+    const uint8_t* const* blocks() const { return _data.data(); }
+
+    size_t memoryUsage() const;
+
+    void load(const QString& path);
+    void save(const QString& path) const;
+
+   private:
+    std::vector<cv::Mat> _blocks;       // BlockRows rows each, last one is partially used
+    std::vector<const uint8_t*> _data;  // _blocks[i].data
+    int _rows = 0, _cols = 0, _type = 0;
+  };
+
+  void buildIndex(int addedRows);
+  void compact();
   void loadIndex(const QString& path);
   void saveIndex(const QString& path);
 
   cv::Mat descriptorsForMediaId(uint32_t mediaId) const;
 
-  cv::Mat _descriptors;      // all descriptors merged into one fat cv::Mat
-  cv::flann::Index* _index;  // index of the cv::Mat
+  Descriptors _descriptors;  // all descriptors merged into one fat matrix
+  OrbLsh* _index;            // index of the matrix
 
   // map of first descriptor index to media Id, in ascending order,
   // _descriptors.rows,0 as last item
@@ -80,4 +116,6 @@ class CvFeaturesIndex : public Index {
   // map of media id to first _descriptors[] index, in ascending order,
   // UINT32_MAX,_descriptors.rows as last item
   std::map<uint32_t, uint32_t> _idMap;
+
+  int _removedRows; // number of descriptors of removed media
 };
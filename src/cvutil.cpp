@@ -162,6 +162,56 @@ void saveMatrix(const cv::Mat& mat, const QString& path) {
   });
 }
 
+int loadMatrixBlocks(const QString& path, int blockRows, std::vector<cv::Mat>& blocks) {
+  QFile f(path);
+  bool ok = f.open(QFile::ReadOnly);
+  if (!ok) qFatal("open failed: %d: %s", f.error(), qPrintable(f.errorString()));
+
+  MatrixHeader h;
+  qint64 len = f.read(reinterpret_cast<char*>(&h), sizeof(h));
+  if (len != sizeof(h))
+    qFatal("read failed (header): %d: %s", f.error(), qPrintable(f.errorString()));
+
+  blocks.clear();
+  for (int i = 0; i < h.rows; i += blockRows) {
+    cv::Mat block(blockRows, h.cols, h.type);
+    Q_ASSERT(h.stride == block.cols * int(block.elemSize()));
+
+    // blocks are continuous, read all rows at once
+    const int rows = std::min(blockRows, h.rows - i);
+    const qint64 blockLen = qint64(rows) * h.stride;
+    len = f.read(reinterpret_cast<char*>(block.data), blockLen);
+    if (len != blockLen)
+      qFatal("read failed (row): %d: %s", f.error(), qPrintable(f.errorString()));
+
+    blocks.push_back(block);
+  }
+  return h.rows;
+}
+
+void saveMatrixBlocks(const std::vector<cv::Mat>& blocks, const QString& path) {
+  writeFileAtomically(path, [&blocks](QFile& f) {
+    MatrixHeader h{0, 0, 0, 0, 0};
+    for (const cv::Mat& m : blocks) h.rows += m.rows;
+    if (!blocks.empty()) {
+      h.cols = blocks[0].cols;
+      h.type = blocks[0].type();
+      h.stride = h.cols * int(blocks[0].elemSize());
+    }
+
+    qint64 len = f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    if (len != sizeof(h)) throw f.errorString();
+
+    for (const cv::Mat& m : blocks) {
+      Q_ASSERT(m.cols == h.cols && m.type() == h.type);
+      for (int i = 0; i < m.rows; ++i) {
+        len = f.write(m.ptr<char>(i), h.stride);
+        if (len != h.stride) throw f.errorString();
+      }
+    }
+  });
+}
+
 #ifdef ENABLE_HIGHGUI
 void showImage(const cv::Mat& img) {
   const char* title = "showImage";
@@ -164,6 +164,13 @@ void loadMatrix(const QString& path, cv::Mat& mat);
 
 void saveMatrix(const cv::Mat& mat, const QString& path);
 
+// load cv::Mat written by saveMatrix() into blocks of blockRows rows,
+// the last block may be partially used, returns the number of rows
+int loadMatrixBlocks(const QString& path, int blockRows, std::vector<cv::Mat>& blocks);
+
+// save blocks of rows as one cv::Mat for loadMatrix()/loadMatrixBlocks()
+void saveMatrixBlocks(const std::vector<cv::Mat>& blocks, const QString& path);
+
 // bit-exact compare
 bool compare(const cv::Mat& a, const cv::Mat& b);
 
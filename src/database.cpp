@@ -30,6 +30,7 @@
 #include <QtCore/QFileInfo>
 #include <QtCore/QLockFile>
 #include <QtCore/QReadWriteLock>
+#include <QtCore/QThreadPool>
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlError>
 #include <QtSql/QSqlQuery>
@@ -418,6 +419,7 @@ void Database::add(MediaGroup& inMedia) {
       SQL_FATAL(prepare);
 
     QVariantList id, type, relPath, width, height, md5, dctHash;
+    MediaGroup videos;
     for (Media& m : media) {
       m.setId(mediaId);
       mediaId++;
@@ -456,9 +458,13 @@ void Database::add(MediaGroup& inMedia) {
       if (m.type() == Media::TypeVideo && !m.videoIndex().isEmpty()) {
         QString indexPath = QString("%1/%2.vdx").arg(videoPath()).arg(m.id());
         m.videoIndex().save(indexPath);
+        videos.append(m);
       }
     }
 
+    // packed copy of the .vdx files, so loading does not open every one
+    if (!videos.isEmpty()) VideoHashStore::append(videoPath(), videos);
+
     query.bindValue(":id", id);
     query.bindValue(":type", type);
     query.bindValue(":path", relPath);
@@ -640,6 +646,10 @@ void Database::vacuum() {
     qWarning() << "removing orphaned video index" << f;
     if (!QFile(videoPath() + "/" + f).remove()) qWarning() << "failed to remove" << f;
   }
+
+  // drop records of removed videos
+  qInfo("rebuild video hash store");
+  VideoHashStore::rebuild(videoPath());
   // FIXME: remove cache/tmp files as they might contain deleted items
 }
 
@@ -1132,6 +1142,23 @@ size_t Database::memoryUsage() const {
   return sum;
 }
 
+void Database::printStats() {
+  auto toMb = [](size_t bytes) { return bytes / 1024.0 / 1024.0; };
+
+  size_t used = 0, wasted = 0;
+  for (const Index* i : _algos) {
+    SearchParams params;
+    params.algo = i->id();
+    const Index* index = loadIndex(params);
+    qInfo("%-6s %'10d items %9.1f MB %9.1f MB removed", qUtf8Printable(params.toString("alg")),
+          index->count(), toMb(index->memoryUsage()), toMb(index->memoryWasted()));
+    used += index->memoryUsage();
+    wasted += index->memoryWasted();
+  }
+  qInfo("%-6s %'10d items %9.1f MB %9.1f MB removed", "total", count(), toMb(used),
+        toMb(wasted));
+}
+
 int Database::count() {
   QSqlQuery query(connect());
   if (!query.prepare("select count(*) from media")) SQL_FATAL(prepare);
@@ -1394,13 +1421,31 @@ MediaGroupList Database::similar(const SearchParams& params) {
   QSet<int> skip;
   QMutex mutex;
 
+  // all-pairs search in one pass is much faster than a lookup for each needle,
+  // unless the threshold depends on the needle, or there are few needles
+  // compared to the index (e.g. -p.types); the join always covers the whole index
+  QHash<uint32_t, QVector<Index::Match>> joined;
+  bool isJoined = false;
+  if (params.maxThresh <= 0 &&
+      qint64(haystack.count()) * 100 >= qint64(index->count()) * JoinMinPercent) {
+    QReadLocker lock(_rwLock);
+    isJoined = index->findAll(params, joined);
+  }
+
   PROGRESS_LOGGER(pl, "searching:<PL> %percent %step lookups, %1 results", progressTotal);
   pl.showLast();
 
   QFuture<void>
-      f = QtConcurrent::map(haystack, [&idMap, &results, &progress, &resultCount, &tm, &pl,
-                                       progressInterval, params, index, this](const Media& m) {
-        MediaGroup result = this->searchIndex(index, m, params, idMap);
+      f = QtConcurrent::map(haystack, [&idMap, &results, &progress, &resultCount, &tm, &pl, &joined,
+                                       isJoined, progressInterval, params, index,
+                                       this](const Media& m) {
+        MediaGroup result;
+        if (isJoined) {
+          QVector<Index::Match> matches = joined.value(uint32_t(m.id()));
+          QReadLocker locker(_rwLock);
+          result = this->matchGroup(index, m, matches, params, idMap);
+        } else
+          result = this->searchIndex(index, m, params, idMap);
 
         // give each work item a (lockless) way to write results
         int resultIndex = progress.fetchAndAddRelaxed(1);
@@ -1485,8 +1530,16 @@ MediaGroup Database::similarTo(const Media& needle, const SearchParams& params)
     }
   }
 
-  // TODO: multithread search, for *huge* indexes it's an issue
-  MediaGroup result = searchIndex(index, needle, params, idMap);
+  // for huge indexes, search shards in parallel; maxThresh is
+  // left to searchIndex() since it uses findNearest()
+  MediaGroup result;
+  QVector<Index::Match> matches;
+  if (params.maxThresh <= 0 && index->count() >= ShardMinCount &&
+      searchShards(index, needle, params, matches)) {
+    QReadLocker locker(_rwLock);
+    result = matchGroup(index, needle, matches, params, idMap);
+  } else
+    result = searchIndex(index, needle, params, idMap);
 
   delete slice;
 
@@ -1688,6 +1741,35 @@ void Database::saveIndices() {
   }
 }
 
+bool Database::searchShards(Index* index, const Media& needle, const SearchParams& params,
+                            QVector<Index::Match>& matches) {
+  const int numShards = QThreadPool::globalInstance()->maxThreadCount();
+  if (numShards < 2) return false;
+
+  QVector<int> shards;
+  for (int i = 0; i < numShards; ++i) shards.append(i);
+
+  QVector<QVector<Index::Match>> results(numShards);
+  QVector<Index::Match>* shardResults = results.data(); // no detach in the work item
+  QAtomicInt supported(1);
+
+  QReadLocker locker(_rwLock);
+  QtConcurrent::blockingMap(shards, [&](int shard) {
+    if (!index->findShard(needle, params, shard, numShards, shardResults[shard]))
+      supported.storeRelaxed(0);
+  });
+
+  if (!supported.loadRelaxed()) return false;
+
+  matches.clear();
+  for (const auto& r : std::as_const(results)) matches.append(r);
+
+  if (params.verbose)
+    qInfo("%d shards, %lld matches", numShards, matches.count());
+
+  return true;
+}
+
 MediaGroup Database::searchIndex(Index* index, const Media& needle, const SearchParams& params,
                                  const QHash<int, Media>& idMap) {
   // TODO take an in/out parameter to pass back stats from the query
@@ -1697,11 +1779,37 @@ MediaGroup Database::searchIndex(Index* index, const Media& needle, const Search
   // This will make possible an accurate "time per hash" stat on progress line
   QReadLocker locker(_rwLock);
 
-  QVector<Index::Match> matches = index->find(needle, params);
+  // color search has no threshold, and matchGroup() only keeps the best maxMatches,
+  // so the index can skip the rest (+1 since the needle may match itself)
+  QVector<Index::Match> matches;
+  if (index->id() != SearchParams::AlgoColor ||
+      !index->findNearest(needle, params.maxMatches + 1, params, matches))
+    matches = index->find(needle, params);
 
   // increase threshold until is match is found or maxThresh is exceeded
-  if (params.maxThresh > 0) {
+  if (params.maxThresh > 0 && matches.count() <= params.minMatches) {
     SearchParams tmp = params;
+
+    // if supported, one search for the nearest within maxThresh, enough
+    // for minMatches and maxMatches, +1 since the needle may match itself.
+    // The score is the distance, so the loop below would stop at the
+    // threshold that includes match[minMatches], anything further is dropped.
+    // Other algos score each match differently for each threshold, so they
+    // need the loop.
+    if (params.algo == SearchParams::AlgoDCT) {
+      tmp.dctThresh = std::max(params.dctThresh, params.maxThresh);
+      if (index->findNearest(needle, std::max(params.minMatches, params.maxMatches) + 1, tmp,
+                             matches)) {
+        std::sort(matches.begin(), matches.end());
+        if (matches.count() > params.minMatches) {
+          const int maxScore = matches[params.minMatches].score;
+          matches.removeIf([maxScore](const Index::Match& m) { return m.score > maxScore; });
+        }
+        goto DONE;
+      }
+      tmp.dctThresh = params.dctThresh;
+    }
+
     while (matches.count() <= params.minMatches) {
       switch (params.algo) {
         case SearchParams::AlgoDCT:
@@ -1725,6 +1833,12 @@ MediaGroup Database::searchIndex(Index* index, const Media& needle, const Search
   }
 DONE:
 
+  return matchGroup(index, needle, matches, params, idMap);
+}
+
+MediaGroup Database::matchGroup(Index* index, const Media& needle,
+                                QVector<Index::Match>& matches, const SearchParams& params,
+                                const QHash<int, Media>& idMap) {
   // sort by score
   std::sort(matches.begin(), matches.end());
 
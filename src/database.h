@@ -201,6 +201,9 @@ class Database {
   // @return rough estimate of current memory usage (heap)
   size_t memoryUsage() const;
 
+  /// Load every index and log its size and memory usage
+  void printStats();
+
   /**
    * Filter a match with search params
    * @note the group must have the needle prepended
@@ -219,6 +222,18 @@ class Database {
   static void disconnectAll();
 
  private:
+  enum {
+    ShardMinCount = 100000, // index size where similarTo() searches shards in parallel
+    JoinMinPercent = 10,    // haystack size, in percent of the index, where similar() joins
+  };
+
+  /**
+   * Search the needle with multiple threads using Index::findShard()
+   * @return false if the index does not support it
+   */
+  bool searchShards(Index* index, const Media& needle, const SearchParams& params,
+                    QVector<Index::Match>& matches);
+
   /**
    * Thread-safe database connection
    * @return per-thread instance
@@ -246,6 +261,15 @@ class Database {
                          const SearchParams& params,
                          const QHash<int, Media>& idMap);
 
+  /**
+   * @return Media matching needle, from index matches
+   * @note sorts matches by score, the rest is the same as searchIndex()
+   */
+  MediaGroup matchGroup(Index* index, const Media& needle,
+                        QVector<Index::Match>& matches,
+                        const SearchParams& params,
+                        const QHash<int, Media>& idMap);
+
   /// Create database (sql) tables for index id 0, the others use Index interface
   void createTables();
 
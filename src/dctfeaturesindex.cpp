@@ -25,7 +25,9 @@
 #include "qtutil.h"
 #include "tree/hammingtree.h"
 
+#include <QtConcurrent/QtConcurrentRun>
 #include <QtCore/QDateTime>
+#include <QtCore/QThreadStorage>
 
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlError>
@@ -33,6 +35,45 @@
 
 static QString cacheFile(const QString& cachePath) { return cachePath + qq("/dctfeatures.cache"); }
 
+static QString hashesFile(const QString& cachePath) {
+  return cachePath + qq("/dctfeatures.hashes");
+}
+
+// header written to hashes file, the payload is the two array lengths,
+// then _mediaRange[] and _mediaHashes[]
+static QString hashesHeader() {
+  static constexpr int version = 1;
+  return QStringLiteral("cbird dct features hashes:%1:%2:%3")
+      .arg(version)
+      .arg(sizeof(uint64_t))
+      .arg(sizeof(uint64_t) * 2);
+}
+
+namespace {
+/// one needle hash matched a hash of mediaId
+struct Vote {
+  uint32_t mediaId;
+  int distance;
+  bool operator<(const Vote& other) const { return mediaId < other.mediaId; }
+};
+
+/// votes reduced by mediaId
+struct Tally {
+  uint32_t mediaId;
+  uint32_t count;
+  int distance; // sum of vote distances
+};
+
+/// find() scratch space, reused by each search thread so it doesn't allocate
+struct FindBuffers {
+  std::vector<HammingTree::Match> candidates;
+  std::vector<Vote> votes;
+  std::vector<Tally> tallies;
+};
+} // namespace
+
+static QThreadStorage<FindBuffers> findBuffers;
+
 DctFeaturesIndex::DctFeaturesIndex() { init(); }
 
 DctFeaturesIndex::~DctFeaturesIndex() { unload(); }
@@ -81,16 +122,146 @@ void DctFeaturesIndex::removeRecords(QSqlDatabase& db, const QVector<int>& media
 void DctFeaturesIndex::init() {
   _id = SearchParams::AlgoDCTFeatures;
   _tree = nullptr;
+  _numRemovedHashes = 0;
 }
 
 void DctFeaturesIndex::unload() {
   delete _tree;
+  _mediaHashes.clear();
+  _mediaHashes.shrink_to_fit();
+  _mediaRange.clear();
+  _mediaRange.shrink_to_fit();
   init();
 }
 
 int DctFeaturesIndex::count() const { return _tree ? int(_tree->size()) : 0; }
 
-size_t DctFeaturesIndex::memoryUsage() const { return _tree ? _tree->stats().memory : 0; }
+size_t DctFeaturesIndex::memoryUsage() const {
+  if (!_tree) return 0;
+  return _tree->stats().memory + VECTOR_SIZE(_mediaHashes) + VECTOR_SIZE(_mediaRange);
+}
+
+size_t DctFeaturesIndex::memoryWasted() const {
+  return sizeof(uint64_t) * _numRemovedHashes;
+}
+
+void DctFeaturesIndex::addMediaHashes(uint32_t mediaId, const uint64_t* hashes, size_t count) {
+  removeMediaHashes(mediaId);
+  if (count <= 0) return;
+
+  if (mediaId >= _mediaRange.size()) _mediaRange.resize(mediaId + 1, HashRange{0, 0});
+  _mediaRange[mediaId] = HashRange{_mediaHashes.size(), count};
+  _mediaHashes.insert(_mediaHashes.end(), hashes, hashes + count);
+}
+
+void DctFeaturesIndex::removeMediaHashes(uint32_t mediaId) {
+  if (mediaId >= _mediaRange.size() || _mediaRange[mediaId].count <= 0) return;
+
+  _numRemovedHashes += _mediaRange[mediaId].count;
+  _mediaRange[mediaId] = HashRange{0, 0};
+
+  if (_numRemovedHashes * 100 >= _mediaHashes.size() * CompactPercent) compactMediaHashes();
+}
+
+void DctFeaturesIndex::compactMediaHashes() {
+  // ranges are in insertion order, not id order, so copy to a new array
+  std::vector<uint64_t> hashes;
+  hashes.reserve(_mediaHashes.size() - _numRemovedHashes);
+  for (HashRange& r : _mediaRange)
+    if (r.count > 0) {
+      const uint64_t offset = hashes.size();
+      const auto first = _mediaHashes.begin() + ptrdiff_t(r.offset);
+      hashes.insert(hashes.end(), first, first + ptrdiff_t(r.count));
+      r.offset = offset;
+    }
+
+  qDebug("removed %d hashes, %d remaining", int(_numRemovedHashes), int(hashes.size()));
+
+  _mediaHashes.swap(hashes);
+  _numRemovedHashes = 0;
+
+  while (_mediaRange.size() > 0 && _mediaRange.back().count <= 0) _mediaRange.pop_back();
+  _mediaRange.shrink_to_fit();
+}
+
+void DctFeaturesIndex::buildMediaHashes() {
+  // one pass over the tree, then counting sort by media id
+  std::vector<uint64_t> hashes;
+  std::vector<uint32_t> ids;
+  _tree->findIf([](uint32_t id, uint64_t) { return id != 0; }, &hashes, &ids);
+
+  uint32_t maxId = 0;
+  for (uint32_t id : ids) maxId = std::max(maxId, id);
+
+  _mediaRange.assign(ids.size() > 0 ? maxId + 1 : 0, HashRange{0, 0});
+  for (uint32_t id : ids) _mediaRange[id].count++;
+
+  uint64_t offset = 0;
+  for (HashRange& r : _mediaRange) {
+    r.offset = offset;
+    offset += r.count;
+  }
+
+  _mediaHashes.resize(hashes.size());
+  _mediaHashes.shrink_to_fit();
+  std::vector<uint64_t> next(_mediaRange.size());
+  for (size_t i = 0; i < next.size(); ++i) next[i] = _mediaRange[i].offset;
+  for (size_t i = 0; i < ids.size(); ++i) _mediaHashes[next[ids[i]]++] = hashes[i];
+
+  _numRemovedHashes = 0;
+}
+
+bool DctFeaturesIndex::loadMediaHashes(const QString& path) {
+  QFile f(path);
+  qint64 len = 0;
+  const uchar* ptr = mapCacheFile(f, hashesHeader(), &len);
+
+  uint64_t size[2] = {0, 0};
+  bool ok = ptr && size_t(len) >= sizeof(size);
+  if (ok) {
+    memcpy(size, ptr, sizeof(size));
+    ok = size[0] < UINT32_MAX && size[1] < (uint64_t(1) << 40) &&
+         uint64_t(len) == sizeof(size) + size[0] * sizeof(HashRange) + size[1] * sizeof(uint64_t);
+  }
+
+  if (ok) {
+    const auto* ranges = reinterpret_cast<const HashRange*>(ptr + sizeof(size));
+    const auto* hashes = reinterpret_cast<const uint64_t*>(ranges + size[0]);
+    _mediaRange.assign(ranges, ranges + size[0]);
+    _mediaHashes.assign(hashes, hashes + size[1]);
+
+    // every range must be in bounds, then find() can't crash
+    for (const HashRange& r : _mediaRange)
+      if (r.offset > size[1] || r.count > size[1] - r.offset) ok = false;
+  }
+
+  if (!ok) {
+    qWarning() << "invalid cache file, removing" << path;
+    if (!f.remove()) qWarning() << "failed to remove cache file:" << f.errorString();
+    _mediaRange.clear();
+    _mediaHashes.clear();
+  }
+  _numRemovedHashes = 0;
+  return ok;
+}
+
+void DctFeaturesIndex::saveMediaHashes(const QString& path) {
+  // no reason to keep removed items in the cache
+  if (_numRemovedHashes > 0) compactMediaHashes();
+
+  writeFileAtomically(path, [this](QFile& f) {
+    writeCacheHeader(f, hashesHeader());
+    const uint64_t size[2] = {_mediaRange.size(), _mediaHashes.size()};
+    qint64 len = qint64(sizeof(size));
+    if (len != f.write(reinterpret_cast<const char*>(size), len)) throw f.errorString();
+    len = qint64(sizeof(HashRange) * _mediaRange.size());
+    if (len != f.write(reinterpret_cast<const char*>(_mediaRange.data()), len))
+      throw f.errorString();
+    len = qint64(sizeof(uint64_t) * _mediaHashes.size());
+    if (len != f.write(reinterpret_cast<const char*>(_mediaHashes.data()), len))
+      throw f.errorString();
+  });
+}
 
 bool DctFeaturesIndex::isLoaded() const { return _tree != nullptr; }
 
@@ -108,22 +279,25 @@ void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QS
 
     bool invalid = false;
     if (!stale) {
-      qInfo("reading cache file");
-      invalid = true;
-      QFile f(path);
-      if (!f.open(QFile::ReadOnly))
-        qWarning() << "open failed" << path << f.errorString();
-      else if (!_tree->read(f))
-        qWarning() << "read cache failed" << path << f.errorString();
-      else
-        invalid = false;
+      qInfo("mapping cache file");
+      invalid = !_tree->map(path);
 
       if (invalid) {
         qWarning() << "invalid cache file, removing" << path;
+        QFile f(path);
         if (!f.remove()) qWarning() << "failed to remove cache file:" << f.errorString();
       }
     }
 
+    if (!stale && !invalid) {
+      const QString hpath = hashesFile(cachePath);
+      if (DBHelper::isCacheFileStale(db, hpath) || !loadMediaHashes(hpath)) {
+        qInfo("rebuilding media hashes");
+        buildMediaHashes();
+        saveMediaHashes(hpath);
+      }
+    }
+
     if (stale || invalid) {
       QSqlQuery query(db);
       query.setForwardOnly(true);
@@ -136,6 +310,16 @@ void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QS
       const int minChunkSize = 100000;       // TODO: this size seems to have some small effect
       size_t currentRow = 0;
 
+      // insert the previous chunk while reading the next one, in order, so the
+      // tree is the same as inserting each chunk serially
+      QFuture<void> building;
+      auto insertChunk = [this, &building](std::vector<HammingTree::Value>&& values) {
+        building.waitForFinished();
+        building = QtConcurrent::run([this, values = std::move(values)]() mutable {
+          _tree->insertConcurrent(values);
+        });
+      };
+
       if (!query.exec("select media_id,hashes from kphash")) SQL_FATAL(exec);
 
       while (query.next()) {
@@ -153,23 +337,26 @@ void DctFeaturesIndex::load(QSqlDatabase& db, const QString& cachePath, const QS
         for (int j = 0; j < len; ++j)
           chunk.push_back(HammingTree::Value(mediaId, ptr[j]));
 
+        addMediaHashes(mediaId, ptr, size_t(len));
+
         if (chunk.size() >= minChunkSize) {
-          _tree->insert(chunk);
-          chunk.clear();  // no reallocation
+          insertChunk(std::move(chunk));
+          chunk = std::vector<HammingTree::Value>();
+          chunk.reserve(minChunkSize);
         }
         pl.stepRateLimited(currentRow++);
       }
       pl.end();
-      _tree->insert(chunk);
-      chunk.clear();
+      insertChunk(std::move(chunk));
+      building.waitForFinished();
       save(db, cachePath);
     }
 
     HammingTree::Stats stats = _tree->stats();
 
-    qInfo("%dKhash, height=%d nodes=%d %dMB %dms", stats.numValues / 1000, stats.maxHeight,
-          stats.numNodes, int(stats.memory / 1000000),
-          int(QDateTime::currentMSecsSinceEpoch() - then));
+    qInfo("%dKhash, height=%d nodes=%d %dMB (%dMB mapped) %dms", stats.numValues / 1000,
+          stats.maxHeight, stats.numNodes, int(stats.memory / 1000000),
+          int(stats.mapped / 1000000), int(QDateTime::currentMSecsSinceEpoch() - then));
   }
 }
 
@@ -178,10 +365,16 @@ void DctFeaturesIndex::save(QSqlDatabase& db, const QString& cachePath) {
 
   const QString path = cacheFile(cachePath);
 
-  if (!DBHelper::isCacheFileStale(db, path)) return;
+  if (DBHelper::isCacheFileStale(db, path)) {
+    // if we are mapped, the file is about to be replaced
+    _tree->detach();
+
+    qInfo() << "writing cache file";
+    writeFileAtomically(path, [this](QFile& f) { _tree->write(f); });
+  }
 
-  qInfo() << "writing cache file";
-  writeFileAtomically(path, [this](QFile& f) { _tree->write(f); });
+  const QString hpath = hashesFile(cachePath);
+  if (DBHelper::isCacheFileStale(db, hpath)) saveMediaHashes(hpath);
 }
 
 QSet<mediaid_t> DctFeaturesIndex::mediaIds(QSqlDatabase& db,
@@ -219,9 +412,12 @@ void DctFeaturesIndex::add(const MediaGroup& media) {
   if (media.count() <= 0) return;
 
   std::vector<HammingTree::Value> values;
-  for (const Media& m : media)
-    for (uint64_t hash : m.keyPointHashes())
+  for (const Media& m : media) {
+    const KeyPointHashList& hashes = m.keyPointHashes();
+    for (uint64_t hash : hashes)
       values.push_back(HammingTree::Value(m.id(), hash));
+    addMediaHashes(uint32_t(m.id()), hashes.data(), hashes.size());
+  }
 
   _tree->insert(values);
 }
@@ -230,8 +426,10 @@ void DctFeaturesIndex::remove(const QVector<int>& ids) {
   if (ids.count() <= 0 || !isLoaded()) return;
 
   std::unordered_set<HammingTree::index_t> indices;
-  for (int id : ids)
+  for (int id : ids) {
     indices.insert(uint32_t(id));
+    removeMediaHashes(uint32_t(id));
+  }
 
   _tree->remove(indices);
 }
@@ -248,6 +446,11 @@ Index* DctFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
 
   chunk->_tree = _tree->slice(ids);
 
+  for (uint32_t id : ids)
+    if (id < _mediaRange.size() && _mediaRange[id].count > 0)
+      chunk->addMediaHashes(id, _mediaHashes.data() + _mediaRange[id].offset,
+                            _mediaRange[id].count);
+
   HammingTree::Stats stats = chunk->_tree->stats();
 
   qDebug("%dKhash, height=%d nodes=%d %dMB %dms", stats.numValues / 1000, stats.maxHeight,
@@ -258,7 +461,13 @@ Index* DctFeaturesIndex::slice(const QSet<uint32_t>& mediaIds) const {
 }
 
 QVector<Index::Match> DctFeaturesIndex::find(const Media& needle, const SearchParams& params) {
-  KeyPointHashList hashes = needle.keyPointHashes();
+  FindBuffers& buf = findBuffers.localData();
+  std::vector<HammingTree::Match>& cand = buf.candidates;
+  std::vector<Vote>& votes = buf.votes;
+  std::vector<Tally>& tallies = buf.tallies;
+
+  const uint64_t* hashes = needle.keyPointHashes().data();
+  int numNeedleHashes = int(needle.keyPointHashes().size());
 
   //
   // for each needle hash
@@ -267,92 +476,89 @@ QVector<Index::Match> DctFeaturesIndex::find(const Media& needle, const SearchPa
   //
   uint64_t now, then = nanoTime();
 
-  if (hashes.size() <= 0) {
+  if (numNeedleHashes <= 0) {
     // if we don't have hashes for the needle,
-    // we can get them from tree
-    if (needle.id() > 0) {
-      // FIXME: this is not great as it touches every index in the tree
-      _tree->findIndex(needle.id(), hashes);
+    // we can get them from the side table
+    const uint32_t id = uint32_t(needle.id());
+    if (needle.id() > 0 && id < _mediaRange.size()) {
+      hashes = _mediaHashes.data() + _mediaRange[id].offset;
+      numNeedleHashes = int(_mediaRange[id].count);
     }
 
-    if (hashes.size() <= 0) {
+    if (numNeedleHashes <= 0) {
       qWarning() << "needle has no hashes" << needle.id() << needle.path();
       return QVector<Index::Match>();
     }
   }
 
-  const int numNeedleHashes = hashes.size();
-  std::vector<dcthash_t> nHash;
-  for (int j = 0; j < numNeedleHashes; j++)
-    nHash.push_back(hashes[j]);
+  votes.clear();
+  tallies.clear();
 
   // TODO: investigate if it may be possible to prune the search
   // - if a hash has no matches, nearby hashes probably also have no matches
-  std::vector<std::vector<HammingTree::Match> > cand(numNeedleHashes);
-  for (int j = 0; j < numNeedleHashes; j++)
-    _tree->search(nHash[j], params.dctThresh, cand[j]);
-
-  QMap<uint32_t, uint32_t> matches; // map
-  QMap<uint32_t, int> scores;
-  uint32_t maxMatches = 0;
-
   for (int j = 0; j < numNeedleHashes; j++) {
+    cand.clear();
+    _tree->search(hashes[j], params.dctThresh, cand);
+
     // take the first 10, which gives us the 10 best matches
-    int len = std::min(10, (int) cand[j].size());
+    int len = std::min(10, (int) cand.size());
     for (int k = 0; k < len; k++) {
-      const HammingTree::Match& match = cand[j][k];
+      const HammingTree::Match& match = cand[size_t(k)];
       int index = match.value.index;
 
       // zero index means deleted, negative must be bogus
       if (index <= 0) continue;
 
-      uint64_t hash = match.value.hash;
-      Q_ASSERT(hamm64(hash, nHash[j]) < params.dctThresh);
+      Q_ASSERT(hamm64(match.value.hash, hashes[j]) < params.dctThresh);
 
-      int mediaId = index;
+      votes.push_back(Vote{uint32_t(index), match.distance});
+    }
+  }
 
-      if (matches.contains(mediaId)) {
-        matches[mediaId]++;
-        scores[mediaId] += match.distance;
-      } else {
-        matches[mediaId] = 1;
-        scores[mediaId] = match.distance;
-      }
+  // sort and reduce, results come out in mediaId order
+  std::sort(votes.begin(), votes.end());
 
-      if (needle.id() != mediaId) maxMatches = std::max(matches[mediaId], maxMatches);
+  uint32_t maxMatches = 0;
+  for (size_t i = 0; i < votes.size();) {
+    Tally t{votes[i].mediaId, 0, 0};
+    for (; i < votes.size() && votes[i].mediaId == t.mediaId; ++i) {
+      t.count++;
+      t.distance += votes[i].distance;
     }
+    if (t.mediaId != uint32_t(needle.id())) maxMatches = std::max(t.count, maxMatches);
+    tallies.push_back(t);
   }
 
   now = nanoTime();
   if (params.verbose)
-    qInfo("%d features, %lld results, %.1f ms rate=%.1f Mhash/sec", numNeedleHashes,
-          matches.count(), (now - then) / 1000000.0,
+    qInfo("%d features, %d results, %.1f ms rate=%.1f Mhash/sec", numNeedleHashes,
+          int(tallies.size()), (now - then) / 1000000.0,
           (_tree->size() * numNeedleHashes) / ((now - then) / 1000.0));
 
   QVector<Index::Match> results;
-
-  for (uint32_t mediaId : matches.keys())
-    if (matches[mediaId] > 0) {
-      Index::Match match;
-      match.mediaId = mediaId;
-      match.score = 0;
-
-      float avgScore = (float) scores[mediaId] / matches[mediaId];
-
-      // qDebug("score=%.2f matches=%d maxMatches=%d", avgScore, matches[mediaId], maxMatches);
-      if (mediaId == uint32_t(needle.id()))
-        match.score = -1;
-      else if (maxMatches == 1) {
-        // only one match, use the avg score
-        match.score = 10 * avgScore;
-      } else {
-        // more matches gets lower score
-        // quality of each match is controlled by params.dctThresh
-        match.score = maxMatches - matches[mediaId];
-      }
-
-      results.append(match);
+  results.reserve(int(tallies.size()));
+
+  for (const Tally& t : tallies) {
+    Index::Match match;
+    match.mediaId = t.mediaId;
+    match.score = 0;
+
+    float avgScore = (float) t.distance / t.count;
+
+    // qDebug("score=%.2f matches=%d maxMatches=%d", avgScore, t.count, maxMatches);
+    if (t.mediaId == uint32_t(needle.id()))
+      match.score = -1;
+    else if (maxMatches == 1) {
+      // only one match, use the avg score
+      match.score = 10 * avgScore;
+    } else {
+      // more matches gets lower score
+      // quality of each match is controlled by params.dctThresh
+      match.score = maxMatches - t.count;
     }
 
+    results.append(match);
+  }
+
   return results;
 }
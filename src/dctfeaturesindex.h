@@ -48,6 +48,7 @@ class DctFeaturesIndex : public Index {
   int count() const override;
   bool isLoaded() const override;
   size_t memoryUsage() const override;
+  size_t memoryWasted() const override;
 
   void load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) override;
   void save(QSqlDatabase& db, const QString& cachePath) override;
@@ -66,5 +67,26 @@ class DctFeaturesIndex : public Index {
  private:
   void init();
   void unload();
+
+  // side table of each media's hashes, since the tree can't look them up by id
+  void addMediaHashes(uint32_t mediaId, const uint64_t* hashes, size_t count);
+  void removeMediaHashes(uint32_t mediaId);
+  void compactMediaHashes();
+  void buildMediaHashes();
+  bool loadMediaHashes(const QString& path);
+  void saveMediaHashes(const QString& path);
+
+  enum {
+    CompactPercent = 10, // compact side table when this % of hashes are removed
+  };
+
+  struct HashRange {
+    uint64_t offset; // first hash in _mediaHashes
+    uint64_t count;  // 0 if the media id is not present
+  };
+
   HammingTree* _tree;
+  std::vector<uint64_t> _mediaHashes; // hashes grouped by media id
+  std::vector<HashRange> _mediaRange; // indexed by media id
+  size_t _numRemovedHashes;
 };
@@ -20,6 +20,8 @@
    <https://www.gnu.org/licenses/>.  */
 #include "dcthashindex.h"
 
+#include "env.h"
+#include "ioutil.h"
 #include "qtutil.h"
 #include "tree/dcttree.h"
 
@@ -27,6 +29,17 @@
 #include <QtSql/QSqlError>
 #include <QtSql/QSqlQuery>
 
+static QString cacheFile(const QString& cachePath) { return cachePath + qq("/dcthash.cache"); }
+
+// header written to cache file, the payload is hashes[] then mediaId[]
+static QString cacheHeader() {
+  static constexpr int version = 1;
+  return QStringLiteral("cbird dct hash index:%1:%2:%3")
+      .arg(version)
+      .arg(sizeof(uint64_t))
+      .arg(sizeof(uint32_t));
+}
+
 DctHashIndex::DctHashIndex() {
   _id = SearchParams::AlgoDCT;
   init();
@@ -36,8 +49,10 @@ void DctHashIndex::init() {
   _hashes = nullptr;
   _mediaId = nullptr;
   _numHashes = 0;
+  _numRemoved = 0;
   _isLoaded = false;
   _tree = nullptr;
+  _mapped = nullptr;
 }
 
 DctHashIndex::~DctHashIndex() { unload(); }
@@ -47,15 +62,97 @@ void DctHashIndex::unload() {
   // usage could be huge, we could use the savings,
   // plus realloc() is super cheap in case QVector
   // doesn't use it (which would be dumb)
-  free(_hashes);
-  free(_mediaId);
+  if (_mapped)
+    delete _mapped; // also unmaps
+  else {
+    free(_hashes);
+    free(_mediaId);
+  }
   delete _tree;
   init();
 }
 
+void DctHashIndex::detach() {
+  // arrays are about to be resized, move them off of the cache file
+  if (!_mapped) return;
+
+  uint64_t* hashes = strict_malloc(hashes, _numHashes);
+  uint32_t* mediaId = strict_malloc(mediaId, _numHashes);
+  memcpy(hashes, _hashes, sizeof(*hashes) * size_t(_numHashes));
+  memcpy(mediaId, _mediaId, sizeof(*mediaId) * size_t(_numHashes));
+
+  delete _mapped;
+  _mapped = nullptr;
+  _hashes = hashes;
+  _mediaId = mediaId;
+}
+
+bool DctHashIndex::loadCache(const QString& path) {
+  auto* f = new QFile(path);
+  qint64 len = 0;
+  uchar* ptr = mapCacheFile(*f, cacheHeader(), &len);
+
+  const size_t itemSize = sizeof(*_hashes) + sizeof(*_mediaId);
+  if (!ptr || len % itemSize != 0 || size_t(len) / itemSize > INT_MAX) {
+    qWarning() << "invalid cache file, removing" << path;
+    if (!f->remove()) qWarning() << "failed to remove cache file:" << f->errorString();
+    delete f;
+    return false;
+  }
+
+  _mapped = f;
+  _numHashes = int(size_t(len) / itemSize);
+  _hashes = reinterpret_cast<uint64_t*>(ptr);
+  _mediaId = reinterpret_cast<uint32_t*>(ptr + sizeof(*_hashes) * size_t(_numHashes));
+
+  _numRemoved = 0;
+  for (int i = 0; i < _numHashes; ++i)
+    if (_mediaId[i] == 0) _numRemoved++;
+
+  return true;
+}
+
+void DctHashIndex::compact() {
+  // the tree has its own tombstones, it does not depend on the array positions
+  detach();
+
+  int j = 0;
+  for (int i = 0; i < _numHashes; ++i)
+    if (_mediaId[i]) {
+      _hashes[j] = _hashes[i];
+      _mediaId[j] = _mediaId[i];
+      j++;
+    }
+
+  qDebug("removed %d items, %d remaining", _numHashes - j, j);
+
+  _numHashes = j;
+  _numRemoved = 0;
+  if (_numHashes > 0) {
+    _hashes = strict_realloc(_hashes, _numHashes);
+    _mediaId = strict_realloc(_mediaId, _numHashes);
+  } else {
+    free(_hashes);
+    free(_mediaId);
+    _hashes = nullptr;
+    _mediaId = nullptr;
+  }
+}
+
 size_t DctHashIndex::memoryUsage() const {
-  // TODO: tree->memoryUsage
-  return (sizeof(*_hashes) + sizeof(*_mediaId)) * size_t(_numHashes);
+  size_t bytes = 0;
+  if (_mapped) // pages of the cache file, malloc_size() is only for the heap
+    bytes += (sizeof(*_hashes) + sizeof(*_mediaId)) * size_t(_numHashes);
+  else {
+    if (_hashes) bytes += malloc_size(_hashes);
+    if (_mediaId) bytes += malloc_size(_mediaId);
+  }
+  if (_tree) bytes += _tree->memoryUsage();
+  return bytes;
+}
+
+size_t DctHashIndex::memoryWasted() const {
+  return (sizeof(*_hashes) + sizeof(*_mediaId)) * size_t(_numRemoved);
 }
 
 void DctHashIndex::buildTree() {
@@ -68,8 +165,6 @@ void DctHashIndex::buildTree() {
 }
 
 void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
-  // hashes are always loaded from database, no caching
-  (void)cachePath;
   (void)dataPath;
 
   if (!isLoaded()) {
@@ -77,6 +172,12 @@ void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QStrin
 
     _isLoaded = true;
 
+    const QString path = cacheFile(cachePath);
+    if (!DBHelper::isCacheFileStale(db, path) && loadCache(path)) {
+      buildTree();
+      return;
+    }
+
     QSqlQuery query(db);
     query.setForwardOnly(true);
 
@@ -110,13 +211,32 @@ void DctHashIndex::load(QSqlDatabase& db, const QString& cachePath, const QStrin
     buildTree();
 
     pl.end();
+
+    save(db, cachePath);
   }
 }
 
 void DctHashIndex::save(QSqlDatabase& db, const QString& cachePath) {
-  (void)db;
-  (void)cachePath;
-  // TODO: _tree->save()
+  if (!isLoaded()) return;
+
+  const QString path = cacheFile(cachePath);
+
+  if (!DBHelper::isCacheFileStale(db, path)) return;
+
+  // if we are mapped, the file is about to be replaced
+  detach();
+
+  // no reason to keep removed items in the cache
+  if (_numRemoved > 0) compact();
+
+  qInfo() << "writing cache file";
+  writeFileAtomically(path, [this](QFile& f) {
+    writeCacheHeader(f, cacheHeader());
+    qint64 len = qint64(sizeof(*_hashes)) * _numHashes;
+    if (len != f.write(reinterpret_cast<const char*>(_hashes), len)) throw f.errorString();
+    len = qint64(sizeof(*_mediaId)) * _numHashes;
+    if (len != f.write(reinterpret_cast<const char*>(_mediaId), len)) throw f.errorString();
+  });
 }
 
 QSet<mediaid_t> DctHashIndex::mediaIds(QSqlDatabase& db,
@@ -156,6 +276,8 @@ QSet<mediaid_t> DctHashIndex::mediaIds(QSqlDatabase& db,
 }
 
 void DctHashIndex::add(const MediaGroup& media) {
+  detach();
+
   int end = _numHashes;
   _numHashes += media.count();
 
@@ -168,26 +290,60 @@ void DctHashIndex::add(const MediaGroup& media) {
     _mediaId[i + end] = uint32_t(m.id());
   }
 
-  // TODO: _tree->insert(media);
-  buildTree();
+  // rebuild is expensive, add to the tree until enough has changed
+  if (_tree) {
+    _tree->insert(_hashes + end, _mediaId + end, media.count());
+    if (_tree->needsRebuild()) buildTree();
+  } else
+    buildTree();
 }
 
 void DctHashIndex::remove(const QVector<int>& removed) {
   if (!isLoaded()) return;
 
-  // rather than realloc the index, nullify the removed items
-  // TODO: track the amount of wasted space and compact at some point
+  // rather than realloc the index, nullify the removed items,
+  // and compact when enough of it is wasted
   QSet<int> ids;
   for (int id : removed) ids.insert(id);
 
   for (int i = 0; i < _numHashes; i++)
-    if (ids.contains(int(_mediaId[i]))) {
+    if (_mediaId[i] && ids.contains(int(_mediaId[i]))) {
       _mediaId[i] = 0;
       _hashes[i] = 0;
+      _numRemoved++;
     }
 
-  // TODO: _tree->remove()
-  buildTree();
+  if (_numRemoved > 0 && _numRemoved * 100LL >= _numHashes * qint64(CompactPercent)) compact();
+
+  if (_tree) {
+    _tree->remove(ids);
+    if (_tree->needsRebuild()) buildTree();
+  }
+}
+
+bool DctHashIndex::useBruteForce(int threshold) const {
+  // vp-tree pruning falls off quickly as the threshold increases, at some point
+  // it visits most of the tree and a linear scan of the hashes is faster and
+  // more predictable. The scan also wins on small indexes. The SIMD kernels
+  // are 8-10x faster than scalar so they win much sooner.
+  // Measured with 1k-4M clustered random hashes.
+  struct Cutoff {
+    const char* kernel;
+    int threshold; // dctThresh where linear scan beats the tree
+    int size;      // index size where linear scan beats the tree
+  };
+  static constexpr Cutoff cutoffs[] = {
+      {"avx512", 6, 32768},
+      {"avx2", 7, 16384},
+      {"scalar", 12, 1024},
+  };
+
+  const char* kernel = hamm64ScanKernel();
+  const Cutoff* cutoff = &cutoffs[std::size(cutoffs) - 1];
+  for (const Cutoff& c : cutoffs)
+    if (strcmp(c.kernel, kernel) == 0) cutoff = &c;
+
+  return threshold >= cutoff->threshold || _numHashes < cutoff->size;
 }
 
 QVector<Index::Match> DctHashIndex::find(const Media& m, const SearchParams& p) {
@@ -199,26 +355,140 @@ QVector<Index::Match> DctHashIndex::find(const Media& m, const SearchParams& p)
     return results;
   }
 
-  if (!_tree) {
+  if (_numHashes <= 0) {
     qWarning() << "empty/null tree";
     return results;
   }
-// TODO: maybe use brute if threshold is high
-#if 1
-  results = _tree->search(target, p.dctThresh);
-#else
-  // brute-force search is often fast enough
-  for (int i = 0; i < _numHashes; i++) {
-    int score = hamm64(target, _hashes[i]);
-    if (score < p.dctThresh) {
-      uint32_t id = _mediaId[i];
-      if (id != 0) results.append(Index::Match(id, score));
+
+  const bool bruteForce = useBruteForce(p.dctThresh);
+
+  if (!bruteForce && _tree)
+    results = _tree->search(target, p.dctThresh);
+  else {
+    std::vector<HammScanMatch> matches;
+    hamm64Scan(target, _hashes, size_t(_numHashes), p.dctThresh, matches);
+    for (const auto& match : matches) {
+      uint32_t id = _mediaId[match.index];
+      if (id != 0) results.append(Index::Match(id, match.distance));
     }
   }
-#endif
+
+  if (p.verbose)
+    qInfo("thresh=%d haystack=%d match=%lld method=%s", p.dctThresh, _numHashes,
+          results.count(), bruteForce ? hamm64ScanKernel() : "tree");
+
   return results;
 }
 
+bool DctHashIndex::findShard(const Media& m, const SearchParams& p, int shard, int numShards,
+                             QVector<Index::Match>& results) {
+  results.clear();
+
+  uint64_t target = m.dctHash();
+  if (!target || _numHashes <= 0) return true;  // find() warns about this
+
+  // same planner as find(), each shard scans a chunk or searches some subtrees
+  const bool bruteForce = useBruteForce(p.dctThresh);
+
+  if (!bruteForce && _tree)
+    results = _tree->search(target, p.dctThresh, shard, numShards);
+  else {
+    const size_t begin = size_t(_numHashes) * size_t(shard) / size_t(numShards);
+    const size_t end = size_t(_numHashes) * size_t(shard + 1) / size_t(numShards);
+
+    std::vector<HammScanMatch> matches;
+    hamm64Scan(target, _hashes + begin, end - begin, p.dctThresh, matches);
+    for (const auto& match : matches) {
+      uint32_t id = _mediaId[begin + match.index];
+      if (id != 0) results.append(Index::Match(id, match.distance));
+    }
+  }
+
+  return true;
+}
+
+bool DctHashIndex::findNearest(const Media& m, int k, const SearchParams& p,
+                               QVector<Index::Match>& results) {
+  results.clear();
+
+  uint64_t target = m.dctHash();
+  if (!target) {
+    qWarning() << "no hash for needle:" << m.path();
+    return true;
+  }
+
+  if (_numHashes <= 0) {
+    qWarning() << "empty/null tree";
+    return true;
+  }
+
+  // same planner as find(), the search radius is the threshold
+  const bool bruteForce = useBruteForce(p.dctThresh);
+
+  if (!bruteForce && _tree)
+    results = _tree->nearest(target, k, p.dctThresh);
+  else {
+    std::vector<HammScanMatch> matches;
+    hamm64Scan(target, _hashes, size_t(_numHashes), p.dctThresh, matches);
+    for (const auto& match : matches) {
+      uint32_t id = _mediaId[match.index];
+      if (id != 0) results.append(Index::Match(id, match.distance));
+    }
+    keepNearest(results, k);
+  }
+
+  if (p.verbose)
+    qInfo("k=%d radius=%d haystack=%d match=%lld method=%s", k, p.dctThresh, _numHashes,
+          results.count(), bruteForce ? hamm64ScanKernel() : "tree");
+
+  return true;
+}
+
+bool DctHashIndex::findAll(const SearchParams& p,
+                           QHash<uint32_t, QVector<Index::Match>>& matches) {
+  QElapsedTimer timer;
+  timer.start();
+
+  // removed items cannot match, same as find(). A zero hash is in the
+  // haystack of find() too, but as a needle it has no results
+  std::vector<uint64_t> hashes;
+  std::vector<uint32_t> ids;
+  QSet<uint32_t> noHash;
+  hashes.reserve(size_t(_numHashes));
+  ids.reserve(size_t(_numHashes));
+  for (int i = 0; i < _numHashes; ++i)
+    if (_mediaId[i]) {
+      hashes.push_back(_hashes[i]);
+      ids.push_back(_mediaId[i]);
+      if (!_hashes[i]) noHash.insert(_mediaId[i]);
+    }
+
+  // similar() has no progress of its own until the join is done
+  PROGRESS_LOGGER(pl, "joining:<PL> %percent %step hashes", hashes.size());
+  std::vector<HammJoinPair> pairs;
+  hamm64Join(hashes.data(), ids.data(), hashes.size(), p.dctThresh, pairs,
+             [&pl, &hashes](size_t done, size_t total) {
+               pl.step(done * hashes.size() / total);
+             });
+  pl.end();
+
+  // find() would also return the needle itself
+  if (!p.filterSelf)
+    for (size_t i = 0; i < ids.size(); ++i)
+      if (hashes[i]) matches[ids[i]].append(Index::Match(ids[i], 0));
+
+  for (const auto& pair : pairs) {
+    if (!noHash.contains(pair.a)) matches[pair.a].append(Index::Match(pair.b, pair.distance));
+    if (!noHash.contains(pair.b)) matches[pair.b].append(Index::Match(pair.a, pair.distance));
+  }
+
+  if (p.verbose)
+    qInfo("thresh=%d haystack=%d pairs=%d method=join %lldms", p.dctThresh, int(ids.size()),
+          int(pairs.size()), timer.elapsed());
+
+  return true;
+}
+
 Index* DctHashIndex::slice(const QSet<uint32_t>& mediaIds) const {
   Q_ASSERT(isLoaded());
 
@@ -22,11 +22,15 @@
 
 #include "index.h"
 
+class QFile;
+
 /**
  * @class DctHashIndex
  * @brief Index for 64-bit dct hash that uses hamming distance
  */
 class DctHashIndex : public Index {
+  friend class TestDctHashIndex;
+
   Q_DISABLE_COPY_MOVE(DctHashIndex)
 
  public:
@@ -37,6 +41,7 @@ class DctHashIndex : public Index {
   bool isLoaded() const override { return _isLoaded; }
   int count() const override { return _numHashes; }
   size_t memoryUsage() const override;
+  size_t memoryWasted() const override;
 
   void add(const MediaGroup& media) override;
   void remove(const QVector<int>& ids) override;
@@ -50,18 +55,36 @@ class DctHashIndex : public Index {
 
   QVector<Index::Match> find(const Media& m, const SearchParams& p) override;
 
+  bool findNearest(const Media& m, int k, const SearchParams& p,
+                   QVector<Index::Match>& matches) override;
+
+  bool findShard(const Media& m, const SearchParams& p, int shard, int numShards,
+                 QVector<Index::Match>& matches) override;
+
+  bool findAll(const SearchParams& p, QHash<uint32_t, QVector<Index::Match>>& matches) override;
+
   Index* slice(const QSet<uint32_t>& mediaIds) const override;
 
   //uint64_t hashForMedia(const Media& m) { return m.dctHash(); }
   //QString hashQuery() const { return "select id,phash_dct from media where type=1"; }
 
  private:
+  enum {
+    CompactPercent = 10, // percent of removed items that triggers compact()
+  };
+
   void unload();
   class DctTree* _tree;
   uint64_t* _hashes;
   uint32_t* _mediaId;
   int _numHashes;
+  int _numRemoved; // number of zeroed items in _hashes/_mediaId
   bool _isLoaded;
+  QFile* _mapped; // if non-null, _hashes/_mediaId point into the cache file
   void init();
   void buildTree();
+  bool loadCache(const QString& path);
+  void detach();
+  void compact();
+  bool useBruteForce(int threshold) const;
 };
@@ -20,28 +20,81 @@
    <https://www.gnu.org/licenses/>.  */
 #include "dctvideoindex.h"
 
+#include "ioutil.h"
 #include "qtutil.h"
 // #include "tree/hammingtree.h"
 #include "tree/radix.h"
-#include <unordered_map>
+#include <atomic>
 #include <cinttypes>
+#include <unordered_map>
 
+#include <QtConcurrent/QtConcurrentMap>
 #include <QtCore/QFileInfo>
 #include <QtCore/QMutex>
+#include <QtCore/QThread>
+#include <QtCore/QThreadStorage>
 
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlError>
 #include <QtSql/QSqlQuery>
 
+// tree for each (radix, skipFrames) is saved separately
+static QString treeFile(const QString& cachePath, int radix, int skipFrames) {
+  return qq("%1/video-%2-%3.tree").arg(cachePath).arg(radix).arg(skipFrames);
+}
+
+// header written to tree file, the payload is numIds, mediaId[], padding,
+// then RadixMap_t::write()
+static QString treeHeader(int radix, int skipFrames) {
+  static constexpr int version = 1;
+  return QStringLiteral("cbird video tree:%1:%2:%3:%4:%5")
+      .arg(version)
+      .arg(radix)
+      .arg(skipFrames)
+      .arg(sizeof(mediaid_t))
+      .arg(sizeof(VideoTreeIndex));
+}
+
+// bytes of mediaId[] plus padding
+static size_t idsSize(uint64_t numIds) { return (numIds * sizeof(mediaid_t) + 7) & ~size_t(7); }
+
+namespace {
+
+struct ScoredMatch
+{
+  int score;
+  int frame;
+};
+
+/// potential match of one needle frame
+struct Candidate
+{
+  mediaid_t id;
+  MatchRange range;
+};
+
+/// findVideo() scratch space, reused by each search thread so it doesn't allocate
+struct FindBuffers
+{
+  std::vector<VideoSearchTree::Match> matches;
+  std::unordered_map<mediaid_t, ScoredMatch> closestMatch; // mediaId to closest match
+};
+
+} // namespace
+
+static QThreadStorage<FindBuffers> findBuffers;
+
 DctVideoIndex::DctVideoIndex() {
   _id = SearchParams::AlgoVideo;
   _tree = nullptr;
   _isLoaded = false;
   _mutex = new QMutex;
+  _store = new VideoHashStore;
 }
 
 DctVideoIndex::~DctVideoIndex() {
   delete _mutex;
+  delete _store;
   delete _tree;
   for (auto it : _cachedIndex) delete it.second;
 }
@@ -55,32 +108,48 @@ int DctVideoIndex::count() const {
 }
 
 size_t DctVideoIndex::memoryUsage() const {
-  return _tree ? _tree->stats().memory : 0;
+  size_t bytes = VECTOR_SIZE(_mediaId);
+  bytes += _store->memoryUsage();
+  if (_tree) bytes += _tree->stats().memory;
+  return bytes;
 }
 
-DctVideoIndex::VStat DctVideoIndex::insertHashes(mediaid_t mediaIndex,
-                                                 VideoSearchTree* tree,
-                                                 const SearchParams& params) {
-  QString indexPath = QString("%1/%2.vdx").arg(_dataPath).arg(_mediaId[uint32_t(mediaIndex)]);
-  if (!QFileInfo(indexPath).exists()) {
-    qWarning() << "index file missing:" << indexPath;
-    return {0, 0};
-  }
+/**
+ * Append the searchable hashes of one video to values
+ * @return number of frames in the video
+ */
+static int treeValues(const VideoHashStore& store,
+                      const QString& dataPath,
+                      mediaid_t mediaId,
+                      mediaid_t mediaIndex,
+                      const SearchParams& params,
+                      std::vector<VideoSearchTree::Value>& values) {
+  // use the packed store if we can, otherwise the .vdx
+  VideoHashStore::Entry index;
+  VideoIndex fileIndex;
+  if (!store.find(mediaId, index)) {
+    QString indexPath = QString("%1/%2.vdx").arg(dataPath).arg(mediaId);
+    if (!QFileInfo(indexPath).exists()) {
+      qWarning() << "index file missing:" << indexPath;
+      return 0;
+    }
 
-  VideoIndex index;
-  index.load(indexPath);
+    fileIndex.load(indexPath);
+    index.frames = fileIndex.frames.data();
+    index.hashes = fileIndex.hashes.data();
+    index.count = uint32_t(std::min(fileIndex.frames.size(), fileIndex.hashes.size()));
+  }
 
-  if (index.frames.size() == 0) {
-    return {0, 0};
+  if (index.count == 0) {
+    return 0;
   }
 
-  const int lastFrame = index.frames[index.frames.size() - 1];
+  const int lastFrame = index.frames[index.count - 1];
   const int skip = params.skipFrames;
 
-  std::vector<VideoSearchTree::Value> values;
-  values.reserve(index.hashes.size());
+  values.reserve(values.size() + index.count);
 
-  for (size_t j = 0; j < index.hashes.size(); ++j) {
+  for (size_t j = 0; j < index.count; ++j) {
     // drop hashes with < 5 0's or 1's (insufficient detail)
     // TODO: figure out what value is reasonable
     // TODO: drop these when creating the index
@@ -101,12 +170,16 @@ DctVideoIndex::VStat DctVideoIndex::insertHashes(mediaid_t mediaIndex,
     values.push_back(VideoSearchTree::Value(treeIndex, index.hashes[j]));
   }
 
-  // std::sort(values.begin(), values.end(), [tree](auto& a, auto& b) {
-  //   return tree->indexOf(a.hash) < tree->indexOf(b.hash);
-  // });
+  return lastFrame;
+}
 
+DctVideoIndex::VStat DctVideoIndex::insertHashes(mediaid_t mediaIndex,
+                                                 VideoSearchTree* tree,
+                                                 const SearchParams& params) {
+  std::vector<VideoSearchTree::Value> values;
+  const int lastFrame =
+      treeValues(*_store, _dataPath, _mediaId[uint32_t(mediaIndex)], mediaIndex, params, values);
   tree->insert(values);
-
   return {uint64_t(lastFrame), values.size()};
 }
 
@@ -118,22 +191,45 @@ void DctVideoIndex::buildTree(const SearchParams& params) {
   QMutexLocker locker(_mutex);
 
   if (!_tree) {
+    _treeRadix = params.videoRadix;
+    _treeSkip = params.skipFrames;
+
     VStat sum{0, 0};
-    // auto* tree = new VideoSearchTree;
-    auto* tree = new VideoSearchTree(params.videoRadix);
-    QElapsedTimer timer; // don't spam progress prints
-    timer.start();
-    PROGRESS_LOGGER(pl, "<PL>%percent %step videos", _mediaId.size());
-    for (size_t i = 0; i < _mediaId.size(); ++i) {
-      if (timer.elapsed() > 100) {
-        pl.step(i);
-        timer.start();
+    auto* tree = loadTree(params);
+    _treeIsSaved = tree != nullptr;
+    if (!tree) {
+      // auto* tree = new VideoSearchTree;
+      tree = new VideoSearchTree(params.videoRadix);
+
+      // each video is loaded twice, once to count bucket sizes, then to fill them
+      const size_t numVideos = _mediaId.size();
+      std::vector<VStat> stats(numVideos);
+      std::atomic<uint64_t> done(0);
+      QMutex plMutex; // don't spam progress prints
+      PROGRESS_LOGGER(pl, "<PL>%percent %step videos", numVideos);
+
+      tree->build(
+          int(numVideos),
+          [&](int i, std::vector<VideoSearchTree::Value>& values) {
+            const int lastFrame =
+                treeValues(*_store, _dataPath, _mediaId[size_t(i)], mediaid_t(i), params, values);
+            stats[size_t(i)] = {uint64_t(lastFrame), values.size()};
+            const uint64_t n = ++done;
+            if (plMutex.tryLock()) {
+              pl.stepRateLimited(n / 2);
+              plMutex.unlock();
+            }
+          },
+          [](const VideoTreeIndex& a, const VideoTreeIndex& b) {
+            return a.idx < b.idx || (a.idx == b.idx && a.frame < b.frame);
+          });
+      pl.end();
+
+      for (const VStat& st : stats) {
+        sum.videoFrames += st.videoFrames;
+        sum.usedFrames += st.usedFrames;
       }
-      VStat st = insertHashes(mediaid_t(i), tree, params);
-      sum.videoFrames += st.videoFrames;
-      sum.usedFrames += st.usedFrames;
     }
-    pl.end();
 
     // auto stats = tree->stats();
     // qInfo("%" PRIu64 " frames, %" PRIu64
@@ -150,12 +246,19 @@ void DctVideoIndex::buildTree(const SearchParams& params) {
     auto toKb = [](size_t bytes) { return int(bytes + 1024) / 1024; };
 
     auto stats = tree->stats();
-    qInfo("%'" PRIu64 " frames, %'" PRIu64 " hashes, %d:1, %.1f MB, vtrim %d",
-          sum.videoFrames,
-          sum.usedFrames,
-          sum.usedFrames > 0 ? int(sum.videoFrames / sum.usedFrames) : 1,
-          stats.memory / 1024.0 / 1024.0,
-          params.skipFrames);
+    if (_treeIsSaved)
+      qInfo("cached tree, %.1f MB (%.1f MB slack), vtrim %d",
+            stats.memory / 1024.0 / 1024.0,
+            stats.slack / 1024.0 / 1024.0,
+            params.skipFrames);
+    else
+      qInfo("%'" PRIu64 " frames, %'" PRIu64 " hashes, %d:1, %.1f MB (%.1f MB slack), vtrim %d",
+            sum.videoFrames,
+            sum.usedFrames,
+            sum.usedFrames > 0 ? int(sum.videoFrames / sum.usedFrames) : 1,
+            stats.memory / 1024.0 / 1024.0,
+            stats.slack / 1024.0 / 1024.0,
+            params.skipFrames);
 
     qInfo("%'d buckets, %'d empty, sizes(KB): min:%'d max:%'d avg:%'d variance:%d%%",
           stats.numBuckets,
@@ -169,9 +272,51 @@ void DctVideoIndex::buildTree(const SearchParams& params) {
   }
 }
 
+VideoSearchTree* DctVideoIndex::loadTree(const SearchParams& params) const {
+  if (_cachePath.isEmpty()) return nullptr;
+
+  const QString path = treeFile(_cachePath, params.videoRadix, params.skipFrames);
+  const QFileInfo info(path);
+  if (!info.exists()) return nullptr;
+  if (info.lastModified() < _cacheTime) {
+    qDebug() << "stale cache file" << path;
+    return nullptr;
+  }
+
+  QFile f(path);
+  qint64 len = 0;
+  const uchar* ptr = mapCacheFile(f, treeHeader(params.videoRadix, params.skipFrames), &len);
+
+  // tree refers to media by index, so the ids must be the same
+  uint64_t numIds = 0;
+  bool ok = ptr && size_t(len) >= sizeof(numIds);
+  if (ok) {
+    memcpy(&numIds, ptr, sizeof(numIds));
+    ok = numIds == _mediaId.size() && size_t(len) >= sizeof(numIds) + idsSize(numIds) &&
+         0 == memcmp(ptr + sizeof(numIds), _mediaId.data(), numIds * sizeof(mediaid_t));
+  }
+  if (!ok) {
+    qDebug() << "media changed, ignoring cache file" << path;
+    return nullptr;
+  }
+
+  auto* tree = new VideoSearchTree(params.videoRadix);
+  const size_t offset = sizeof(numIds) + idsSize(numIds);
+  if (!tree->read(ptr + offset, size_t(len) - offset)) {
+    qWarning() << "invalid cache file, rebuilding" << path;
+    delete tree;
+    return nullptr;
+  }
+  return tree;
+}
+
 void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QString& dataPath) {
-  (void)cachePath;
   _dataPath = dataPath;
+  _cachePath = cachePath;
+
+  // tree cache is stale if any media was added/removed, or
+  // .vdx files were added/removed/replaced (e.g. -migrate)
+  _cacheTime = std::max(DBHelper::lastModified(db), QFileInfo(dataPath).lastModified());
 
   QSqlQuery query(db);
   query.setForwardOnly(true);
@@ -191,6 +336,11 @@ void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QStri
   _mediaId.clear();
   _isLoaded = false;
 
+  if (_store->open(dataPath))
+    qDebug("video hash store: %'d videos", int(_store->count()));
+  else
+    qDebug("video hash store unavailable, using .vdx files");
+
   PROGRESS_LOGGER(pl, "querying:<PL> %percent %step rows", rowCount);
 
   size_t i = 0;
@@ -212,7 +362,27 @@ void DctVideoIndex::load(QSqlDatabase& db, const QString& cachePath, const QStri
 
 void DctVideoIndex::save(QSqlDatabase& db, const QString& cachePath) {
   (void)db;
-  (void) cachePath;
+
+  QMutexLocker locker(_mutex);
+  if (!_tree || _treeIsSaved) return;
+
+  qInfo() << "<PL>writing video tree... ";
+  const uint64_t numIds = _mediaId.size();
+  writeFileAtomically(treeFile(cachePath, _treeRadix, _treeSkip), [&](QFile& f) {
+    writeCacheHeader(f, treeHeader(_treeRadix, _treeSkip));
+
+    const auto write = [&f](const void* data, size_t len) {
+      if (qint64(len) != f.write(reinterpret_cast<const char*>(data), qint64(len)))
+        throw f.errorString();
+    };
+    static const char pad[8] = {0};
+    write(&numIds, sizeof(numIds));
+    write(_mediaId.data(), numIds * sizeof(mediaid_t));
+    write(pad, idsSize(numIds) - numIds * sizeof(mediaid_t));
+
+    _tree->write(f);
+  });
+  _treeIsSaved = true;
 }
 
 QSet<mediaid_t> DctVideoIndex::mediaIds(QSqlDatabase& db,
@@ -338,7 +508,7 @@ QVector<Index::Match> DctVideoIndex::findFrame(const Media& needle, const Search
 
   std::vector<VideoSearchTree::Match> matches;
 
-  queryIndex->search(hash, params.dctThresh, matches);
+  queryIndex->search(hash, params.dctThresh, matches, params.videoProbe);
 
   qint64 end = QDateTime::currentMSecsSinceEpoch();
 
@@ -392,6 +562,7 @@ Index* DctVideoIndex::slice(const QSet<uint32_t>& mediaIds) const {
   // tree rebuilds on first query
   copy->_dataPath = _dataPath;
   copy->_isLoaded = true;
+  if (_store->isOpen()) copy->_store->open(_dataPath);
   for (auto& id : mediaIds) copy->_mediaId.push_back(id);
   return copy;
 }
@@ -408,10 +579,14 @@ QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const Search
 
   {
     VideoIndex srcIndex;
+    VideoHashStore::Entry entry;
     // if id == 0, it doesn't exist in the db and was indexed separately
     if (needle.id() == 0)
       srcIndex = needle.videoIndex();
-    else
+    else if (_store->find(needle.id(), entry)) {
+      srcIndex.frames.assign(entry.frames, entry.frames + entry.count);
+      srcIndex.hashes.assign(entry.hashes, entry.hashes + entry.count);
+    } else
       srcIndex.load(QString("%1/%2.vdx").arg(_dataPath).arg(needle.id()));
 
     if (srcIndex.isEmpty()) {
@@ -434,24 +609,14 @@ QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const Search
       index.frame = srcFrame;
       index.idx = 0;
 
-      VideoSearchTree::Value v(index, srcIndex.hashes[i]);
-#if 1
-      // sort needles by bucket, this should improve cache utilization
-      // also required for vector search
-      if (srcData.size() > 0)
-        srcData.insert(std::upper_bound(srcData.begin(),
-                                        srcData.end(),
-                                        v,
-                                        [this](auto& a, auto& b) {
-                                          auto pa = _tree->indexOf(a.hash);
-                                          auto pb = _tree->indexOf(b.hash);
-                                          return pa < pb;
-                                        }),
-                       v);
-      else
-#endif
-        srcData.push_back(VideoSearchTree::Value(index, srcIndex.hashes[i]));
+      srcData.push_back(VideoSearchTree::Value(index, srcIndex.hashes[i]));
     };
+
+    // sort needles by bucket, this should improve cache utilization
+    // also required for vector search
+    std::stable_sort(srcData.begin(), srcData.end(), [this](auto& a, auto& b) {
+      return _tree->indexOf(a.hash) < _tree->indexOf(b.hash);
+    });
   }
 
   // pull out some constants to help optimizer
@@ -460,25 +625,17 @@ QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const Search
 
   QMap<mediaid_t, std::vector<MatchRange>> cand; // potential matches before filtering
 
-  struct ScoredMatch
-  {
-    int score;
-    int frame;
-  };
-  std::unordered_map<mediaid_t, ScoredMatch> closestMatch; // mediaId to closest match
-
   // tree search returns all matches below threshold, we only need one per
   // matching video
   // NOTE: if the video matched the same frame many times, that would
   // not improve the result score...like perhaps a slideshow or webcast
   // with a mostly static frames
-  const auto reduceMatches = [&closestMatch,
-                              &filterSelf,
-                              &needleId,
-                              &cand,
-                              this](VideoSearchTree::hash_t queryHash,
-                                    int queryFrame,
-                                    const std::vector<VideoSearchTree::Match>& matches) {
+  const auto reduceMatches = [&filterSelf, &needleId, this](
+                                 VideoSearchTree::hash_t queryHash,
+                                 int queryFrame,
+                                 const std::vector<VideoSearchTree::Match>& matches,
+                                 std::unordered_map<mediaid_t, ScoredMatch>& closestMatch,
+                                 std::vector<Candidate>& cand) {
     // reuse this to reduce allocations
     closestMatch.clear();
 
@@ -505,7 +662,8 @@ QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const Search
     // add the closest match to the list of potential matches
     const int matchLen = 1; // to be determined
     for (auto& closest : std::as_const(closestMatch))
-      cand[closest.first].push_back(MatchRange(queryFrame, int(closest.second.frame), matchLen));
+      cand.push_back(
+          {closest.first, MatchRange(queryFrame, int(closest.second.frame), matchLen)});
   };
 
 //
@@ -554,7 +712,7 @@ QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const Search
       matchVector[k].clear();
     }
 
-    _tree->search(queryVector, params.dctThresh, matchVector);
+    _tree->search(queryVector, params.dctThresh, matchVector, params.videoProbe);
 
     size_t j = 0;
     for (auto& matches : std::as_const(matchVector)) {
@@ -565,18 +723,52 @@ QVector<Index::Match> DctVideoIndex::findVideo(const Media& needle, const Search
     }
   }
 #else
-  std::vector<VideoSearchTree::Match> matches;
-  for (const auto& frame : std::as_const(srcData)) {
-    const uint64_t queryHash = frame.hash;
-    const int queryFrame = frame.index.frame;
-    matches.clear();
+  // split needle frames into chunks that don't share buckets, each
+  // chunk is searched by one thread and has its own candidates
+  struct Chunk
+  {
+    size_t begin, end;
+    std::vector<Candidate> cand;
+  };
+  std::vector<Chunk> chunks;
+  {
+    const size_t minChunkFrames = 256;
+    const size_t maxChunks = size_t(QThread::idealThreadCount()) * 4;
+    const size_t numChunks = qBound(size_t(1), srcData.size() / minChunkFrames, maxChunks);
+    size_t begin = 0;
+    for (size_t i = 1; i <= numChunks && begin < srcData.size(); ++i) {
+      size_t end = std::max(begin + 1, srcData.size() * i / numChunks);
+      while (end < srcData.size() &&
+             _tree->indexOf(srcData[end].hash) == _tree->indexOf(srcData[end - 1].hash))
+        end++;
+      chunks.push_back({begin, end, {}});
+      begin = end;
+    }
+  }
 
-    // qInfo("0x%08x %d", (int) _tree->addressOf(queryHash), queryFrame);
+  const auto searchChunk = [&](Chunk& chunk) {
+    FindBuffers& buf = findBuffers.localData();
+    for (size_t i = chunk.begin; i < chunk.end; ++i) {
+      const uint64_t queryHash = srcData[i].hash;
+      const int queryFrame = srcData[i].index.frame;
+      buf.matches.clear();
 
-    _tree->search(queryHash, params.dctThresh, matches);
+      // qInfo("0x%08x %d", (int) _tree->addressOf(queryHash), queryFrame);
 
-    reduceMatches(queryHash, queryFrame, matches);
-  }
+      _tree->search(queryHash, params.dctThresh, buf.matches, params.videoProbe);
+
+      reduceMatches(queryHash, queryFrame, buf.matches, buf.closestMatch, chunk.cand);
+    }
+  };
+
+  if (chunks.size() > 1)
+    QtConcurrent::blockingMap(chunks, searchChunk);
+  else
+    for (Chunk& chunk : chunks) searchChunk(chunk);
+
+  // merge in needle order, the same as searching serially
+  for (const Chunk& chunk : std::as_const(chunks))
+    for (const Candidate& c : chunk.cand) cand[c.id].push_back(c.range);
 #endif
 
   //
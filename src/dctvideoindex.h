@@ -61,6 +61,7 @@ typedef RadixMap_t<VideoTreeIndex> VideoSearchTree;
 #endif
 
 class QMutex;
+class VideoHashStore;
 
 /**
  * @class DctVideoIndex
@@ -108,11 +109,17 @@ class DctVideoIndex : public Index {
   VStat insertHashes(mediaid_t mediaIndex, VideoSearchTree* tree, const SearchParams& params);
 
   void buildTree(const SearchParams& params);
+  VideoSearchTree* loadTree(const SearchParams& params) const;
 
   VideoSearchTree* _tree;
+  bool _treeIsSaved = false;          // _tree was read from, or written to the cache
+  int _treeRadix = 0, _treeSkip = 0;  // params _tree was built with
   std::vector<mediaid_t> _mediaId;
   QString _dataPath;
+  QString _cachePath;
+  QDateTime _cacheTime; // tree cache must be newer than this
   std::map<mediaid_t, VideoSearchTree*> _cachedIndex;
   QMutex* _mutex = nullptr;
+  VideoHashStore* _store = nullptr; // packed .vdx files, if available
   bool _isLoaded;
 };
@@ -0,0 +1,452 @@
+/* Fast hamming distance
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#include "hamm.h"
+
+#include <QtConcurrent/QtConcurrentMap>
+#include <atomic>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAMM_X86_DISPATCH (1)
+#include <immintrin.h>
+#endif
+
+// scan hashes[begin..count), outputs index relative to hashes
+static void scanScalar(uint64_t target,
+                       const uint64_t* hashes,
+                       size_t begin,
+                       size_t count,
+                       int threshold,
+                       std::vector<HammScanMatch>& matches) {
+  for (size_t i = begin; i < count; ++i) {
+    int d = hamm64(target, hashes[i]);
+    if (Q_UNLIKELY(d < threshold)) matches.push_back({uint32_t(i), d});
+  }
+}
+
+static void scanGeneric(uint64_t target,
+                        const uint64_t* hashes,
+                        size_t count,
+                        int threshold,
+                        std::vector<HammScanMatch>& matches) {
+  scanScalar(target, hashes, 0, count, threshold, matches);
+}
+
+#if HAMM_X86_DISPATCH
+
+// popcount of each byte with 4-bit lookup table (Mula et al), then sum
+// the bytes of each 64-bit lane with psadbw
+__attribute__((target("avx2"))) static inline __m256i popcount256(__m256i x) {
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low4 = _mm256_set1_epi8(0x0F);
+  const __m256i lo = _mm256_and_si256(x, low4);
+  const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low4);
+  const __m256i bytes =
+      _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+  return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"))) static void scanAvx2(uint64_t target,
+                                                     const uint64_t* hashes,
+                                                     size_t count,
+                                                     int threshold,
+                                                     std::vector<HammScanMatch>& matches) {
+  const __m256i t = _mm256_set1_epi64x(int64_t(target));
+  const __m256i thresh = _mm256_set1_epi64x(threshold);
+
+  // 8 hashes per iteration, matches are rare so test both masks at once
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes + i + 4));
+    const __m256i da = popcount256(_mm256_xor_si256(a, t));
+    const __m256i db = popcount256(_mm256_xor_si256(b, t));
+    const int ma = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(thresh, da)));
+    const int mb = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(thresh, db)));
+
+    if (Q_UNLIKELY(ma | mb)) {
+      alignas(32) int64_t d[8];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(d), da);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(d + 4), db);
+      const int mask = ma | (mb << 4);
+      for (int j = 0; j < 8; ++j)
+        if (mask & (1 << j)) matches.push_back({uint32_t(i + j), int(d[j])});
+    }
+  }
+
+  scanScalar(target, hashes, i, count, threshold, matches);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) static void scanAvx512(
+    uint64_t target,
+    const uint64_t* hashes,
+    size_t count,
+    int threshold,
+    std::vector<HammScanMatch>& matches) {
+  const __m512i t = _mm512_set1_epi64(int64_t(target));
+  const __m512i thresh = _mm512_set1_epi64(threshold);
+
+  for (size_t i = 0; i < count; i += 8) {
+    // last iteration uses masked load for the remainder
+    const __mmask8 load = count - i >= 8 ? 0xFF : __mmask8((1U << (count - i)) - 1);
+    const __m512i h = _mm512_maskz_loadu_epi64(load, hashes + i);
+    const __m512i d = _mm512_popcnt_epi64(_mm512_xor_si512(h, t));
+    const __mmask8 mask = _mm512_mask_cmplt_epu64_mask(load, d, thresh);
+
+    if (Q_UNLIKELY(mask)) {
+      alignas(64) uint64_t dist[8];
+      _mm512_store_si512(dist, d);
+      for (int j = 0; j < 8; ++j)
+        if (mask & (1 << j)) matches.push_back({uint32_t(i + j), int(dist[j])});
+    }
+  }
+}
+
+#endif // HAMM_X86_DISPATCH
+
+namespace {
+
+// hashes grouped into contiguous buckets by one substring
+struct JoinTable {
+  int shift = 0;
+  int bits = 0;
+  std::vector<uint32_t> offsets;  // bucket i is [offsets[i], offsets[i+1])
+  std::vector<uint64_t> hashes;
+  std::vector<uint32_t> ids;
+
+  uint32_t key(uint64_t hash) const { return uint32_t(hash >> shift) & ((1U << bits) - 1); }
+};
+
+// work item, range of rows or buckets
+struct JoinTask {
+  uint32_t begin, end;
+  std::vector<HammJoinPair> pairs;
+};
+
+enum {
+  JoinTileSize = 512,       // hashes per tile, small enough to stay in L1
+  JoinTasksPerThread = 16,  // more tasks than threads, for load balancing
+};
+
+} // namespace
+
+/**
+ * compare a[0..na) with b[0..nb), b is tiled to keep it in cache
+ * if triangle, a==b and only j > i are compared
+ * accept(i, j) is the final say on each pair within threshold
+ */
+template <typename Accept>
+static void joinBlock(const uint64_t* ha,
+                      const uint32_t* ia,
+                      size_t na,
+                      const uint64_t* hb,
+                      const uint32_t* ib,
+                      size_t nb,
+                      bool triangle,
+                      int threshold,
+                      const Accept& accept,
+                      std::vector<HammJoinPair>& pairs) {
+  for (size_t tile = 0; tile < nb; tile += JoinTileSize) {
+    const size_t tileEnd = std::min(nb, tile + JoinTileSize);
+    const size_t rows = triangle ? std::min(na, tileEnd) : na;
+    for (size_t i = 0; i < rows; ++i) {
+      const uint64_t h = ha[i];
+      const size_t first = triangle ? std::max(tile, i + 1) : tile;
+      for (size_t j = first; j < tileEnd; ++j) {
+        const int d = hamm64(h, hb[j]);
+        if (Q_UNLIKELY(d < threshold) && accept(h, hb[j])) pairs.push_back({ia[i], ib[j], d});
+      }
+    }
+  }
+}
+
+// masks of neighboring buckets to probe, with 1..radius bits set
+static std::vector<uint32_t> joinMasks(int bits, int radius) {
+  std::vector<uint32_t> masks;
+  for (int r = 1; r <= radius && r <= bits; ++r) {
+    uint64_t mask = (uint64_t(1) << r) - 1;  // Gosper's hack
+    while (mask < (uint64_t(1) << bits)) {
+      masks.push_back(uint32_t(mask));
+      const uint64_t c = mask & -mask;
+      const uint64_t n = mask + c;
+      mask = (((n ^ mask) >> 2) / c) | n;
+    }
+  }
+  return masks;
+}
+
+static void joinTasks(std::vector<JoinTask>& tasks,
+                      size_t count,
+                      const std::function<void(JoinTask&)>& fn) {
+  const size_t numTasks = std::max(size_t(1), size_t(QThread::idealThreadCount()) * JoinTasksPerThread);
+  const size_t step = std::max(size_t(1), (count + numTasks - 1) / numTasks);
+  tasks.clear();
+  for (size_t i = 0; i < count; i += step)
+    tasks.push_back({uint32_t(i), uint32_t(std::min(count, i + step)), {}});
+
+  QtConcurrent::blockingMap(tasks, fn);
+}
+
+void hamm64Join(const uint64_t* hashes,
+                const uint32_t* ids,
+                size_t count,
+                int threshold,
+                std::vector<HammJoinPair>& pairs,
+                const std::function<void(size_t, size_t)>& progress) {
+  Q_ASSERT(count < UINT32_MAX);
+  if (count < 2 || threshold <= 0) return;
+
+  // substring length ~= log2(count), so buckets have ~1 item
+  const int bits = qBound(8, int(std::round(std::log2(double(count)))), 22);
+  const int numTables = qBound(1, (64 + bits - 1) / bits, 8);
+  const int subRadius = (threshold - 1) / numTables;
+
+  // progress is in hashes, each pass visits every hash once
+  std::atomic<size_t> done(0);
+  size_t total = count;
+  auto report = [&](size_t n) {
+    if (progress) progress(done.fetch_add(n, std::memory_order_relaxed) + n, total);
+  };
+
+  std::vector<JoinTask> tasks;
+  auto collect = [&]() {
+    for (auto& task : tasks) pairs.insert(pairs.end(), task.pairs.begin(), task.pairs.end());
+  };
+
+  // tables are processed one at a time, earlier tables are only needed to
+  // know if the pair was already emitted, which comes from the hashes
+  std::vector<JoinTable> tables(static_cast<size_t>(numTables));
+  int shift = 0;
+  for (int t = 0; t < numTables; ++t) {
+    JoinTable& table = tables[size_t(t)];
+    table.bits = (64 - shift) / (numTables - t);
+    table.shift = shift;
+    shift += table.bits;
+  }
+
+  // if probing costs more than comparing everything, then compare everything
+  const size_t numMasks = joinMasks(tables.back().bits, subRadius).size();
+  const double probeCost = double(numTables) * double(numMasks + 1) * double(count);
+  if (probeCost * 2 >= double(count) * double(count)) {
+    auto any = [](uint64_t, uint64_t) { return true; };
+    joinTasks(tasks, (count + JoinTileSize - 1) / JoinTileSize, [&](JoinTask& task) {
+      for (size_t row = task.begin * size_t(JoinTileSize);
+           row < std::min(count, task.end * size_t(JoinTileSize)); row += JoinTileSize) {
+        const size_t na = std::min(size_t(JoinTileSize), count - row);
+        joinBlock(hashes + row, ids + row, na, hashes + row, ids + row, count - row, true,
+                  threshold, any, task.pairs);
+        report(na);
+      }
+    });
+    collect();
+    return;
+  }
+
+  total = count * size_t(numTables);
+
+  for (int t = 0; t < numTables; ++t) {
+    JoinTable& table = tables[size_t(t)];
+
+    // counting sort into buckets
+    const size_t numBuckets = size_t(1) << table.bits;
+    table.offsets.assign(numBuckets + 1, 0);
+    for (size_t i = 0; i < count; ++i) table.offsets[table.key(hashes[i]) + 1]++;
+    for (size_t i = 0; i < numBuckets; ++i) table.offsets[i + 1] += table.offsets[i];
+
+    const std::vector<uint32_t> masks = joinMasks(table.bits, subRadius);
+
+    table.hashes.resize(count);
+    table.ids.resize(count);
+    {
+      std::vector<uint32_t> fill(table.offsets.begin(), table.offsets.end() - 1);
+      for (size_t i = 0; i < count; ++i) {
+        const uint32_t pos = fill[table.key(hashes[i])]++;
+        table.hashes[pos] = hashes[i];
+        table.ids[pos] = ids[i];
+      }
+    }
+
+    // pair was emitted by an earlier table if its substring was within radius
+    auto accept = [&tables, t, subRadius](uint64_t a, uint64_t b) {
+      for (int k = 0; k < t; ++k) {
+        const JoinTable& prev = tables[size_t(k)];
+        if (hamm64(prev.key(a), prev.key(b)) <= subRadius) return false;
+      }
+      return true;
+    };
+
+    // each bucket pair (k, k^mask) is visited once from the smaller key
+    joinTasks(tasks, numBuckets, [&](JoinTask& task) {
+      for (uint32_t key = task.begin; key < task.end; ++key) {
+        const uint32_t a = table.offsets[key];
+        const uint32_t na = table.offsets[key + 1] - a;
+        if (na == 0) continue;
+
+        const uint64_t* ha = table.hashes.data() + a;
+        const uint32_t* ia = table.ids.data() + a;
+        joinBlock(ha, ia, na, ha, ia, na, true, threshold, accept, task.pairs);
+
+        for (uint32_t mask : masks) {
+          const uint32_t probe = key ^ mask;
+          if (probe < key) continue;
+          const uint32_t b = table.offsets[probe];
+          const uint32_t nb = table.offsets[probe + 1] - b;
+          if (nb == 0) continue;
+          joinBlock(ha, ia, na, table.hashes.data() + b, table.ids.data() + b, nb, false,
+                    threshold, accept, task.pairs);
+        }
+      }
+      report(table.offsets[task.end] - table.offsets[task.begin]);
+    });
+    collect();
+
+    // keep the parameters for accept(), release the rest
+    table.offsets = std::vector<uint32_t>();
+    table.hashes = std::vector<uint64_t>();
+    table.ids = std::vector<uint32_t>();
+  }
+}
+
+// address of row in blocks of 2^shift rows
+static inline const uint8_t* gatherRow(const uint8_t* const* blocks, int shift, uint32_t row) {
+  return blocks[row >> shift] + size_t(row & ((1U << shift) - 1)) * 32;
+}
+
+static void gatherGeneric(const uint8_t* needle,
+                          const uint8_t* const* blocks,
+                          int shift,
+                          const uint32_t* rows,
+                          size_t count,
+                          int* distances) {
+  for (size_t i = 0; i < count; ++i)
+    distances[i] = hamm256(needle, gatherRow(blocks, shift, rows[i]));
+}
+
+#if HAMM_X86_DISPATCH
+
+__attribute__((target("avx2"))) static void gatherAvx2(const uint8_t* needle,
+                                                       const uint8_t* const* blocks,
+                                                       int shift,
+                                                       const uint32_t* rows,
+                                                       size_t count,
+                                                       int* distances) {
+  const __m256i n = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(needle));
+
+  // 4 rows per iteration, popcount256() leaves 4 partial sums per row,
+  // transpose and add them so each lane is the distance of one row
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m256i* p[4];
+    for (int j = 0; j < 4; ++j)
+      p[j] = reinterpret_cast<const __m256i*>(gatherRow(blocks, shift, rows[i + j]));
+
+    const __m256i a = popcount256(_mm256_xor_si256(_mm256_loadu_si256(p[0]), n));
+    const __m256i b = popcount256(_mm256_xor_si256(_mm256_loadu_si256(p[1]), n));
+    const __m256i c = popcount256(_mm256_xor_si256(_mm256_loadu_si256(p[2]), n));
+    const __m256i d = popcount256(_mm256_xor_si256(_mm256_loadu_si256(p[3]), n));
+
+    // [a0+a1, b0+b1, a2+a3, b2+b3], [c0+c1, d0+d1, c2+c3, d2+d3]
+    const __m256i ab = _mm256_add_epi64(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+    const __m256i cd = _mm256_add_epi64(_mm256_unpacklo_epi64(c, d), _mm256_unpackhi_epi64(c, d));
+
+    // [a, b, c, d]
+    const __m256i sum = _mm256_add_epi64(_mm256_permute2x128_si256(ab, cd, 0x20),
+                                         _mm256_permute2x128_si256(ab, cd, 0x31));
+
+    alignas(32) int64_t dist[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(dist), sum);
+    for (int j = 0; j < 4; ++j) distances[i + j] = int(dist[j]);
+  }
+
+  gatherGeneric(needle, blocks, shift, rows + i, count - i, distances + i);
+}
+
+#endif // HAMM_X86_DISPATCH
+
+namespace {
+
+typedef void (*ScanFunc)(uint64_t, const uint64_t*, size_t, int, std::vector<HammScanMatch>&);
+
+typedef void (*GatherFunc)(
+    const uint8_t*, const uint8_t* const*, int, const uint32_t*, size_t, int*);
+
+struct HammKernel {
+  const char* name;
+  ScanFunc scan;
+  GatherFunc gather;
+  bool (*supported)();
+};
+
+} // namespace
+
+// in order of preference, there is no avx512 gather kernel
+static const HammKernel hammKernels[] = {
+#if HAMM_X86_DISPATCH
+    {"avx512", scanAvx512, gatherAvx2,
+     [] { return bool(__builtin_cpu_supports("avx512vpopcntdq")); }},
+    {"avx2", scanAvx2, gatherAvx2, [] { return bool(__builtin_cpu_supports("avx2")); }},
+#endif
+    {"scalar", scanGeneric, gatherGeneric, [] { return true; }},
+};
+
+static std::atomic<const HammKernel*> currentKernel{nullptr};
+
+bool hammSetKernel(const char* name) {
+#if HAMM_X86_DISPATCH
+  __builtin_cpu_init();
+#endif
+  const bool best = !name || !*name;
+  for (const HammKernel& kernel : hammKernels)
+    if ((best || strcmp(name, kernel.name) == 0) && kernel.supported()) {
+      currentKernel = &kernel;
+      return true;
+    }
+  return false;
+}
+
+static const HammKernel& hammKernel() {
+  const HammKernel* kernel = currentKernel.load(std::memory_order_relaxed);
+  if (Q_UNLIKELY(!kernel)) {
+    hammSetKernel(nullptr);
+    kernel = currentKernel.load();
+  }
+  return *kernel;
+}
+
+void hamm64Scan(uint64_t target,
+                const uint64_t* hashes,
+                size_t count,
+                int threshold,
+                std::vector<HammScanMatch>& matches) {
+  Q_ASSERT(count <= UINT32_MAX);
+  hammKernel().scan(target, hashes, count, threshold, matches);
+}
+
+const char* hamm64ScanKernel() { return hammKernel().name; }
+
+void hamm256Gather(const uint8_t* needle,
+                   const uint8_t* const* blocks,
+                   int blockShift,
+                   const uint32_t* rows,
+                   size_t count,
+                   int* distances) {
+  hammKernel().gather(needle, blocks, blockShift, rows, count, distances);
+}
@@ -24,3 +24,91 @@
 inline char hamm64(uint64_t a, uint64_t b) {
   return __builtin_popcountll(a ^ b);
 } // TODO: use std::popcount() - c++20
+
+/// Result of hamm64Scan(), position in the scanned array
+struct HammScanMatch {
+  uint32_t index;
+  int distance;
+};
+
+/**
+ * Linear scan for hashes with hamming distance < threshold
+ * @param target needle hash
+ * @param hashes haystack
+ * @param count number of hashes, must be <= UINT32_MAX
+ * @param matches output, appended
+ * @note SIMD kernel is chosen at runtime based on cpu features (avx2, avx512 vpopcntq)
+ */
+void hamm64Scan(uint64_t target,
+                const uint64_t* hashes,
+                size_t count,
+                int threshold,
+                std::vector<HammScanMatch>& matches);
+
+/// @return name of the kernel used by hamm64Scan
+const char* hamm64ScanKernel();
+
+/**
+ * Select the SIMD kernel used by hamm64Scan() and hamm256Gather(), for testing
+ * @param name "scalar", "avx2", "avx512", or null for the best the cpu supports
+ * @return false if the kernel is unknown or not supported, the selection is unchanged
+ * @note not thread-safe, call when nothing is scanning
+ */
+bool hammSetKernel(const char* name);
+
+/// Result of hamm64Join(), a pair of ids
+struct HammJoinPair {
+  uint32_t a, b;  // ids of the pair, in no particular order
+  int distance;
+};
+
+/**
+ * All-pairs self-join, finds every pair of hashes with hamming distance < threshold
+ * @param hashes haystack
+ * @param ids id of each hash, output instead of the position
+ * @param count number of hashes, must be < UINT32_MAX
+ * @param pairs output, appended, each pair appears once and never paired with itself
+ * @param progress if set, progress(done, total) is called from the worker threads
+ *        as parts of the join finish, done reaches total at the end
+ * @details Hashes are partitioned by substring (multi-index hashing) and copied
+ * into contiguous buckets, then neighboring buckets are compared in tiles. Each pair
+ * is emitted by exactly one partition. When the threshold is too large for the
+ * partitions to help, it is a tiled scan of all pairs. Work is split over the
+ * global thread pool.
+ */
+void hamm64Join(const uint64_t* hashes,
+                const uint32_t* ids,
+                size_t count,
+                int threshold,
+                std::vector<HammJoinPair>& pairs,
+                const std::function<void(size_t, size_t)>& progress = nullptr);
+
+/// 256-bit hamming distance, e.g. ORB descriptors (32 bytes)
+inline int hamm256(const uint8_t* a, const uint8_t* b) {
+  int d = 0;
+  for (int i = 0; i < 32; i += 8) {
+    uint64_t x, y;
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    d += hamm64(x, y);
+  }
+  return d;
+}
+
+/**
+ * Distance from needle to a set of rows in a descriptor matrix
+ * @param needle 256-bit descriptor
+ * @param blocks haystack of 256-bit descriptors, 32 bytes per row,
+ *        in blocks of 2^blockShift rows
+ * @param blockShift log2 of rows per block
+ * @param rows row numbers in haystack to compare
+ * @param count number of rows
+ * @param distances output, distances[i] is the distance to rows[i]
+ * @note SIMD kernel is chosen at runtime based on cpu features (avx2)
+ */
+void hamm256Gather(const uint8_t* needle,
+                   const uint8_t* const* blocks,
+                   int blockShift,
+                   const uint32_t* rows,
+                   size_t count,
+                   int* distances);
@@ -91,6 +91,13 @@ SearchParams::SearchParams() {
          counter++, SET_INT(videoRadix), GET(videoRadix), NO_NAMES, GET_CONST(range)});
   }
 
+  {
+    static const QVector<int> range{0, 8};
+    add({"vprobe", CatAlgo, "Also search radix buckets within R bits, recovers accuracy (video)",
+         Value::Int, counter++, SET_INT(videoProbe), GET(videoProbe), NO_NAMES,
+         GET_CONST(range)});
+  }
+
   add({"vfm", CatAlgo, "Minimum number of frames matched per video", Value::Int, counter++,
        SET_INT(minFramesMatched), GET(minFramesMatched), NO_NAMES, GET_CONST(positive)});
 
@@ -110,6 +110,7 @@ class SearchParams : public Params {
   int minFramesMatched = 30;  // video search: require >N frames match between videos
   int minFramesNear = 60;     // video search: require >N% of frames that matched are nearby
   int videoRadix = 10;        // video search: radix of RadixSearch
+  int videoProbe = 0;         // video search: also search radix buckets within N bits
 
   bool filterSelf = true;       // remove media that matched itself
   bool filterGroups = true;     // remove duplicate groups from results (a matches (b,c,d)
@@ -174,6 +175,9 @@ class Index {
   /// @return amount of heap memory used
   virtual size_t memoryUsage() const = 0;
 
+  /// @return portion of memoryUsage() held by removed items, until the index compacts itself
+  virtual size_t memoryWasted() const { return 0; }
+
   /**
    * @return number of items represented
    * @note could be less than number of items in database
@@ -249,6 +253,56 @@ class Index {
    */
   virtual QVector<Index::Match> find(const Media& m, const SearchParams& p) = 0;
 
+  /**
+   * Search part of the index, so one query can run on multiple threads
+   * @param m The query media, pre-processed for searching
+   * @param p Parameters, same as find()
+   * @param shard Part to search, 0 <= shard < numShards
+   * @param numShards Number of parts, the results of all parts together are the same as find()
+   * @param matches Matches in this part, unsorted
+   * @return false if unsupported, find() must be used instead
+   * @note must be thread-safe, shards are searched concurrently
+   */
+  virtual bool findShard(const Media& m, const SearchParams& p, int shard, int numShards,
+                         QVector<Index::Match>& matches) {
+    (void)m;
+    (void)p;
+    (void)shard;
+    (void)numShards;
+    (void)matches;
+    return false;
+  }
+
+  /**
+   * Find the k nearest items, in one search instead of find() with increasing thresholds
+   * @param m The query media, pre-processed for searching
+   * @param k Maximum number of matches
+   * @param p Parameters, the threshold (e.g. dctThresh) is the search radius
+   * @param matches Up to k matches with the best score, sorted by score
+   * @return false if unsupported
+   */
+  virtual bool findNearest(const Media& m, int k, const SearchParams& p,
+                           QVector<Index::Match>& matches) {
+    (void)m;
+    (void)k;
+    (void)p;
+    (void)matches;
+    return false;
+  }
+
+  /**
+   * Find every item in the index (self-join), which can be much faster than find()
+   * on each item since every pair only has to be compared once
+   * @param p Parameters, same as find()
+   * @param matches mediaId => result of find(), items with no matches may be omitted
+   * @return false if unsupported, find() must be used instead
+   */
+  virtual bool findAll(const SearchParams& p, QHash<uint32_t, QVector<Index::Match>>& matches) {
+    (void)p;
+    (void)matches;
+    return false;
+  }
+
   /**
    * Get data such as descriptors that are only stored in the index
    * @param m if m.id() exists in the index then it is populated.
@@ -278,9 +332,18 @@ class Index {
  protected:
   int _id;
   Index() { _id = -1; }
+
+  /// keep the k best matches, sorted by score
+  static void keepNearest(QVector<Index::Match>& matches, int k);
 };
 
 /// sort matches by score
 inline bool operator<(const Index::Match& m1, const Index::Match& m2) {
   return m1.score < m2.score;
 }
+
+inline void Index::keepNearest(QVector<Index::Match>& matches, int k) {
+  const int len = std::min(k, int(matches.count()));
+  std::partial_sort(matches.begin(), matches.begin() + len, matches.end());
+  matches.resize(len);
+}
@@ -241,6 +241,44 @@ class Dangling {
 const Dangling* Dangling::_this = nullptr;
 #endif
 
+void writeCacheHeader(QFile& f, const QString& header) {
+  QByteArray bytes = header.toLatin1() + '\n';
+  const int pad = (CACHE_FILE_ALIGN - bytes.length() % CACHE_FILE_ALIGN) % CACHE_FILE_ALIGN;
+  bytes.append(pad, '\0');
+  if (bytes.length() != f.write(bytes)) throw f.errorString();
+}
+
+uchar* mapCacheFile(QFile& f, const QString& header, qint64* len) {
+  *len = 0;
+  if (!f.isOpen() && !f.open(QFile::ReadOnly)) {
+    qWarning() << "open failed" << f.fileName() << f.errorString();
+    return nullptr;
+  }
+
+  const QByteArray line = f.readLine(256);
+  if (line != header.toLatin1() + '\n') {
+    qDebug() << "incompatible format:" << line.trimmed();
+    qDebug() << "expected" << header;
+    return nullptr;
+  }
+
+  const qint64 offset = (line.length() + CACHE_FILE_ALIGN - 1) / CACHE_FILE_ALIGN * CACHE_FILE_ALIGN;
+  const qint64 size = f.size();
+  if (size < offset) {
+    qWarning() << "truncated file" << f.fileName();
+    return nullptr;
+  }
+
+  uchar* ptr = f.map(0, size, QFile::MapPrivateOption);
+  if (!ptr) {
+    qWarning() << "map failed" << f.fileName() << f.errorString();
+    return nullptr;
+  }
+
+  *len = size - offset;
+  return ptr + offset;
+}
+
 void writeFileAtomically(const QString& path, const std::function<void(QFile&)>& fn) {
   // static auto* d = new Dangling;
   // FIXME: using exceptions for control flow
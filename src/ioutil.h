@@ -194,6 +194,27 @@ QString sparseMd5(QIODevice& file);
 /// all-or-nothing file writing, function must throw QString for errors
 void writeFileAtomically(const QString& path, const std::function<void(QFile&)>& fn);
 
+/**
+ * Cache files that can be memory-mapped
+ * @details One text line identifies the file format, padded with zeros to
+ * CACHE_FILE_ALIGN, followed by the payload. Payload offsets that are
+ * multiples of the element size can be used in place without copying.
+ */
+#define CACHE_FILE_ALIGN (64)
+
+/// write header line and padding, throws QString for use with writeFileAtomically
+void writeCacheHeader(QFile& f, const QString& header);
+
+/**
+ * Map cache file for reading and verify the header
+ * @param f file to map, it must remain open for the lifetime of the mapping
+ * @param header expected header, exact match
+ * @param len set to the length of the payload
+ * @return pointer to payload or nullptr if invalid
+ * @note mapping is copy-on-write so the payload can be modified in place
+ */
+uchar* mapCacheFile(QFile& f, const QString& header, qint64* len);
+
 /// read binary blob
 void loadBinaryData(const QString& path, void** data, uint64_t* len, bool compress);
 
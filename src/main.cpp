@@ -161,8 +161,8 @@ int printCompletions(const char* argv0, const QStringList& args) {
                      "-headless", "-dups", "-similar", "-select-none", "-select-all",
                      "-select-errors", "-first", "-chop", "-first-sibling", "-sort-similar",
                      "-remove", "-nuke", "-rename", "-sets", "-folders", "-exit-on-select", "-show",
-                     "-help", "-version", "-about", "-verify", "-vacuum", "-select-result",
-                     "-license", "-cwd", "-init", "-list-search-params", "-list-index-params",
+                     "-help", "-version", "-about", "-verify", "-vacuum", "-stats",
+                     "-select-result", "-license", "-cwd", "-init", "-list-search-params", "-list-index-params",
                      "-weeds", /*"-track-weeds",*/ "-nuke-weeds", "-dump", "-list-formats",
                      "-focus-first", "-no-delete", "-v", "-verbose", "-q", "-quiet", "-list-codecs",
                      "-migrate",
@@ -1759,6 +1759,8 @@ int main(int argc, char** argv) {
       _commands.testCsv(engine(), nextArg());
     } else if (arg == "-vacuum") {
       engine().db->vacuum();
+    } else if (arg == "-stats") {
+      engine().db->printStats();
     } else if (arg == "-add-video") {
       const QString path = QFileInfo(nextArg()).absoluteFilePath();
       int accel = -1;
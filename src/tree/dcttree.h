@@ -23,9 +23,29 @@
 #include "../hamm.h"
 #include "../index.h"
 
+#include <unordered_set>
+
+// vptree unless another one is given to the build, e.g. DEFINES+=MIHTREE
+#if !defined(LIBVPTREE) && !defined(HAMMINGTREE) && !defined(MIHTREE)
 #define VPTREE (1)
-// #define LIBVPTREE (1)
-// #define HAMMINGTREE (1)
+#endif
+
+/// k-nearest for trees that only have a threshold search
+template <typename Tree, typename Accept>
+QVector<Index::Match> dctNearestBySearch(
+    Tree& tree, uint64_t target, int k, int threshold, const Accept& accept) {
+  QVector<Index::Match> matches = tree.search(target, threshold);
+  matches.removeIf([&accept](const Index::Match& m) { return !accept(m.mediaId); });
+  std::sort(matches.begin(), matches.end());
+  if (matches.count() > k) matches.resize(k);
+  return matches;
+}
+
+/// sharded search for trees that can't be split, shard 0 does all of it
+template <typename Tree>
+QVector<Index::Match> dctShardBySearch(Tree& tree, uint64_t target, int threshold, int shard) {
+  return shard == 0 ? tree.search(target, threshold) : QVector<Index::Match>();
+}
 
 // least-significant-bit tree for dct hash,
 // very fast but lower hit rate ~90%
@@ -33,7 +53,7 @@
 #if HAMMINGTREE
 #include "hammingtree.h"
 
-class DctTree {
+class DctTreeBase {
  public:
   HammingTree _tree;
 
@@ -52,6 +72,18 @@ class DctTree {
     for (auto& r : results) matches.append(Index::Match(r.value.index, r.distance));
     return matches;
   }
+
+  QVector<Index::Match> search(uint64_t target, int threshold, int shard, int numShards) {
+    (void)numShards;
+    return dctShardBySearch(*this, target, threshold, shard);
+  }
+
+  template <typename Accept>
+  QVector<Index::Match> nearest(uint64_t target, int k, int threshold, const Accept& accept) {
+    return dctNearestBySearch(*this, target, k, threshold, accept);
+  }
+
+  size_t memoryUsage() const { return _tree.stats().memory; }
 };
 
 #endif
@@ -67,7 +99,7 @@ class DctPoint {
   uint32_t id;
 };
 
-class DctTree : public VPTree<DctPoint> {
+class DctTreeBase : public VPTree<DctPoint> {
  public:
   double distance(const DctPoint& p1, const DctPoint& p2) override {
     return hamm64(p1.hash, p2.hash);
@@ -92,6 +124,19 @@ class DctTree : public VPTree<DctPoint> {
     }
     return matches;
   }
+
+  QVector<Index::Match> search(uint64_t target, int threshold, int shard, int numShards) {
+    (void)numShards;
+    return dctShardBySearch(*this, target, threshold, shard);
+  }
+
+  template <typename Accept>
+  QVector<Index::Match> nearest(uint64_t target, int k, int threshold, const Accept& accept) {
+    return dctNearestBySearch(*this, target, k, threshold, accept);
+  }
+
+  // the library has no way to measure its nodes
+  size_t memoryUsage() const { return sizeof(*this); }
 };
 #endif
 
@@ -100,7 +145,7 @@ class DctTree : public VPTree<DctPoint> {
 #if VPTREE
 #include "vptree.h"
 
-class DctTree {
+class DctTreeBase {
   struct vpValue {
     uint64_t hash;
     uint32_t id;
@@ -135,5 +180,204 @@ class DctTree {
     }
     return matches;
   }
+
+  QVector<Index::Match> search(uint64_t target, int threshold, int shard, int numShards) {
+    std::vector<int> distances;
+    std::vector<vpValue> results;
+    _tree.search(vpValue{target, 0}, threshold, shard, numShards, &results, &distances);
+
+    QVector<Index::Match> matches;
+    for (size_t i = 0; i < distances.size(); ++i)
+      matches.append(Index::Match(results[i].id, distances[i]));
+    return matches;
+  }
+
+  template <typename Accept>
+  QVector<Index::Match> nearest(uint64_t target, int k, int threshold, const Accept& accept) {
+    std::vector<int> distances;
+    std::vector<vpValue> results;
+    _tree.nearest(
+        vpValue{target, 0}, size_t(k), threshold,
+        [&accept](const vpValue& v) { return accept(v.id); }, &results, &distances);
+
+    QVector<Index::Match> matches;
+    for (size_t i = 0; i < distances.size(); ++i)
+      matches.append(Index::Match(results[i].id, distances[i]));
+    return matches;
+  }
+
+  size_t memoryUsage() const { return _tree.stats().memory; }
 };
 #endif
+
+// multi-index hashing, exact results like vptree, much faster
+// for small thresholds, uses ~4x more memory
+#if MIHTREE
+#include "mih.h"
+
+class DctTreeBase {
+  typedef MultiIndexHash_t<uint32_t> MultiIndexHash;
+  MultiIndexHash _tree;
+
+ public:
+  void create(uint64_t* hashes, uint32_t* ids, int numHashes) {
+    std::vector<MultiIndexHash::Value> values;
+    values.reserve(size_t(numHashes));
+    for (int i = 0; i < numHashes; ++i) values.push_back(MultiIndexHash::Value(ids[i], hashes[i]));
+    _tree.create(values);
+  }
+
+  QVector<Index::Match> search(uint64_t target, int threshold) {
+    std::vector<MultiIndexHash::Match> results;
+    _tree.search(target, threshold, results);
+
+    QVector<Index::Match> matches;
+    for (auto& r : results) matches.append(Index::Match(r.value.index, r.distance));
+    return matches;
+  }
+
+  QVector<Index::Match> search(uint64_t target, int threshold, int shard, int numShards) {
+    (void)numShards;
+    return dctShardBySearch(*this, target, threshold, shard);
+  }
+
+  template <typename Accept>
+  QVector<Index::Match> nearest(uint64_t target, int k, int threshold, const Accept& accept) {
+    return dctNearestBySearch(*this, target, k, threshold, accept);
+  }
+
+  size_t memoryUsage() const { return _tree.memoryUsage(); }
+};
+#endif
+
+/**
+ * @class DctTree
+ * @brief Incremental updates for the selected tree
+ *
+ * Building the tree is expensive, so additions go to an append buffer that is
+ * searched linearly, and removals are tombstones that filter the results. Once
+ * the fraction of changes to the tree exceeds rebuildFraction(), the owner
+ * should call create() again.
+ */
+class DctTree : public DctTreeBase {
+  size_t _treeSize = 0;                 // number of values given to create()
+  std::vector<uint32_t> _treeIds;       // sorted ids given to create()
+  std::vector<uint64_t> _pendingHashes; // values added since create()
+  std::vector<uint32_t> _pendingIds;
+  std::unordered_set<uint32_t> _removed; // ids removed since create()
+  float _rebuildFraction = 0.1f;
+
+ public:
+  void create(uint64_t* hashes, uint32_t* ids, int numHashes) {
+    DctTreeBase::create(hashes, ids, numHashes);
+    _treeSize = size_t(numHashes);
+    _treeIds.assign(ids, ids + numHashes);
+    std::sort(_treeIds.begin(), _treeIds.end());
+    _treeIds.erase(std::unique(_treeIds.begin(), _treeIds.end()), _treeIds.end());
+    _pendingHashes.clear();
+    _pendingIds.clear();
+    _removed.clear();
+  }
+
+  /// Add values without rebuilding the tree
+  void insert(const uint64_t* hashes, const uint32_t* ids, int numHashes) {
+    _pendingHashes.insert(_pendingHashes.end(), hashes, hashes + numHashes);
+    _pendingIds.insert(_pendingIds.end(), ids, ids + numHashes);
+  }
+
+  /// Remove values by id without rebuilding the tree
+  void remove(const QSet<int>& ids) {
+    // only values in the tree need a tombstone, the owner may pass ids we never had
+    for (int id : ids)
+      if (std::binary_search(_treeIds.begin(), _treeIds.end(), uint32_t(id)))
+        _removed.insert(uint32_t(id));
+
+    // values in the append buffer can be removed for real
+    size_t j = 0;
+    for (size_t i = 0; i < _pendingIds.size(); ++i)
+      if (!ids.contains(int(_pendingIds[i]))) {
+        _pendingHashes[j] = _pendingHashes[i];
+        _pendingIds[j] = _pendingIds[i];
+        j++;
+      }
+    _pendingHashes.resize(j);
+    _pendingIds.resize(j);
+  }
+
+  /// Fraction of the tree that may change before needsRebuild() is true
+  float rebuildFraction() const { return _rebuildFraction; }
+  void setRebuildFraction(float fraction) { _rebuildFraction = fraction; }
+
+  /// @return true if create() should be called to merge changes
+  bool needsRebuild() const {
+    const size_t changes = _pendingIds.size() + _removed.size();
+    return changes > 0 && changes >= _rebuildFraction * _treeSize;
+  }
+
+  /// Tree plus the pending changes; the tombstone set is estimated from its node size
+  size_t memoryUsage() const {
+    return DctTreeBase::memoryUsage() + sizeof(*this) - sizeof(DctTreeBase) +
+           VECTOR_SIZE(_treeIds) + VECTOR_SIZE(_pendingHashes) + VECTOR_SIZE(_pendingIds) +
+           _removed.bucket_count() * sizeof(void*) +
+           _removed.size() * (sizeof(void*) + sizeof(uint32_t));
+  }
+
+  QVector<Index::Match> search(uint64_t target, int threshold) {
+    QVector<Index::Match> matches = DctTreeBase::search(target, threshold);
+
+    // zero id means removed by the owner before create()
+    matches.removeIf([this](const Index::Match& m) {
+      return m.mediaId == 0 || _removed.find(m.mediaId) != _removed.end();
+    });
+
+    const size_t count = _pendingHashes.size();
+    for (size_t i = 0; i < count; ++i) {
+      int distance = hamm64(target, _pendingHashes[i]);
+      if (distance < threshold && _pendingIds[i] != 0)
+        matches.append(Index::Match(_pendingIds[i], distance));
+    }
+
+    return matches;
+  }
+
+  /// Search part of the tree, the union of all shards is the same as search()
+  QVector<Index::Match> search(uint64_t target, int threshold, int shard, int numShards) {
+    QVector<Index::Match> matches = DctTreeBase::search(target, threshold, shard, numShards);
+
+    matches.removeIf([this](const Index::Match& m) {
+      return m.mediaId == 0 || _removed.find(m.mediaId) != _removed.end();
+    });
+
+    // each shard takes a slice of the append buffer
+    const size_t count = _pendingHashes.size();
+    const size_t end = count * size_t(shard + 1) / size_t(numShards);
+    for (size_t i = count * size_t(shard) / size_t(numShards); i < end; ++i) {
+      int distance = hamm64(target, _pendingHashes[i]);
+      if (distance < threshold && _pendingIds[i] != 0)
+        matches.append(Index::Match(_pendingIds[i], distance));
+    }
+
+    return matches;
+  }
+
+  /// @return up to k nearest values with distance < threshold, sorted by distance
+  QVector<Index::Match> nearest(uint64_t target, int k, int threshold) {
+    QVector<Index::Match> matches =
+        DctTreeBase::nearest(target, k, threshold, [this](uint32_t id) {
+          return id != 0 && _removed.find(id) == _removed.end();
+        });
+
+    const size_t count = _pendingHashes.size();
+    for (size_t i = 0; i < count; ++i) {
+      int distance = hamm64(target, _pendingHashes[i]);
+      if (distance < threshold && _pendingIds[i] != 0)
+        matches.append(Index::Match(_pendingIds[i], distance));
+    }
+
+    if (count > 0) {
+      std::sort(matches.begin(), matches.end());
+      if (matches.count() > k) matches.resize(k);
+    }
+    return matches;
+  }
+};
@@ -21,6 +21,8 @@
 #pragma once
 #include "../env.h"
 #include "../hamm.h"
+#include "../ioutil.h"
+#include <QtConcurrent/QtConcurrentRun>
 #include <unordered_set>
 
 /**
@@ -53,8 +55,11 @@ class HammingTree_t
 {
  public:
   enum {
-    FILE_VERSION = 2,         // v1 had no version header
+    FILE_VERSION = 3,         // v1 had no version header, v2 was not mappable
     CLUSTER_SIZE = 64 * 1024, // minimum size of a node before partitioning
+    CLUSTER_ALIGN = 4096,     // file offset of each leaf, so leaves start on a page
+    PARALLEL_DEPTH = 5,       // insertConcurrent(): subtrees above this depth run in parallel
+    PARALLEL_MIN = 16 * 1024, // insertConcurrent(): minimum values to start another thread
   };
 
   typedef index_type index_t; // v2 optionally larger for video index
@@ -88,7 +93,9 @@ class HammingTree_t
   /// Stats traversal type
   struct Stats
   {
-    size_t memory = sizeof(HammingTree_t<index_t>);
+    size_t memory = sizeof(HammingTree_t<index_t>); // bytes allocated, including slack
+    size_t slack = 0;  // unused bytes of leaf arrays (malloc rounding, removed values)
+    size_t mapped = 0; // bytes of leaves in the cache file, not included in memory
     int numNodes = 0;
     int maxHeight = 0;
     int numValues = 0;
@@ -124,7 +131,21 @@ class HammingTree_t
 
     if (!_root) _root = new Node;
 
-    insert(_root, values, 0);
+    insert(_root, values, 0, 0);
+  }
+
+  /**
+   * Same as insert(), but the left and right subtrees of the upper levels are
+   * updated concurrently on the global thread pool
+   * @note each subtree gets the same values in the same order as insert(), so
+   *       the tree is identical, including the order of values in the leaves
+   */
+  void insertConcurrent(std::vector<Value>& values) {
+    _count += values.size();
+
+    if (!_root) _root = new Node;
+
+    insert(_root, values, 0, PARALLEL_DEPTH);
   }
 
   /// Remove nodes
@@ -154,49 +175,109 @@ class HammingTree_t
 
   // header written to files
   static QString fileHeader() {
-    return QStringLiteral("cbird hamming tree:%1:%2:%3:%4\n")
+    return QStringLiteral("cbird hamming tree:%1:%2:%3:%4")
         .arg(FILE_VERSION)
         .arg(sizeof(index_t))
         .arg(sizeof(hash_t))
         .arg(CLUSTER_SIZE);
   }
 
-  /// Read tree from file
-  bool read(QFile& f) {
-    // use text file header,maxlen 128
-    if (FILE_VERSION > 1) {
-      QByteArray header = f.readLine(128);
-
-      if (header.length() > 0) header.resize(header.length() - 1); // drop '\n'
+  /**
+   * Map tree from cache file written by write()
+   * @details Only the nodes are read, leaves point into the file and are paged
+   *          in by searches. A leaf is copied to the heap when insert() changes it.
+   *          remove() modifies the private mapping in place.
+   * @return false if the file is incompatible or corrupt, the tree is then empty
+   */
+  bool map(const QString& path) {
+    clear();
+
+    auto* f = new QFile(path);
+    qint64 len = 0;
+    const uchar* ptr = mapCacheFile(*f, fileHeader(), &len);
+
+    FileHeader header{0, 0};
+    bool ok = ptr && size_t(len) >= sizeof(header);
+    if (ok) {
+      memcpy(&header, ptr, sizeof(header));
+      ok = header.numNodes <= (size_t(len) - sizeof(header)) / sizeof(FileNode);
+    }
 
-      QList<QByteArray> fields = header.split(':');
-      if (fields.count() < 1 || fields[0] != "cbird hamming tree") {
-        qDebug() << "old file format?:" << QString(header);
-        qDebug() << "expected" << fileHeader();
-        return false;
-      }
+    if (ok && header.numNodes > 0) {
+      const auto* nodes = reinterpret_cast<const FileNode*>(ptr + sizeof(header));
+      size_t next = 0;
+      _root = mapNode(nodes, header.numNodes, next, ptr, size_t(len), 0);
+      ok = _root && next == header.numNodes;
+    }
 
-      if (fields.count() != 5 //
-          || fields[1] != QString::number(FILE_VERSION)
-          || fields[2] != QString::number(sizeof(index_t))
-          || fields[3] != QString::number(sizeof(hash_t))
-          || fields[4] != QString::number(CLUSTER_SIZE)) {
-        qDebug() << "incompatible format:" << QString(header);
-        qDebug() << "expected" << fileHeader();
-        return false;
-      }
+    if (!ok) {
+      delete f;
+      clear();
+      return false;
     }
 
-    _root = readNode(f);
-    return _root != nullptr;
+    _file = f;
+    _count = header.numValues;
+    return true;
   }
 
-  /// Write tree to file
-  void write(QFile& f) {
-    QByteArray header = fileHeader().toLatin1();
-    Q_ASSERT(header.length() == f.write(header.data()));
+  /**
+   * Write tree to file that map() can use
+   * @details Nodes are written in depth-first order, followed by the leaves,
+   *          each one aligned to CLUSTER_ALIGN. Removed values are dropped.
+   * @throw QString on write error
+   */
+  void write(QFile& f) const {
+    writeCacheHeader(f, fileHeader());
+    const qint64 payload = f.pos();
+
+    // layout the leaves after the node table
+    std::vector<FileNode> nodes;
+    std::vector<const Node*> leaves;
+    if (_root) flatten(_root, nodes, leaves);
+
+    auto align = [payload](uint64_t offset) {
+      const uint64_t pos = uint64_t(payload) + offset;
+      return (pos + CLUSTER_ALIGN - 1) / CLUSTER_ALIGN * CLUSTER_ALIGN - uint64_t(payload);
+    };
+
+    FileHeader header{uint64_t(nodes.size()), 0};
+    uint64_t offset = align(sizeof(header) + sizeof(FileNode) * nodes.size());
+    for (FileNode& n : nodes)
+      if (n.bit < 0 && n.count > 0) {
+        n.offset = offset;
+        offset = align(offset + n.count * (sizeof(hash_t) + sizeof(index_t)));
+        header.numValues += n.count;
+      }
+
+    writeBytes(f, &header, sizeof(header));
+    writeBytes(f, nodes.data(), sizeof(FileNode) * nodes.size());
+
+    std::vector<hash_t> hashes;
+    std::vector<index_t> indices;
+    for (const Node* level : leaves) {
+      hashes.clear();
+      indices.clear();
+      for (size_t i = 0; i < level->count; ++i)
+        if (!(level->indices[i] == index_t(0))) {
+          hashes.push_back(level->hashes[i]);
+          indices.push_back(level->indices[i]);
+        }
+      if (hashes.empty()) continue;
+
+      const qint64 pos = payload + qint64(align(uint64_t(f.pos() - payload)));
+      writeBytes(f, QByteArray(int(pos - f.pos()), '\0').constData(), size_t(pos - f.pos()));
+      writeBytes(f, hashes.data(), sizeof(hash_t) * hashes.size());
+      writeBytes(f, indices.data(), sizeof(index_t) * indices.size());
+    }
+  }
 
-    if (_root) writeNode(_root, f);
+  /// Copy mapped leaves to the heap and close the cache file, e.g. before replacing it
+  void detach() {
+    if (!_file) return;
+    if (_root) detach(_root);
+    delete _file;
+    _file = nullptr;
   }
 
   /// Print the tree structure
@@ -219,17 +300,33 @@ class HammingTree_t
     uint32_t count = 0;
     hash_t* hashes = nullptr;
     index_t* indices = nullptr;
+    bool mapped = false; // hashes/indices point into the cache file
 
     Node(){};
 
     ~Node() {
       delete left;
       delete right;
+      if (mapped) return;
       if (indices) free(indices);
       if (hashes) free(hashes);
     }
   };
 
+  // cache file layout, after the cache header
+  struct FileHeader
+  {
+    uint64_t numNodes;
+    uint64_t numValues;
+  };
+
+  struct FileNode
+  {
+    int32_t bit;     // < 0 if leaf
+    uint32_t count;  // leaf: number of values
+    uint64_t offset; // leaf: payload offset of hashes[count], then indices[count]
+  };
+
   static void partition(int bit, const std::vector<Value>& values, std::vector<Value>& left,
                         std::vector<Value>& right) {
     for (const Value& v : values)
@@ -261,7 +358,7 @@ class HammingTree_t
       // manually unrolled version ~25% faster?!
       // x8 unroll was slower
       size_t i;
-      for (i = 0; i < count - 4; i += 4) {
+      for (i = 0; i + 4 <= count; i += 4) { // count - 4 underflows
         distance_t d0 = hamm64(hash, hashes[i + 0]);
         bool b0 = d0 < threshold;
         distance_t d1 = hamm64(hash, hashes[i + 1]);
@@ -363,7 +460,22 @@ class HammingTree_t
     }
   }
 
-  static void insert(Node* level, const std::vector<Value>& values, int depth) {
+  /// insert into both children, in parallel if depth < parallelDepth
+  static void insertChildren(Node* level, std::vector<Value>& left, std::vector<Value>& right,
+                             int depth, int parallelDepth) {
+    if (depth < parallelDepth && left.size() >= PARALLEL_MIN && right.size() >= PARALLEL_MIN) {
+      QFuture<void> future = QtConcurrent::run(
+          [&]() { insert(level->left, left, depth + 1, parallelDepth); });
+      insert(level->right, right, depth + 1, parallelDepth);
+      future.waitForFinished();
+    } else {
+      insert(level->left, left, depth + 1, parallelDepth);
+      insert(level->right, right, depth + 1, parallelDepth);
+    }
+  }
+
+  static void insert(Node* level, const std::vector<Value>& values, int depth,
+                     int parallelDepth) {
     Q_ASSERT(depth < 64);
     if (values.size() <= 0) return;
 
@@ -372,8 +484,7 @@ class HammingTree_t
       std::vector<Value> left, right;
       partition(level->bit, values, left, right);
 
-      insert(level->left, left, depth + 1);
-      insert(level->right, right, depth + 1);
+      insertChildren(level, left, right, depth, parallelDepth);
     } else if (depth < 63 && level->count + values.size() > (CLUSTER_SIZE / sizeof(hash_t))) {
       // level (cluster) is full, chop it up
       int bit = getBit(depth);
@@ -392,19 +503,22 @@ class HammingTree_t
           right.push_back(value);
       }
 
-      free(level->indices);
-      free(level->hashes);
+      if (!level->mapped) {
+        free(level->indices);
+        free(level->hashes);
+      }
       level->indices = nullptr;
       level->hashes = nullptr;
+      level->mapped = false;
       level->count = 0;
 
       level->left = new Node;
       level->right = new Node;
 
-      insert(level->left, left, depth + 1);
-      insert(level->right, right, depth + 1);
+      insertChildren(level, left, right, depth, parallelDepth);
     } else {
       // leaf is not full, add some more
+      if (level->mapped) detach(level);
       size_t offset = level->count;
 
       level->count += values.size();
@@ -456,75 +570,85 @@ class HammingTree_t
     return level;
   }
 
-  template<typename T>
-  static bool readScalar(QFile& f, T& x) {
-    return f.read((char*) &x, sizeof(T)) == sizeof(T);
-  }
-
-  template<typename T>
-  static bool readBuffer(QFile& f, T& x, size_t count) {
-    static_assert(std::is_pointer<T>(), "");
-    qint64 len = sizeof(std::remove_pointer_t<T>) * count;
-    x = (T) malloc(len);
-    return f.read((char*) x, len) == len;
-  }
+  static Node* mapNode(const FileNode* nodes, size_t numNodes, size_t& next,
+                       const uchar* payload, size_t len, int depth) {
+    if (next >= numNodes || depth > 64) return nullptr;
 
-  static Node* readNode(QFile& f) {
+    const FileNode& n = nodes[next++];
     Node* level = new Node;
-
-    bool isLeaf;
-    Q_ASSERT(readScalar(f, isLeaf));
-
-    if (f.atEnd())
-      ;
-    else if (!isLeaf) {
-      Q_ASSERT(readScalar(f, level->bit));
-
-      level->left = readNode(f);
-      level->right = readNode(f);
-    } else {
-      Q_ASSERT(readScalar(f, level->count));
-      if (level->count > 0) {
-        Q_ASSERT(readBuffer(f, level->indices, level->count));
-        Q_ASSERT(malloc_size(level->indices) >= level->count * sizeof(*level->indices));
-
-        Q_ASSERT(readBuffer(f, level->hashes, level->count));
-        Q_ASSERT(malloc_size(level->hashes) >= level->count * sizeof(*level->hashes));
+    level->bit = n.bit;
+
+    if (n.bit >= 0) {
+      level->left = mapNode(nodes, numNodes, next, payload, len, depth + 1);
+      level->right = level->left ? mapNode(nodes, numNodes, next, payload, len, depth + 1)
+                                 : nullptr;
+      if (!level->right) {
+        delete level;
+        return nullptr;
       }
+    } else if (n.count > 0) {
+      const size_t size = n.count * (sizeof(hash_t) + sizeof(index_t));
+      if (n.offset % sizeof(hash_t) != 0 || n.offset > len || size > len - n.offset) {
+        delete level;
+        return nullptr;
+      }
+      level->mapped = true;
+      level->count = n.count;
+      level->hashes = (hash_t*) (payload + n.offset);
+      level->indices = (index_t*) (payload + n.offset + n.count * sizeof(hash_t));
     }
     return level;
   }
 
-  static void writeNode(const Node* level, QFile& f) {
-    bool isLeaf = level->left == nullptr;
-    if (isLeaf) {
-      // TODO: compact entries that have been "removed" (index == 0)
-      QByteArray data;
-      data.append((char*) &isLeaf, sizeof(isLeaf));
-      data.append((char*) &level->count, sizeof(level->count));
-
-      if (level->count > 0) {
-        data.append((char*) level->indices, sizeof(*level->indices) * level->count);
-        data.append((char*) level->hashes, sizeof(*level->hashes) * level->count);
-      }
-
-      if (Q_UNLIKELY(data.length() != f.write(data))) throw f.errorString();
+  static void flatten(const Node* level, std::vector<FileNode>& nodes,
+                      std::vector<const Node*>& leaves) {
+    if (level->left) {
+      nodes.push_back(FileNode{level->bit, 0, 0});
+      flatten(level->left, nodes, leaves);
+      flatten(level->right, nodes, leaves);
     } else {
-      QByteArray data;
-      data.append((char*) &isLeaf, sizeof(isLeaf));
-      data.append((char*) &level->bit, sizeof(level->bit));
-      if (Q_UNLIKELY(data.length() != f.write(data))) throw f.errorString();
+      uint32_t count = 0;
+      for (size_t i = 0; i < level->count; ++i)
+        if (!(level->indices[i] == index_t(0))) count++;
+      nodes.push_back(FileNode{-1, count, 0});
+      leaves.push_back(level);
+    }
+  }
 
-      writeNode(level->left, f);
-      writeNode(level->right, f);
+  static void detach(Node* level) {
+    if (level->left) {
+      detach(level->left);
+      detach(level->right);
+    } else if (level->mapped) {
+      hash_t* hashes = strict_malloc(hashes, level->count);
+      index_t* indices = strict_malloc(indices, level->count);
+      memcpy(hashes, level->hashes, sizeof(*hashes) * level->count);
+      memcpy(indices, level->indices, sizeof(*indices) * level->count);
+      level->hashes = hashes;
+      level->indices = indices;
+      level->mapped = false;
     }
   }
 
+  static void writeBytes(QFile& f, const void* data, size_t len) {
+    if (qint64(len) != f.write(reinterpret_cast<const char*>(data), qint64(len)))
+      throw f.errorString();
+  }
+
   static void stats(const Node* level, Stats& st, int height) {
     st.numNodes++;
     st.maxHeight = std::max(st.maxHeight, height);
     st.memory += sizeof(Node);
-    st.memory += level->count * (sizeof(index_t) + sizeof(hash_t));
+    const size_t used = level->count * (sizeof(index_t) + sizeof(hash_t));
+    if (level->mapped) {
+      st.mapped += used;
+    } else {
+      size_t allocated = 0;
+      if (level->hashes) allocated += malloc_size(level->hashes);
+      if (level->indices) allocated += malloc_size(level->indices);
+      st.memory += std::max(used, allocated);
+      st.slack += std::max(used, allocated) - used;
+    }
     st.numValues += level->count;
     st.smallNodes += level->count < (CLUSTER_SIZE / sizeof(hash_t)) ? 1 : 0;
 
@@ -534,9 +658,10 @@ class HammingTree_t
     }
   }
 
-  void init() { _root = nullptr, _count = 0; }
+  void init() { _root = nullptr, _count = 0, _file = nullptr; }
   void clear() {
-    delete _root;
+    delete _root; // before the mapping goes away
+    delete _file;
     init();
   }
   bool empty() const { return _root == nullptr; }
@@ -561,4 +686,5 @@ class HammingTree_t
 
   Node* _root;
   size_t _count;
+  QFile* _file; // mapped cache file, see map()
 };
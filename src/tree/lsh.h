@@ -0,0 +1,335 @@
+/* Locality-sensitive hashing for binary descriptors
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+
+#include "../hamm.h"
+#include "../ioutil.h"
+
+#include <QtConcurrent/QtConcurrentMap>
+
+/**
+ * @class OrbLsh
+ * @brief Approximate k-nearest search of 256-bit binary descriptors (ORB)
+ *
+ * Each table keys the descriptors by a random sample of their bits (bit sampling
+ * LSH) and stores the rows of each bucket contiguously. A query probes its own
+ * bucket and every bucket one bit away, in every table, then candidates are
+ * verified with the full 256-bit distance.
+ *
+ * Queries are batched: the probes of all queries are sorted by bucket so
+ * each bucket is read once while it is in cache.
+ *
+ * The descriptors are not owned, every call takes the descriptor matrix
+ * as an array of blocks of 2^BlockShift rows (32 bytes per row). The blocks
+ * may move but must not change the rows that were added. Rows appended after
+ * the tables were built are scanned linearly until there are enough of them
+ * to rebuild.
+ */
+class OrbLsh {
+  Q_DISABLE_COPY_MOVE(OrbLsh);
+
+ public:
+  enum {
+    DescBytes = 32,    // bytes per descriptor
+    BlockShift = 16,   // descriptor matrix is in blocks of 2^BlockShift rows
+    NumTables = 4,     // more tables improves recall, costs memory and query time
+    BucketSize = 64,   // average rows per bucket, determines the key size
+    MaxKeyBits = 24,   // limits the table size to 2^24 buckets
+    MinTail = 16384,   // rows that can be appended without rebuilding
+    TailPercent = 10,  // or percent of rows in the tables
+    FileVersion = 1,
+  };
+
+  /// Output of knnSearch()
+  struct Match {
+    uint32_t index = UINT32_MAX;  // row in the descriptor matrix, UINT32_MAX if none
+    int distance = INT_MAX;
+  };
+
+ private:
+  struct Table {
+    std::vector<uint8_t> bits;       // bit i of key is bit bits[i] of descriptor
+    std::vector<uint32_t> offsets;   // bucket i is positions[offsets[i]..offsets[i+1]]
+    std::vector<uint32_t> positions; // row numbers
+
+    uint32_t key(const uint8_t* desc) const {
+      uint32_t k = 0;
+      for (size_t i = 0; i < bits.size(); ++i)
+        k |= uint32_t((desc[bits[i] >> 3] >> (bits[i] & 7)) & 1) << i;
+      return k;
+    }
+  };
+
+  static const uint8_t* row(const uint8_t* const* blocks, size_t i) {
+    return blocks[i >> BlockShift] + (i & ((size_t(1) << BlockShift) - 1)) * DescBytes;
+  }
+
+  std::vector<Table> _tables;
+  std::vector<uint32_t> _tail;  // rows appended after build()
+  size_t _numIndexed = 0;       // rows in the tables
+
+  // file layout after the header: FileHeader, numTables*keyBits sampled bits,
+  // padding to 8 bytes, then offsets and positions of each table
+  struct FileHeader {
+    uint32_t numTables;
+    uint32_t keyBits;
+    uint64_t numIndexed;
+  };
+
+  static QString fileHeader() {
+    return QStringLiteral("cbird orb lsh:%1:%2").arg(FileVersion).arg(DescBytes);
+  }
+
+ public:
+  OrbLsh() {}
+
+  /// Number of rows in the index
+  size_t size() const { return _numIndexed + _tail.size(); }
+
+  /// Build tables for rows [0..count) from scratch
+  void build(const uint8_t* const* blocks, size_t count) {
+    Q_ASSERT(count < UINT32_MAX);
+
+    int keyBits = int(std::log2(std::max(2.0, double(count) / BucketSize)));
+    keyBits = std::min(int(MaxKeyBits), std::max(1, keyBits));
+
+    _tail.clear();
+    _numIndexed = count;
+    _tables.clear();
+    _tables.resize(NumTables);
+
+    // the seed is fixed so the same rows always produce the same tables
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (Table& table : _tables) {
+      // partial fisher-yates to sample keyBits distinct bits
+      uint8_t perm[DescBytes * 8];
+      for (int i = 0; i < DescBytes * 8; ++i) perm[i] = uint8_t(i);
+      for (int i = 0; i < keyBits; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        std::swap(perm[i], perm[i + int(seed % uint64_t(DescBytes * 8 - i))]);
+      }
+      table.bits.assign(perm, perm + keyBits);
+    }
+
+    QtConcurrent::blockingMap(_tables, [blocks, count, keyBits](Table& table) {
+      // counting sort of rows by key
+      const size_t numBuckets = size_t(1) << keyBits;
+      std::vector<uint32_t> keys(count);
+      table.offsets.assign(numBuckets + 1, 0);
+      for (size_t i = 0; i < count; ++i) {
+        keys[i] = table.key(row(blocks, i));
+        table.offsets[keys[i] + 1]++;
+      }
+
+      for (size_t i = 0; i < numBuckets; ++i) table.offsets[i + 1] += table.offsets[i];
+
+      table.positions.resize(count);
+      std::vector<uint32_t> fill(table.offsets.begin(), table.offsets.end() - 1);
+      for (size_t i = 0; i < count; ++i) table.positions[fill[keys[i]]++] = uint32_t(i);
+    });
+  }
+
+  /// Add rows [size()..count), rebuilds the tables if too many were appended
+  void append(const uint8_t* const* blocks, size_t count) {
+    Q_ASSERT(count >= size() && count < UINT32_MAX);
+    const size_t maxTail = std::max(size_t(MinTail), _numIndexed * TailPercent / 100);
+    if (_tables.empty() || count - _numIndexed > maxTail) {
+      build(blocks, count);
+      return;
+    }
+    for (size_t i = size(); i < count; ++i) _tail.push_back(uint32_t(i));
+  }
+
+  /**
+   * Find the k nearest rows of each query
+   * @param blocks descriptor matrix
+   * @param queries query descriptors, 32 bytes each
+   * @param numQueries number of queries
+   * @param k matches per query
+   * @param maxDistance only find matches with distance < maxDistance
+   * @param matches output, k per query in ascending distance,
+   *        unused matches have index==UINT32_MAX
+   */
+  void knnSearch(const uint8_t* const* blocks,
+                 const uint8_t* queries,
+                 size_t numQueries,
+                 int k,
+                 int maxDistance,
+                 std::vector<Match>& matches) const {
+    matches.clear();
+    matches.resize(numQueries * size_t(k));
+    if (k <= 0 || size() == 0) return;
+
+    // insert in top k list of query, unless it was found by another table
+    auto consider = [&](size_t query, uint32_t row, int d) {
+      if (d >= maxDistance) return;
+      Match* top = matches.data() + query * size_t(k);
+      if (d >= top[k - 1].distance) return;
+      for (int i = 0; i < k && top[i].distance <= d; ++i)
+        if (top[i].index == row) return;
+
+      int i = k - 1;
+      for (; i > 0 && top[i - 1].distance > d; --i) top[i] = top[i - 1];
+      top[i].index = row;
+      top[i].distance = d;
+    };
+
+    std::vector<int> distances;
+
+    std::vector<std::pair<uint32_t, uint32_t>> probes;  // bucket, query
+    for (const Table& table : _tables) {
+      const int keyBits = int(table.bits.size());
+      probes.clear();
+      probes.reserve(numQueries * size_t(keyBits + 1));
+      for (size_t q = 0; q < numQueries; ++q) {
+        const uint32_t key = table.key(queries + q * DescBytes);
+        probes.emplace_back(key, uint32_t(q));
+        for (int b = 0; b < keyBits; ++b) probes.emplace_back(key ^ (1U << b), uint32_t(q));
+      }
+      std::sort(probes.begin(), probes.end());
+
+      for (const auto& probe : probes) {
+        const uint32_t begin = table.offsets[probe.first];
+        const uint32_t count = table.offsets[probe.first + 1] - begin;
+        if (count == 0) continue;
+
+        distances.resize(count);
+        hamm256Gather(queries + probe.second * DescBytes, blocks, BlockShift,
+                      table.positions.data() + begin, count, distances.data());
+        for (uint32_t j = 0; j < count; ++j)
+          consider(probe.second, table.positions[begin + j], distances[j]);
+      }
+    }
+
+    if (!_tail.empty()) {
+      distances.resize(_tail.size());
+      for (size_t q = 0; q < numQueries; ++q) {
+        hamm256Gather(queries + q * DescBytes, blocks, BlockShift, _tail.data(), _tail.size(),
+                      distances.data());
+        for (size_t j = 0; j < _tail.size(); ++j) consider(q, _tail[j], distances[j]);
+      }
+    }
+  }
+
+  /**
+   * Read tables written by write()
+   * @param path cache file
+   * @param blocks descriptor matrix
+   * @param count number of rows in the descriptor matrix, rows not in
+   *        the file are appended
+   * @return false if the file is missing or invalid, the index is empty
+   */
+  bool read(const QString& path, const uint8_t* const* blocks, size_t count) {
+    _tables.clear();
+    _tail.clear();
+    _numIndexed = 0;
+
+    QFile f(path);
+    qint64 len = 0;
+    const uchar* ptr = mapCacheFile(f, fileHeader(), &len);
+
+    FileHeader header{0, 0, 0};
+    bool ok = ptr && size_t(len) >= sizeof(header);
+    if (ok) {
+      memcpy(&header, ptr, sizeof(header));
+      ok = header.numTables > 0 && header.numTables <= 64 && header.keyBits > 0 &&
+           header.keyBits <= MaxKeyBits && header.numIndexed <= count && count < UINT32_MAX;
+    }
+
+    size_t bitsLen = 0, tableLen = 0;
+    if (ok) {
+      bitsLen = (header.numTables * header.keyBits + 7) & ~size_t(7);
+      tableLen = ((size_t(1) << header.keyBits) + 1 + header.numIndexed) * sizeof(uint32_t);
+      ok = size_t(len) == sizeof(header) + bitsLen + header.numTables * tableLen;
+    }
+
+    if (ok) {
+      const uchar* bits = ptr + sizeof(header);
+      const uchar* table = bits + bitsLen;
+      const size_t numBuckets = size_t(1) << header.keyBits;
+      _tables.resize(header.numTables);
+      for (Table& t : _tables) {
+        t.bits.assign(bits, bits + header.keyBits);
+        bits += header.keyBits;
+
+        const auto* offsets = reinterpret_cast<const uint32_t*>(table);
+        t.offsets.assign(offsets, offsets + numBuckets + 1);
+        t.positions.assign(offsets + numBuckets + 1, offsets + numBuckets + 1 + header.numIndexed);
+        table += tableLen;
+
+        // every bucket and position must be in bounds, then knnSearch() can't crash
+        ok = ok && t.offsets[0] == 0 && t.offsets[numBuckets] == header.numIndexed;
+        for (size_t i = 0; ok && i < numBuckets; ++i) ok = t.offsets[i] <= t.offsets[i + 1];
+        for (size_t i = 0; ok && i < t.positions.size(); ++i)
+          ok = t.positions[i] < header.numIndexed;
+      }
+    }
+
+    if (!ok) {
+      _tables.clear();
+      return false;
+    }
+
+    _numIndexed = header.numIndexed;
+    append(blocks, count);
+    return true;
+  }
+
+  /**
+   * Write tables to file that read() can use, appended rows are not included
+   * @throw QString on write error
+   */
+  void write(QFile& f) const {
+    writeCacheHeader(f, fileHeader());
+
+    const uint32_t keyBits = _tables.empty() ? 0 : uint32_t(_tables[0].bits.size());
+    const FileHeader header{uint32_t(_tables.size()), keyBits, _numIndexed};
+    qint64 len = qint64(sizeof(header));
+    if (len != f.write(reinterpret_cast<const char*>(&header), len)) throw f.errorString();
+
+    std::vector<uint8_t> bits;
+    for (const Table& t : _tables) bits.insert(bits.end(), t.bits.begin(), t.bits.end());
+    bits.resize((bits.size() + 7) & ~size_t(7), 0);
+    len = qint64(bits.size());
+    if (len != f.write(reinterpret_cast<const char*>(bits.data()), len)) throw f.errorString();
+
+    for (const Table& t : _tables) {
+      len = qint64(t.offsets.size() * sizeof(uint32_t));
+      if (len != f.write(reinterpret_cast<const char*>(t.offsets.data()), len))
+        throw f.errorString();
+      len = qint64(t.positions.size() * sizeof(uint32_t));
+      if (len != f.write(reinterpret_cast<const char*>(t.positions.data()), len))
+        throw f.errorString();
+    }
+  }
+
+  /// Memory used by the tables, not including the descriptors
+  size_t memoryUsage() const {
+    size_t bytes = sizeof(*this) + _tables.capacity() * sizeof(Table) +
+                   _tail.capacity() * sizeof(uint32_t);
+    for (const Table& t : _tables)
+      bytes += t.bits.capacity() +
+               (t.offsets.capacity() + t.positions.capacity()) * sizeof(uint32_t);
+    return bytes;
+  }
+};
@@ -0,0 +1,197 @@
+/* Multi-index hashing for DCT hashes
+   Copyright (C) 2021 scrubbbbs
+   Contact: screubbbebs@gemeaile.com =~ s/e//g
+   Project: https://github.com/scrubbbbs/cbird
+
+   This file is part of cbird.
+
+   cbird is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   cbird is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public
+   License along with cbird; if not, see
+   <https://www.gnu.org/licenses/>.  */
+#pragma once
+
+#include "../hamm.h"
+
+/**
+ * @class MultiIndexHash_t
+ * @brief Exact hamming radius search by multi-index hashing (Norouzi et al)
+ *
+ * The 64-bit hash is split into m substrings, and each substring has its own
+ * direct-mapped table of the values that contain it. If two hashes
+ * are within distance r, then by the pigeonhole principle at least one
+ * substring is within distance floor(r/m). So we only have to probe the
+ * buckets near each substring of the query, then verify the full distance.
+ *
+ * Results are identical to brute force. The number of probes per table grows
+ * with the binomial sum of floor(r/m), so it works best for small thresholds on
+ * large indexes; for high thresholds a linear scan is better.
+ *
+ * The number of substrings is chosen so each table has about as many buckets
+ * as values in the index.
+ */
+template<typename index_type = uint32_t>
+class MultiIndexHash_t
+{
+  Q_DISABLE_COPY_MOVE(MultiIndexHash_t);
+
+ public:
+  typedef index_type index_t;
+  typedef dcthash_t hash_t;
+  typedef int distance_t;
+
+  /// Input/output type
+  struct Value
+  {
+    index_t index;
+    hash_t hash;
+    Value(index_t index_, hash_t hash_)
+        : index(index_)
+        , hash(hash_) {}
+  };
+
+  struct Match
+  {
+    Value value;
+    distance_t distance;
+    Match(const Value& value_, distance_t distance_)
+        : value(value_)
+        , distance(distance_) {}
+    bool operator<(const Match& m) const { return distance < m.distance; }
+  };
+
+  enum {
+    MinTables = 3,  // limits the table size to 2^22 buckets
+    MaxTables = 8,  // fewer than 8 bits per table is pointless
+  };
+
+ private:
+  // substring of the hash used by one table
+  struct Table
+  {
+    int shift = 0;                 // first bit of substring
+    int bits = 0;                  // length of substring
+    std::vector<uint32_t> offsets; // bucket i is positions[offsets[i]..offsets[i+1]]
+    std::vector<uint32_t> positions;
+
+    uint32_t key(hash_t hash) const { return uint32_t(hash >> shift) & ((1U << bits) - 1); }
+  };
+
+  std::vector<hash_t> _hashes;
+  std::vector<index_t> _indices;
+  std::vector<Table> _tables;
+
+ public:
+  MultiIndexHash_t() {}
+
+  size_t size() const { return _hashes.size(); }
+
+  /// Build tables from scratch
+  void create(const std::vector<Value>& values) {
+    const size_t count = values.size();
+    Q_ASSERT(count < UINT32_MAX);
+
+    _hashes.resize(count);
+    _indices.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      _hashes[i] = values[i].hash;
+      _indices[i] = values[i].index;
+    }
+
+    // substring length ~= log2(count)
+    int numTables = int(std::round(64.0 / std::max(1.0, std::log2(double(count)))));
+    numTables = std::min(int(MaxTables), std::max(int(MinTables), numTables));
+
+    _tables.clear();
+    _tables.resize(numTables);
+
+    int shift = 0;
+    for (int t = 0; t < numTables; ++t) {
+      Table& table = _tables[t];
+      table.bits = (64 - shift) / (numTables - t);
+      table.shift = shift;
+      shift += table.bits;
+
+      // counting sort of positions by substring key
+      const size_t numBuckets = size_t(1) << table.bits;
+      table.offsets.assign(numBuckets + 1, 0);
+      for (size_t i = 0; i < count; ++i) table.offsets[table.key(_hashes[i]) + 1]++;
+
+      for (size_t i = 0; i < numBuckets; ++i) table.offsets[i + 1] += table.offsets[i];
+
+      table.positions.resize(count);
+      std::vector<uint32_t> fill(table.offsets.begin(), table.offsets.end() - 1);
+      for (size_t i = 0; i < count; ++i)
+        table.positions[fill[table.key(_hashes[i])]++] = uint32_t(i);
+    }
+  }
+
+  /// Find hash with distance(hash, cand) < threshold
+  void search(hash_t hash, distance_t threshold, std::vector<Match>& matches) const {
+    if (_hashes.empty() || threshold <= 0) return;
+
+    const int numTables = int(_tables.size());
+    const distance_t radius = threshold - 1;
+    const int subRadius = radius / numTables;
+
+    for (int t = 0; t < numTables; ++t) {
+      const Table& table = _tables[t];
+      const uint32_t key = table.key(hash);
+
+      forEachKey(key, table.bits, subRadius, [&](uint32_t probe) {
+        const uint32_t end = table.offsets[probe + 1];
+        for (uint32_t j = table.offsets[probe]; j < end; ++j) {
+          const uint32_t pos = table.positions[j];
+          const hash_t cand = _hashes[pos];
+          const distance_t d = hamm64(hash, cand);
+          if (d >= threshold) continue;
+
+          // if an earlier table was also within radius, the candidate was
+          // already found there
+          bool seen = false;
+          for (int k = 0; k < t && !seen; ++k)
+            seen = hamm64(_tables[k].key(hash), _tables[k].key(cand)) <= subRadius;
+
+          if (!seen) matches.push_back(Match(Value(_indices[pos], cand), d));
+        }
+      });
+    }
+  }
+
+  /// Memory used by the tables and values
+  size_t memoryUsage() const {
+    // VECTOR_SIZE() doesn't work on dependent types
+    size_t bytes = sizeof(*this) + _hashes.capacity() * sizeof(hash_t) +
+                   _indices.capacity() * sizeof(index_t) + _tables.capacity() * sizeof(Table);
+    for (const Table& t : _tables)
+      bytes += (t.offsets.capacity() + t.positions.capacity()) * sizeof(uint32_t);
+    return bytes;
+  }
+
+ private:
+  /// call fn(key ^ mask) for every mask of up to radius bits set
+  template<typename Fn>
+  static void forEachKey(uint32_t key, int bits, int radius, const Fn& fn) {
+    fn(key);
+    for (int r = 1; r <= std::min(radius, bits); ++r) {
+      // iterate masks with popcount r in ascending order (Gosper's hack)
+      const uint64_t limit = uint64_t(1) << bits;
+      uint64_t mask = (uint64_t(1) << r) - 1;
+      while (mask < limit) {
+        fn(key ^ uint32_t(mask));
+        const uint64_t c = mask & -mask;
+        const uint64_t n = mask + c;
+        mask = (((n ^ mask) >> 2) / c) | n;
+      }
+    }
+  }
+};
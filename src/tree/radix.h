@@ -22,6 +22,10 @@
 
 #include "../hamm.h"
 
+#include <QtConcurrent/QtConcurrentMap>
+#include <atomic>
+#include <numeric>
+
 /**
  * @brief Direct-mapped, Single-level Radix earch
  * 
@@ -32,11 +36,15 @@
  * 
  * By changing the radix value we also have a knob to turn to dramatically
  * decrease the search time, at the expense of losing some matches.
+ *
+ * Multi-probe search gets some of them back by also scanning the buckets
+ * whose radix bits differ from the query in up to r bits.
  */
 template<typename index_type = uint32_t>
 class RadixMap_t
 {
   Q_DISABLE_COPY_MOVE(RadixMap_t);
+  friend class TestTree;
 
  public:
   typedef index_type index_t;
@@ -66,27 +74,18 @@ class RadixMap_t
     bool operator<(const Match& m) const { return distance < m.distance; }
   };
 
-  struct Bucket
+  /// follows the caller's cache header in the file
+  struct FileHeader
   {
-    Q_DISABLE_COPY_MOVE(Bucket); // try not to copy/move
-
-    std::vector<hash_t> hashes; // using pointers to save memory here
-    std::vector<index_t> indices;
-
-    Bucket(){
-        // hashes.reserve(4096 / sizeof(hash_t));
-        // indices.reserve(4096 / sizeof(hash_t));
-    };
-
-    size_t size() const {
-      return sizeof(*this) + hashes.capacity() * sizeof(hash_t)
-             + indices.capacity() * sizeof(index_t);
-    }
+    uint32_t radix;
+    uint32_t unused;
+    uint64_t count; // number of hashes
   };
 
   struct Stats
   {
-    size_t memory = 0;
+    size_t memory = 0; // bytes allocated, including slack
+    size_t slack = 0;  // unused capacity of arrays
     uint numBuckets = 0;
     uint mean = 0;  // mean bucket size
     uint sigma = 0; // standard deviation
@@ -98,13 +97,17 @@ class RadixMap_t
  private:
   uint _radix = 1;
   hash_t _radixMask = 1;
-  std::vector<Bucket*> _buckets;
-  Bucket _emptyBucket;
+
+  // compressed sparse rows: bucket i is [_offsets[i], _offsets[i+1]) of
+  // _hashes and _indices, the same layout is used by write()
+  std::vector<uint32_t> _offsets;
+  std::vector<hash_t> _hashes;
+  std::vector<index_t> _indices;
 
  public:
   RadixMap_t(uint radix) {
     // limit buckets minimum memory usage to ~1GB
-    uint maxRadix = 30 - std::ceil(log2(sizeof(Bucket) + sizeof(Bucket*)));
+    uint maxRadix = 30 - std::ceil(log2(sizeof(uint32_t)));
 
     if (radix > maxRadix) {
       radix = maxRadix;
@@ -116,19 +119,64 @@ class RadixMap_t
     for (uint i = 0; i < radix; ++i)
       _radixMask |= 1 << i;
 
-    _buckets.resize(1U << _radix);
-    for (uint i = 0; i < 1U << _radix; ++i)
-      _buckets[i] = &_emptyBucket;
+    _offsets.resize((size_t(1) << _radix) + 1, 0);
   }
 
-  ~RadixMap_t() {
-    for (auto* b : _buckets)
-      if (b != &_emptyBucket) delete b;
+  uint radix() const { return _radix; }
+
+  /// number of hashes
+  size_t size() const { return _hashes.size(); }
+
+  /**
+   * Write buckets for read(), the caller writes the cache header
+   * @details layout: FileHeader, bucket offsets[2^radix+1], padding to
+   *          8 bytes, hashes[count], indices[count]
+   * @throw QString on write error
+   */
+  void write(QFile& f) const {
+    const FileHeader header{_radix, 0, _hashes.size()};
+    const uint32_t pad = 0;
+    writeBytes(f, &header, sizeof(header));
+    writeBytes(f, _offsets.data(), _offsets.size() * sizeof(uint32_t));
+    if (_offsets.size() % 2) writeBytes(f, &pad, sizeof(pad));
+    writeBytes(f, _hashes.data(), _hashes.size() * sizeof(hash_t));
+    writeBytes(f, _indices.data(), _indices.size() * sizeof(index_t));
+  }
+
+  /**
+   * Replace buckets with those written by write()
+   * @param data start of the write() output
+   * @param len bytes from data to the end of the file
+   * @return false if data is invalid or has a different radix
+   */
+  bool read(const uchar* data, size_t len) {
+    const size_t numBuckets = size_t(1) << _radix;
+
+    FileHeader header{0, 0, 0};
+    if (len < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.radix != _radix || header.count > UINT32_MAX) return false;
+
+    const size_t offsetsLen = ((numBuckets + 2) & ~size_t(1)) * sizeof(uint32_t);
+    if (len != sizeof(header) + offsetsLen + header.count * (sizeof(hash_t) + sizeof(index_t)))
+      return false;
+
+    const auto* offsets = reinterpret_cast<const uint32_t*>(data + sizeof(header));
+    if (offsets[0] != 0 || offsets[numBuckets] != header.count) return false;
+    for (size_t i = 0; i < numBuckets; ++i)
+      if (offsets[i] > offsets[i + 1]) return false;
+
+    const auto* hashes = reinterpret_cast<const hash_t*>(data + sizeof(header) + offsetsLen);
+    const auto* indices = reinterpret_cast<const index_t*>(hashes + header.count);
+    _offsets.assign(offsets, offsets + numBuckets + 1);
+    _hashes.assign(hashes, hashes + header.count);
+    _indices.assign(indices, indices + header.count);
+    return true;
   }
 
   uintptr_t addressOf(hash_t hash) const {
-    auto& hashes = _buckets[indexOf(hash)].hashes;
-    auto* p = Q_LIKELY(hashes.size()) ? hashes.data() : nullptr;
+    const size_t i = indexOf(hash);
+    auto* p = Q_LIKELY(_offsets[i] < _offsets[i + 1]) ? _hashes.data() + _offsets[i] : nullptr;
     return uintptr_t(p);
   }
 
@@ -140,43 +188,163 @@ class RadixMap_t
     return i;
   }
 
+  /**
+   * Add values after the existing ones in each bucket
+   * @note this copies the whole map, use build() to add many parts
+   */
   void insert(const std::vector<Value>& values) {
+    const size_t numBuckets = size_t(1) << _radix;
+    checkSize(_hashes.size() + values.size());
+
+    // new offsets, existing counts plus the inserted counts
+    std::vector<uint32_t> offsets(numBuckets + 1, 0);
+    for (auto& v : values) offsets[indexOf(v.hash) + 1]++;
+    for (size_t i = 0; i < numBuckets; ++i)
+      offsets[i + 1] += offsets[i] + (_offsets[i + 1] - _offsets[i]);
+
+    std::vector<hash_t> hashes(_hashes.size() + values.size());
+    std::vector<index_t> indices(hashes.size());
+    std::vector<uint32_t> cursor(numBuckets);
+    for (size_t i = 0; i < numBuckets; ++i) {
+      const uint32_t first = _offsets[i], count = _offsets[i + 1] - first;
+      std::copy_n(_hashes.data() + first, count, hashes.data() + offsets[i]);
+      std::copy_n(_indices.data() + first, count, indices.data() + offsets[i]);
+      cursor[i] = offsets[i] + count;
+    }
     for (auto& v : values) {
-      size_t index = indexOf(v.hash);
-      Bucket* bucket = _buckets[index];
-      if (Q_UNLIKELY(bucket == &_emptyBucket)) {
-        bucket = new Bucket;
-        _buckets[index] = bucket;
+      const uint32_t j = cursor[indexOf(v.hash)]++;
+      hashes[j] = v.hash;
+      indices[j] = v.index;
+    }
+
+    _offsets.swap(offsets);
+    _hashes.swap(hashes);
+    _indices.swap(indices);
+  }
+
+  /**
+   * Replace contents with the values of numParts parts, in parallel
+   * @param part part(i, values) appends values of part i, it is called
+   *        twice for each part and must give the same values both times
+   * @param less order of indices in each bucket
+   * @details Bucket sizes are counted in the first pass, which gives the
+   *          offsets, then the arrays are filled in the second. If less()
+   *          orders by part, then by position in the part, the result is
+   *          the same as calling insert() for each part in order.
+   */
+  template<typename PartFn, typename LessFn>
+  void build(int numParts, const PartFn& part, const LessFn& less) {
+    const size_t numBuckets = size_t(1) << _radix;
+    std::vector<std::atomic<uint32_t>> cursor(numBuckets);
+
+    std::vector<int> parts(size_t(std::max(numParts, 0)));
+    std::iota(parts.begin(), parts.end(), 0);
+
+    // call fn(bucket, first, last) for each run of values with the same bucket
+    const auto forEachRun = [&](int i, const auto& fn) {
+      std::vector<Value> values;
+      part(i, values);
+      std::stable_sort(values.begin(), values.end(), [this](const Value& a, const Value& b) {
+        return indexOf(a.hash) < indexOf(b.hash);
+      });
+      for (size_t j = 0; j < values.size();) {
+        const size_t index = indexOf(values[j].hash);
+        size_t k = j + 1;
+        while (k < values.size() && indexOf(values[k].hash) == index) k++;
+        fn(index, values.data() + j, uint32_t(k - j));
+        j = k;
       }
+    };
 
-      bucket->hashes.push_back(v.hash);
-      bucket->indices.push_back(v.index);
+    QtConcurrent::blockingMap(parts, [&](int& i) {
+      forEachRun(i, [&](size_t index, const Value*, uint32_t count) {
+        cursor[index].fetch_add(count, std::memory_order_relaxed);
+      });
+    });
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < numBuckets; ++i) total += cursor[i].load(std::memory_order_relaxed);
+    checkSize(total);
+
+    // cursor is the next position to fill in each bucket
+    _offsets[0] = 0;
+    for (size_t i = 0; i < numBuckets; ++i) {
+      const uint32_t count = cursor[i].load(std::memory_order_relaxed);
+      cursor[i].store(_offsets[i], std::memory_order_relaxed);
+      _offsets[i + 1] = _offsets[i] + count;
     }
+
+    std::vector<hash_t>().swap(_hashes);
+    std::vector<index_t>().swap(_indices);
+    _hashes.resize(total);
+    _indices.resize(total);
+
+    QtConcurrent::blockingMap(parts, [&](int& i) {
+      forEachRun(i, [&](size_t index, const Value* values, uint32_t count) {
+        const uint32_t first = cursor[index].fetch_add(count, std::memory_order_relaxed);
+        Q_ASSERT(first + count <= _offsets[index + 1]);
+        for (uint32_t j = 0; j < count; ++j) {
+          _hashes[first + j] = values[j].hash;
+          _indices[first + j] = values[j].index;
+        }
+      });
+    });
+
+    // parts were filled in any order
+    std::vector<std::pair<size_t, size_t>> ranges;
+    const size_t step = std::max(numBuckets / 256, size_t(1));
+    for (size_t i = 0; i < numBuckets; i += step)
+      ranges.emplace_back(i, std::min(i + step, numBuckets));
+
+    QtConcurrent::blockingMap(ranges, [&](std::pair<size_t, size_t>& range) {
+      std::vector<Value> values;
+      for (size_t i = range.first; i < range.second; ++i) {
+        const uint32_t first = _offsets[i], last = _offsets[i + 1];
+        values.clear();
+        for (uint32_t j = first; j < last; ++j) values.emplace_back(_indices[j], _hashes[j]);
+        std::sort(values.begin(), values.end(), [&less](const Value& a, const Value& b) {
+          return less(a.index, b.index);
+        });
+        for (uint32_t j = first; j < last; ++j) {
+          _hashes[j] = values[j - first].hash;
+          _indices[j] = values[j - first].index;
+        }
+      }
+    });
   }
 
   Stats stats() const {
+    const size_t numBuckets = size_t(1) << _radix;
+    const size_t valueSize = sizeof(hash_t) + sizeof(index_t);
+
     uint64_t sum = 0;
     uint min = UINT_MAX, max = 0, empty = 0;
-    for (size_t i = 0; i < (1U << _radix); ++i) {
-      uint bytes = _buckets[i] != &_emptyBucket ? _buckets[i]->size() : 0;
+    for (size_t i = 0; i < numBuckets; ++i) {
+      uint bytes = (_offsets[i + 1] - _offsets[i]) * valueSize;
       sum += bytes;
       min = std::min(min, bytes);
       max = std::max(max, bytes);
-      if (_buckets[i]->hashes.size() == 0) empty++;
+      if (bytes == 0) empty++;
     }
-    uint64_t memory = sum + sizeof(Bucket*) * (1U << _radix);
 
-    const uint mean = sum / (1U << (_radix & 0x1F));
+    const uint64_t memory = sizeof(*this) + _offsets.capacity() * sizeof(uint32_t) +
+                            _hashes.capacity() * sizeof(hash_t) +
+                            _indices.capacity() * sizeof(index_t);
+    const uint64_t slack = (_hashes.capacity() - _hashes.size()) * sizeof(hash_t) +
+                           (_indices.capacity() - _indices.size()) * sizeof(index_t);
+
+    const uint mean = sum / numBuckets;
     sum = 0;
-    for (size_t i = 0; i < (1U << _radix); ++i) {
-      size_t bytes = _buckets[i]->size();
+    for (size_t i = 0; i < numBuckets; ++i) {
+      int64_t bytes = (_offsets[i + 1] - _offsets[i]) * valueSize;
       int64_t x = (bytes - mean);
       sum += x * x;
     }
-    uint stdDev = sqrt(sum / (1U << (_radix & 0x1F)));
+    uint stdDev = sqrt(sum / numBuckets);
 
     return Stats{.memory = memory,
-                 .numBuckets = 1U << _radix,
+                 .slack = slack,
+                 .numBuckets = uint(numBuckets),
                  .mean = mean,
                  .sigma = stdDev,
                  .min = min,
@@ -184,11 +352,62 @@ class RadixMap_t
                  .empty = empty};
   }
 
-  void search(hash_t hash, distance_t threshold, std::vector<Match>& matches) const {
-    const Bucket* bucket = _buckets[indexOf(hash)];
-    const std::vector<hash_t>& hashes = bucket->hashes;
-    const std::vector<index_t>& indices = bucket->indices;
-    const size_t count = hashes.size();
+  /**
+   * Find hashes with distance(hash, cand) < threshold
+   * @param probeRadius also search buckets whose radix bits are within this
+   *        many bits of the hash, recovers matches that differ in the radix bits
+   */
+  void search(hash_t hash,
+              distance_t threshold,
+              std::vector<Match>& matches,
+              int probeRadius = 0) const {
+    forEachProbe(indexOf(hash), threshold, probeRadius, [&](size_t index) {
+      searchBucket(index, hash, threshold, matches);
+    });
+  }
+
+  enum { vectorSize = 8 }; // 8 may enable AVX512 8x64 popcnt
+
+  /// Search vectorSize hashes at once, they should be in the same bucket
+  void search(const hash_t* __restrict queryHashes,
+              distance_t threshold,
+              std::vector<Match>* matches,
+              int probeRadius = 0) const {
+    forEachProbe(indexOf(queryHashes[0]), threshold, probeRadius, [&](size_t bucket) {
+      const size_t first = _offsets[bucket];
+      const hash_t* __restrict hashes = _hashes.data() + first;
+      const index_t* indices = _indices.data() + first;
+      size_t count = _offsets[bucket + 1] - first;
+
+      for (size_t i = 0; i < count; ++i) {
+        hash_t hash = hashes[i];
+        index_t index = indices[i];
+        for (size_t j = 0; j < vectorSize; ++j) {
+          distance_t d = hamm64(queryHashes[j], hash);
+          if (Q_UNLIKELY(d < threshold)) matches[j].push_back(Match(Value(index, hash), d));
+        }
+      }
+    });
+  }
+
+ private:
+  static void writeBytes(QFile& f, const void* data, size_t len) {
+    if (qint64(len) != f.write(reinterpret_cast<const char*>(data), qint64(len)))
+      throw f.errorString();
+  }
+
+  static void checkSize(uint64_t count) {
+    if (count > UINT32_MAX) qFatal("radix map is limited to %u hashes", UINT32_MAX);
+  }
+
+  void searchBucket(size_t index,
+                    hash_t hash,
+                    distance_t threshold,
+                    std::vector<Match>& matches) const {
+    const size_t first = _offsets[index];
+    const hash_t* hashes = _hashes.data() + first;
+    const index_t* indices = _indices.data() + first;
+    const size_t count = _offsets[index + 1] - first;
 
     // gcc doesn't want to unroll this, but it helps a lot
 #define STEP(d, n) \
@@ -209,22 +428,22 @@ class RadixMap_t
 #undef STEP
   }
 
-  enum { vectorSize = 8 }; // 8 may enable AVX512 8x64 popcnt
-
-  void search(const hash_t* __restrict queryHashes,
-              distance_t threshold,
-              std::vector<Match>* matches) const {
-    const Bucket* bucket = _buckets[indexOf(queryHashes[0])];
-    const hash_t* __restrict hashes = bucket->hashes.data();
-    const index_t* indices = bucket->indices.data();
-    size_t count = bucket->hashes.size();
-
-    for (size_t i = 0; i < count; ++i) {
-      hash_t hash = hashes[i];
-      index_t index = indices[i];
-      for (size_t j = 0; j < vectorSize; ++j) {
-        distance_t d = hamm64(queryHashes[j], hash);
-        if (Q_UNLIKELY(d < threshold)) matches[j].push_back(Match(Value(index, hash), d));
+  /// call fn(index ^ mask) for every mask of up to probeRadius bits set
+  template<typename Fn>
+  void forEachProbe(size_t index, int threshold, int probeRadius, const Fn& fn) const {
+    fn(index);
+
+    // a bucket r bits away can't contain anything closer than r
+    const int radius = std::min({probeRadius, threshold - 1, int(_radix)});
+    for (int r = 1; r <= radius; ++r) {
+      // iterate masks with popcount r in ascending order (Gosper's hack)
+      const uint64_t limit = uint64_t(1) << _radix;
+      uint64_t mask = (uint64_t(1) << r) - 1;
+      while (mask < limit) {
+        fn(index ^ size_t(mask));
+        const uint64_t c = mask & -mask;
+        const uint64_t n = mask + c;
+        mask = (((n ^ mask) >> 2) / c) | n;
       }
     }
   }
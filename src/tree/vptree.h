@@ -26,33 +26,42 @@
 #include <stdio.h>
 #include <queue>
 #include <limits>
+#include <type_traits>
 
 /**
  * @class VpTree
  * @brief Vantage-Point Tree tuned for 64-bit dct hashes
+ *
+ * Nodes are stored in depth-first order in one array, so the left child
+ * immediately follows its parent, and leaf values are packed into a second array
+ * in the same order. Searches mostly walk forward through both arrays. There are
+ * no pointers, so the tree can be written to disk as-is with write()/read().
  */
 template <typename ValueType, typename DistanceType,
           DistanceType (*distance)(ValueType, ValueType)>
 class VpTree {
+  static_assert(std::is_trivially_copyable<ValueType>::value, "values are copied as bytes");
+
  public:
   VpTree() {
     //qDebug("node == %d bytes, value == %d bytes, distance == %d bytes",
     //       int(sizeof(Node)), int(sizeof(ValueType)), int(sizeof(DistanceType)));
   }
 
-  ~VpTree() { delete _root; }
-
   void create(std::vector<ValueType>& items) {
-    delete _root;
-    _root = buildFromPoints(items, 0, items.size(), nullptr);
+    _nodes.clear();
+    _leafValues.clear();
+    if (items.size() > 0) buildFromPoints(items, 0, int(items.size()), nullptr);
+    _nodes.shrink_to_fit();
+    _leafValues.shrink_to_fit();
   }
 
   void search(const ValueType target, const DistanceType threshold,
               std::vector<ValueType>* results,
-              std::vector<DistanceType>* distances) {
+              std::vector<DistanceType>* distances) const {
 
     std::priority_queue<HeapItem> heap;
-    thresholdSearch(_root, target, threshold, heap);
+    if (_nodes.size()) thresholdSearch(0, target, threshold, heap);
 
     results->clear();
     distances->clear();
@@ -68,24 +77,187 @@ class VpTree {
     std::reverse(distances->begin(), distances->end());
   }
 
+  /**
+   * Threshold search of one part of the tree, for searching in parallel
+   * @param shard part to search, 0 <= shard < numShards
+   * @details Subtrees below some depth are dealt out to shards round-robin,
+   * shard 0 also gets the vantage points above that depth. Every shard
+   * prunes the upper levels the same way, so they all agree on the subtrees.
+   * The union of all shards is the same as search(), but not sorted.
+   */
+  void search(const ValueType target, const DistanceType threshold,
+              int shard, int numShards,
+              std::vector<ValueType>* results,
+              std::vector<DistanceType>* distances) const {
+    results->clear();
+    distances->clear();
+    if (_nodes.empty()) return;
+
+    // several subtrees per shard, to balance the load
+    int splitDepth = 3;
+    while ((1 << splitDepth) < numShards * 8 && splitDepth < 20) splitDepth++;
+
+    std::priority_queue<HeapItem> heap;
+    int subtree = 0;
+    shardSearch(0, 0, splitDepth, subtree, shard, numShards, target, threshold, heap);
+
+    while (!heap.empty()) {
+      results->push_back(heap.top().value);
+      distances->push_back(heap.top().dist);
+      heap.pop();
+    }
+  }
+
+  /**
+   * k-nearest search, best-first traversal with a bounded heap
+   * @param k maximum number of results
+   * @param threshold only consider values with distance < threshold
+   * @param accept accept(value) is false for values that should not be returned,
+   *        they do not count towards k
+   */
+  template <typename Accept>
+  void nearest(const ValueType target, const size_t k, const DistanceType threshold,
+               const Accept& accept,
+               std::vector<ValueType>* results,
+               std::vector<DistanceType>* distances) const {
+    results->clear();
+    distances->clear();
+    if (_nodes.empty() || k <= 0) return;
+
+    // worst match at the top, once it is full the search radius
+    // shrinks to the distance of the worst match
+    std::priority_queue<HeapItem> best;
+    auto radius = [&]() { return best.size() < k ? threshold : best.top().dist; };
+    auto visit = [&](const ValueType& value, const DistanceType dist) {
+      if (dist >= radius() || !accept(value)) return;
+      best.push(HeapItem(dist, value));
+      if (best.size() > k) best.pop();
+    };
+
+    // nodes to visit, nearest lower bound at the top
+    struct Pending {
+      DistanceType bound;
+      uint32_t node;
+      bool operator<(const Pending& o) const { return bound > o.bound; }
+    };
+    std::priority_queue<Pending> queue;
+    queue.push({0, 0});
+
+    while (!queue.empty()) {
+      const Pending p = queue.top();
+      queue.pop();
+      if (p.bound >= radius()) break;  // nothing left can be better
+
+      const Node& node = _nodes[p.node];
+      if (node.isLeaf()) {
+        const ValueType* leaf = _leafValues.data() + node.first;
+        for (uint32_t i = 0; i < node.count; ++i) visit(leaf[i], distance(leaf[i], target));
+        continue;
+      }
+
+      const DistanceType t = node.threshold;
+      const DistanceType d = distance(node.value, target);
+      visit(node.value, d);
+
+      // left has distance(vp, x) < t, right has distance(vp, x) >= t,
+      // triangle inequality gives the lower bound of distance(target, x)
+      queue.push({std::max(DistanceType(0), d - t + 1), p.node + 1});
+      queue.push({std::max(DistanceType(0), t - d), node.right});
+    }
+
+    while (!best.empty()) {
+      results->push_back(best.top().value);
+      distances->push_back(best.top().dist);
+      best.pop();
+    }
+
+    std::reverse(results->begin(), results->end());
+    std::reverse(distances->begin(), distances->end());
+  }
+
+  /// Stats traversal type
+  struct Stats {
+    size_t memory = 0;  // bytes allocated, including slack
+    size_t slack = 0;   // unused vector capacity
+    int numNodes = 0;   // inner nodes + leaves
+    int numLeaves = 0;
+    int numValues = 0;  // same as count()
+    int maxDepth = 0;
+  };
+
+  /// Get some stats, like memory usage
+  Stats stats() const {
+    Stats st;
+    st.memory = sizeof(*this) + _nodes.capacity() * sizeof(Node) +
+                _leafValues.capacity() * sizeof(ValueType);
+    st.slack = (_nodes.capacity() - _nodes.size()) * sizeof(Node) +
+               (_leafValues.capacity() - _leafValues.size()) * sizeof(ValueType);
+    st.numNodes = int(_nodes.size());
+    st.numLeaves = int(std::count_if(_nodes.begin(), _nodes.end(),
+                                     [](const Node& n) { return n.isLeaf(); }));
+    st.numValues = count();
+    st.maxDepth = depth();
+    return st;
+  }
+
   void printStats() const {
-    int maxDepth = depth(_root);
-    int numNodes = count(_root);
-    qInfo("hashes=%d depth=%d 2^d=%d", numNodes, maxDepth, 1 << maxDepth);
+    const Stats st = stats();
+    qInfo("hashes=%d depth=%d 2^d=%d nodes=%d leaves=%d memory=%dKB slack=%dKB", st.numValues,
+          st.maxDepth, 1 << std::min(st.maxDepth, 30), st.numNodes, st.numLeaves,
+          int(st.memory / 1024), int(st.slack / 1024));
+  }
+
+  /**
+   * Write nodes and values as-is, read() must use the same ValueType/DistanceType
+   * @throw QString on write error
+   */
+  void write(QIODevice& io) const {
+    const uint64_t size[2] = {_nodes.size(), _leafValues.size()};
+    writeBytes(io, size, sizeof(size));
+    writeBytes(io, _nodes.data(), sizeof(Node) * _nodes.size());
+    writeBytes(io, _leafValues.data(), sizeof(ValueType) * _leafValues.size());
+  }
+
+  /// @return false if the data is truncated or inconsistent, the tree is then empty
+  bool read(QIODevice& io) {
+    uint64_t size[2];
+    bool ok = readBytes(io, size, sizeof(size));
+    ok = ok && size[0] < UINT32_MAX && size[1] < UINT32_MAX;
+    if (ok) {
+      _nodes.resize(size[0]);
+      _leafValues.resize(size[1]);
+      ok = readBytes(io, _nodes.data(), sizeof(Node) * _nodes.size()) &&
+           readBytes(io, _leafValues.data(), sizeof(ValueType) * _leafValues.size());
+    }
+
+    // every child and leaf range must be in bounds, then search can't crash
+    for (size_t i = 0; ok && i < _nodes.size(); ++i) {
+      const Node& node = _nodes[i];
+      if (node.isLeaf())
+        ok = size_t(node.first) + node.count <= _leafValues.size();
+      else
+        ok = node.right > i + 1 && node.right < _nodes.size();
+    }
+
+    if (!ok) {
+      _nodes.clear();
+      _leafValues.clear();
+    }
+    return ok;
   }
 
  private:
   struct Node {
-    ValueType value;
-    DistanceType threshold = 0;
-    Node* left = nullptr;
-    Node* right = nullptr;
-    std::vector<ValueType> leaf;
-    ~Node() {
-      delete left;
-      delete right;
-    }
-  } *_root = nullptr;
+    ValueType value;             // vantage point (inner node)
+    DistanceType threshold = 0;  // partition distance (inner node)
+    uint32_t right = 0;          // inner node: index of right child, left is the next node
+    uint32_t first = 0;          // leaf: index of first value in _leafValues
+    uint32_t count = 0;          // leaf: number of values, 0 if inner node
+    bool isLeaf() const { return count > 0; }
+  };
+
+  std::vector<Node> _nodes;  // depth-first order, root is _nodes[0]
+  std::vector<ValueType> _leafValues;
 
   enum {
     // tuning: minimum 3, maximum number of elements in a leaf node
@@ -115,159 +287,171 @@ class VpTree {
     }
   };
 
-  Node* buildFromPoints(std::vector<ValueType>& items,
-                        int lower, const int upper, Node* parent) {
+  // @return index of the node for items[lower, upper)
+  uint32_t buildFromPoints(std::vector<ValueType>& items,
+                           int lower, const int upper, const ValueType* parent) {
 
     Q_ASSERT(lower >= 0 && lower < int(items.size()));
     Q_ASSERT(upper > 0 && upper <= int(items.size()));
     Q_ASSERT(upper > lower);
 
-    //if (upper == lower) return nullptr;
-
-    Node* node = new Node();
-    //node->value = items[lower];
+    const uint32_t index = uint32_t(_nodes.size());
+    _nodes.push_back(Node());
 
-    if (upper - lower > MaxLeafSize) {
+    if (upper - lower <= MaxLeafSize) {
+      makeLeaf(index, items, lower, upper);
+      return index;
+    }
 
-      // vantage point selection
-      // max distance from parent seems best
+    // vantage point selection
+    // max distance from parent seems best
 #define MAX_FROM_PARENT (1)
 
 #if MAX_FROM_PARENT
-      if (parent) {
-        auto it = std::max_element(items.begin()+lower, items.begin()+upper,
-                                   DistanceComparator(parent->value));
-        std::swap(items[lower], *it);
-      } else
+    if (parent) {
+      auto it = std::max_element(items.begin()+lower, items.begin()+upper,
+                                 DistanceComparator(*parent));
+      std::swap(items[lower], *it);
+    } else
 #endif
-      // TODO: is this an oopsie?
-      {
-        // furthest from maximum value
-        auto it = std::max_element(items.begin()+lower, items.begin()+upper,
-                                   DistanceComparator(ValueType::max()));
-        std::swap(items[lower], *it);
-      }
+    // TODO: is this an oopsie?
+    {
+      // furthest from maximum value
+      auto it = std::max_element(items.begin()+lower, items.begin()+upper,
+                                 DistanceComparator(ValueType::max()));
+      std::swap(items[lower], *it);
+    }
 
-      const ValueType value = items[lower];
-      lower++;
+    const ValueType value = items[lower];
+    lower++;
 
-      // partitioning scheme
-      // one set far from vp (outside) the other near vp (inside)
+    // partitioning scheme
+    // one set far from vp (outside) the other near vp (inside)
 #define FIXED_PARTITION (1)
 
 #if FIXED_PARTITION
-      // choose a fixed value for partitioning
-      // random dct hashes have median distance 32
-      // empirically 23-26 is best, works better even though
-      // we don't get a 50% cut
-      DistanceType midDist = 23;
+    // choose a fixed value for partitioning
+    // random dct hashes have median distance 32
+    // empirically 23-26 is best, works better even though
+    // we don't get a 50% cut
+    DistanceType midDist = 23;
 #else
-      // median partition, the middle distance
-      // sort makes the median distance closer to 50% cut
-      std::sort(items.begin()+lower, items.begin()+upper, DistanceComparator(value));
-      int m1 = ((upper - lower) / 2) + lower + 1;
-      Q_ASSERT(m1 < upper && m1 > lower);
-      const DistanceType midDist = distance(value, items[m1]);
-#endif
-
-      auto it = std::partition(items.begin() + lower,
-                               items.begin() + upper,
-                               [&value,midDist](const  ValueType& v) {
-                                 return distance(value, v) < midDist;
-                               });
-      int median = it - items.begin(); // it==first element of second group
-
-
-      if (median == lower || median == upper) {
-//        qWarning() << "partition failed, size=" << upper-lower << "midDist" << midDist;
-        node->leaf.assign(items.begin() + lower-1, items.begin() + upper);
-        return node;
-      }
-      else {
-
-#ifdef FIXED_PARTITION
-        // the actual middle could be less than midDist,
-        // especially for small partitions
-        // it does not seem to matter much if we do this, and
-        // takes longer to build the tree
-//        auto it = std::max_element(items.begin()+lower, items.begin()+median,
-//                                   DistanceComparator(value));
-//        int m2 = distance(value, *it) + 1;
-//        Q_ASSERT(m2 <= midDist);
-//        midDist = m2;
+    // median partition, the middle distance
+    // sort makes the median distance closer to 50% cut
+    std::sort(items.begin()+lower, items.begin()+upper, DistanceComparator(value));
+    int m1 = ((upper - lower) / 2) + lower + 1;
+    Q_ASSERT(m1 < upper && m1 > lower);
+    const DistanceType midDist = distance(value, items[m1]);
 #endif
-      }
 
-      node->threshold = midDist;
-      node->value = value;
+    auto it = std::partition(items.begin() + lower,
+                             items.begin() + upper,
+                             [&value,midDist](const  ValueType& v) {
+                               return distance(value, v) < midDist;
+                             });
+    int median = int(it - items.begin()); // it==first element of second group
+
+    if (median == lower || median == upper) {
+      // partition failed, the vantage point goes back in the leaf
+      makeLeaf(index, items, lower - 1, upper);
+      return index;
+    }
 
-      //const int split = (median-lower)*100 / (upper-lower);
+    Q_ASSERT(lower < median);
+    Q_ASSERT(median < upper);
 
-      //printf("thresh = %d, median=%d %% sizes=%d,%d\n", node->threshold,
-      //       split, median-lower, upper-median);
+    // left is built first so it is the next node
+    const uint32_t left = buildFromPoints(items, lower, median, &value);
+    const uint32_t right = buildFromPoints(items, median, upper, &value);
+    Q_ASSERT(left == index + 1);
+    (void)left;
 
+    Node& node = _nodes[index];  // _nodes was resized, no reference until now
+    node.threshold = midDist;
+    node.value = value;
+    node.right = right;
+    return index;
+  }
 
-//      for (auto it = items.begin() + lower; it != items.begin() + median; ++it)
-//        Q_ASSERT( distance(value, *it) < node->threshold );
+  void makeLeaf(uint32_t index, const std::vector<ValueType>& items, int lower, int upper) {
+    Node& node = _nodes[index];
+    node.first = uint32_t(_leafValues.size());
+    node.count = uint32_t(upper - lower);
+    _leafValues.insert(_leafValues.end(), items.begin() + lower, items.begin() + upper);
+  }
 
-//      for (auto it = items.begin() + median; it != items.begin() + upper; ++it)
-//        Q_ASSERT( distance(value, *it) >= node->threshold );
+  void thresholdSearch(const uint32_t index, const ValueType& target,
+                       const DistanceType threshold,
+                       std::priority_queue<HeapItem>& matches) const {
+    const Node& node = _nodes[index];
 
-        Q_ASSERT(lower < median);
-        Q_ASSERT(median < upper);
+    if (node.isLeaf()) {
+      const ValueType* leaf = _leafValues.data() + node.first;
+      for (uint32_t i = 0; i < node.count; ++i) {
+        const DistanceType dist = distance(leaf[i], target);
+        if (dist < threshold)
+          matches.push(HeapItem(dist, leaf[i]));
+      }
+      return;
+    }
 
-        node->left = buildFromPoints(items, lower, median, node);
-        node->right = buildFromPoints(items, median, upper, node);
+    const DistanceType t = node.threshold;
+    const DistanceType d = distance(node.value, target);
 
-    } else
-      node->leaf.assign(items.begin() + lower, items.begin() + upper);
+    if (d < threshold)
+      matches.push(HeapItem(d, node.value));
 
-    return node;
+    if ( d - threshold < t )
+      thresholdSearch(index + 1, target, threshold, matches);
+    if ( d + threshold >= t )
+      thresholdSearch(node.right, target, threshold, matches);
   }
 
-  void thresholdSearch(const Node* node, const ValueType& target, const DistanceType threshold,
-                       std::priority_queue<HeapItem>& matches) const {
-
-    const std::vector<ValueType>& leaf = node->leaf;
+  void shardSearch(const uint32_t index, const int depth, const int splitDepth,
+                   int& subtree, const int shard, const int numShards,
+                   const ValueType& target, const DistanceType threshold,
+                   std::priority_queue<HeapItem>& matches) const {
+    const Node& node = _nodes[index];
 
-    if (leaf.size()) {
-      Q_ASSERT(node->left == nullptr && node->right == nullptr);
-      const std::vector<ValueType>& leaf = node->leaf;
-      for (auto it = leaf.begin(); it != leaf.end(); ++it) {
-        const ValueType& value = *it;
-        const DistanceType dist = distance(value, target);
-        if (dist < threshold)
-          matches.push(HeapItem(dist, value));
-      }
+    if (depth == splitDepth || node.isLeaf()) {
+      if (subtree++ % numShards == shard) thresholdSearch(index, target, threshold, matches);
       return;
     }
 
-    const DistanceType t = node->threshold;
-    const DistanceType d = distance(node->value, target);
+    const DistanceType t = node.threshold;
+    const DistanceType d = distance(node.value, target);
 
-    if (d < threshold)
-      matches.push(HeapItem(d, node->value));
+    if (d < threshold && shard == 0)
+      matches.push(HeapItem(d, node.value));
 
     if ( d - threshold < t )
-      thresholdSearch(node->left, target, threshold, matches);
+      shardSearch(index + 1, depth + 1, splitDepth, subtree, shard, numShards, target, threshold,
+                  matches);
     if ( d + threshold >= t )
-      thresholdSearch(node->right, target, threshold, matches);
+      shardSearch(node.right, depth + 1, splitDepth, subtree, shard, numShards, target, threshold,
+                  matches);
+  }
+
+  int depth(uint32_t index = 0) const {
+    if (_nodes.empty()) return 0;
+    const Node& node = _nodes[index];
+    if (node.isLeaf()) return 0;
+    return 1 + std::max(depth(index + 1), depth(node.right));
+  }
+
+  int count() const {
+    // every inner node has one value
+    return int(_leafValues.size() + std::count_if(_nodes.begin(), _nodes.end(), [](const Node& n) {
+                 return !n.isLeaf();
+               }));
   }
 
-  static int depth(Node* node) {
-    int left = 0;
-    int right = 0;
-    if (node->left) left = 1 + depth(node->left);
-    if (node->right) right = 1 + depth(node->right);
-    return std::max(left, right);
+  static void writeBytes(QIODevice& io, const void* data, size_t len) {
+    if (qint64(len) != io.write(reinterpret_cast<const char*>(data), qint64(len)))
+      throw io.errorString();
   }
 
-  static int count(Node* node) {
-    int val = 0;
-    if (node->leaf.size()) val += int(node->leaf.size());
-    else val += 1;
-    if (node->left) val += count(node->left);
-    if (node->right) val += count(node->right);
-    return val;
+  static bool readBytes(QIODevice& io, void* data, size_t len) {
+    return qint64(len) == io.read(reinterpret_cast<char*>(data), qint64(len));
   }
 };
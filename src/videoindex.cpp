@@ -216,6 +216,7 @@ void VideoIndex::migrate(const MediaGroup& media, const QString& root, const Ind
   }
 
   pl.end(0, {updated, removed});
+  if (!params.dryRun && (updated > 0 || removed > 0)) VideoHashStore::rebuild(root);
   if (updated > 0 || removed > 0) qInfo() << "index was updated";
   if (removed > 0) qInfo() << "run -update to refresh index";
 }
@@ -539,3 +540,241 @@ bool VideoIndex::load_v1(SimpleIO& io) {
 
   return true;
 }
+
+static QString segmentFile(const QString& dirPath) { return dirPath + qq("/hashes.seg"); }
+static QString offsetsFile(const QString& dirPath) { return dirPath + qq("/hashes.idx"); }
+
+static QString segmentHeader() {
+  static constexpr int version = 1;
+  return QStringLiteral("cbird video hash segment:%1:%2:%3:%4:%5")
+      .arg(version)
+      .arg(sizeof(mediaid_t))
+      .arg(sizeof(int))
+      .arg(sizeof(dcthash_t))
+      .arg(QSysInfo::ByteOrder);
+}
+
+static QString offsetsHeader() {
+  static constexpr int version = 2; // v1 was missing the byte order
+  return QStringLiteral("cbird video hash offsets:%1:%2:%3:%4")
+      .arg(version)
+      .arg(sizeof(mediaid_t))
+      .arg(sizeof(uint64_t))
+      .arg(QSysInfo::ByteOrder);
+}
+
+// bytes used by writeCacheHeader()
+static qint64 headerSize(const QString& header) {
+  const qint64 len = header.toLatin1().length() + 1;
+  return (len + CACHE_FILE_ALIGN - 1) / CACHE_FILE_ALIGN * CACHE_FILE_ALIGN;
+}
+
+namespace {
+
+// record in the segment, followed by frames[count], padding, hashes[count];
+// records are 8-byte aligned so the hashes can be used in place
+struct SegmentRecord
+{
+  mediaid_t mediaId;
+  uint32_t count;
+};
+
+inline uint64_t framesSize(uint32_t count) {
+  return (uint64_t(count) * sizeof(int) + 7) & ~uint64_t(7);
+}
+
+inline uint64_t recordSize(uint32_t count) {
+  return sizeof(SegmentRecord) + framesSize(count) + uint64_t(count) * sizeof(dcthash_t);
+}
+
+void writeBytes(QFile& f, const void* data, qint64 len) {
+  if (f.write(reinterpret_cast<const char*>(data), len) != len) throw f.errorString();
+}
+
+} // namespace
+
+bool VideoHashStore::open(const QString& dirPath) {
+  close();
+
+  // read offsets before mapping the segment; records appended after this are
+  // not referenced, and if the segment was rewritten find() will not match
+  QFile offsets(offsetsFile(dirPath));
+  if (!offsets.exists()) return false;
+
+  qint64 len = 0;
+  const uchar* ptr = mapCacheFile(offsets, offsetsHeader(), &len);
+  if (!ptr) return false;
+
+  // a partial entry at the end is from an interrupted append
+  _offsets.resize(size_t(len) / sizeof(Offset));
+  memcpy(_offsets.data(), ptr, _offsets.size() * sizeof(Offset));
+  offsets.close();
+
+  auto* f = new QFile(segmentFile(dirPath));
+  ptr = mapCacheFile(*f, segmentHeader(), &len);
+  if (!ptr) {
+    delete f;
+    _offsets.clear();
+    return false;
+  }
+  _mapped = f;
+  _segment = ptr;
+  _segmentLen = uint64_t(len);
+
+  // the last record for an id wins, ids can be reused after removal
+  std::stable_sort(_offsets.begin(), _offsets.end(), [](const Offset& a, const Offset& b) {
+    return a.mediaId < b.mediaId;
+  });
+  auto out = _offsets.begin();
+  for (auto it = _offsets.begin(); it != _offsets.end(); ++it)
+    if (it + 1 == _offsets.end() || (it + 1)->mediaId != it->mediaId) *out++ = *it;
+  _offsets.erase(out, _offsets.end());
+  _offsets.shrink_to_fit();
+
+  return true;
+}
+
+void VideoHashStore::close() {
+  delete _mapped; // also unmaps
+  _mapped = nullptr;
+  _segment = nullptr;
+  _segmentLen = 0;
+  _offsets.clear();
+}
+
+bool VideoHashStore::find(mediaid_t mediaId, Entry& entry) const {
+  auto it = std::lower_bound(_offsets.begin(), _offsets.end(), mediaId,
+                             [](const Offset& a, mediaid_t id) { return a.mediaId < id; });
+  if (it == _offsets.end() || it->mediaId != mediaId) return false;
+
+  const uint64_t offset = it->offset;
+  if (offset % 8 != 0 || offset > _segmentLen || recordSize(it->count) > _segmentLen - offset)
+    return false;
+
+  const auto* record = reinterpret_cast<const SegmentRecord*>(_segment + offset);
+  if (record->mediaId != mediaId || record->count != it->count) return false;
+
+  entry.count = record->count;
+  entry.frames = reinterpret_cast<const int*>(_segment + offset + sizeof(*record));
+  entry.hashes = reinterpret_cast<const dcthash_t*>(_segment + offset + sizeof(*record)
+                                                    + framesSize(record->count));
+  return true;
+}
+
+void VideoHashStore::writeRecord(QFile& segment,
+                                 QFile& offsets,
+                                 qint64 payloadStart,
+                                 mediaid_t mediaId,
+                                 const VideoIndex& index) {
+  const uint32_t count = uint32_t(std::min(index.frames.size(), index.hashes.size()));
+  const qint64 pos = segment.pos();
+  Q_ASSERT(pos >= payloadStart && (pos - payloadStart) % 8 == 0);
+
+  static const char pad[8] = {0};
+  const SegmentRecord record{mediaId, count};
+  writeBytes(segment, &record, sizeof(record));
+  writeBytes(segment, index.frames.data(), qint64(count * sizeof(int)));
+  writeBytes(segment, pad, qint64(framesSize(count) - count * sizeof(int)));
+  writeBytes(segment, index.hashes.data(), qint64(count * sizeof(dcthash_t)));
+
+  const Offset offset{mediaId, count, uint64_t(pos - payloadStart)};
+  writeBytes(offsets, &offset, sizeof(offset));
+}
+
+void VideoHashStore::append(const QString& dirPath, const MediaGroup& media) {
+  const QString segHeader = segmentHeader();
+  const QString idxHeader = offsetsHeader();
+
+  if (!QFile::exists(segmentFile(dirPath)) || !QFile::exists(offsetsFile(dirPath))) {
+    rebuild(dirPath);
+    return;
+  }
+
+  QFile segment(segmentFile(dirPath));
+  QFile offsets(offsetsFile(dirPath));
+  if (!segment.open(QFile::ReadWrite) || !offsets.open(QFile::ReadWrite) ||
+      segment.readLine(256) != segHeader.toLatin1() + '\n' ||
+      offsets.readLine(256) != idxHeader.toLatin1() + '\n') {
+    qWarning() << "video hash store is unreadable, rebuilding";
+    segment.close();
+    offsets.close();
+    rebuild(dirPath);
+    return;
+  }
+
+  try {
+    // an interrupted append leaves an unreferenced partial record,
+    // which can stay, and maybe a partial offset, which cannot
+    const qint64 segStart = headerSize(segHeader);
+    const qint64 segEnd = segStart + (std::max(segment.size(), segStart) - segStart + 7) / 8 * 8;
+    if (segment.size() != segEnd && !segment.resize(segEnd)) throw segment.errorString();
+
+    const qint64 idxStart = headerSize(idxHeader);
+    const qint64 entrySize = sizeof(Offset);
+    const qint64 idxEnd =
+        idxStart + std::max(offsets.size() - idxStart, qint64(0)) / entrySize * entrySize;
+    if (offsets.size() != idxEnd && !offsets.resize(idxEnd)) throw offsets.errorString();
+
+    if (!segment.seek(segEnd)) throw segment.errorString();
+    if (!offsets.seek(idxEnd)) throw offsets.errorString();
+
+    for (const Media& m : media)
+      if (m.type() == Media::TypeVideo && !m.videoIndex().isEmpty())
+        writeRecord(segment, offsets, segStart, m.id(), m.videoIndex());
+
+    // segment first so offsets never point past the end
+    if (!segment.flush()) throw segment.errorString();
+    if (!offsets.flush()) throw offsets.errorString();
+  } catch (const QString& error) {
+    qWarning() << "failed to append to video hash store, removing it:" << error;
+    segment.close();
+    offsets.close();
+    remove(dirPath);
+  }
+}
+
+void VideoHashStore::rebuild(const QString& dirPath) {
+  // only <id>.vdx, there may be resume-<md5>.vdx etc
+  std::vector<mediaid_t> ids;
+  const auto files = QDir(dirPath).entryList({"*.vdx"}, QDir::Files);
+  for (const QString& f : files) {
+    bool ok = false;
+    const uint id = f.split(".").first().toUInt(&ok);
+    if (ok) ids.push_back(id);
+  }
+  std::sort(ids.begin(), ids.end());
+
+  PROGRESS_LOGGER(pl, "video hash store:<PL> %percent %step videos", ids.size());
+
+  // the segment is replaced first, then offsets, open() handles the gap
+  writeFileAtomically(offsetsFile(dirPath), [&](QFile& offsets) {
+    writeCacheHeader(offsets, offsetsHeader());
+
+    writeFileAtomically(segmentFile(dirPath), [&](QFile& segment) {
+      const QString header = segmentHeader();
+      const qint64 payloadStart = headerSize(header);
+      writeCacheHeader(segment, header);
+
+      QElapsedTimer timer;
+      timer.start();
+      for (size_t i = 0; i < ids.size(); ++i) {
+        if (timer.elapsed() > 100) {
+          pl.step(i);
+          timer.start();
+        }
+        VideoIndex index;
+        index.load(qq("%1/%2.vdx").arg(dirPath).arg(ids[i]));
+        if (!index.isEmpty()) writeRecord(segment, offsets, payloadStart, ids[i], index);
+      }
+    });
+  });
+
+  pl.end();
+}
+
+void VideoHashStore::remove(const QString& dirPath) {
+  // offsets first, without them the segment is never used
+  for (auto& path : {offsetsFile(dirPath), segmentFile(dirPath)})
+    if (QFile::exists(path) && !QFile::remove(path))
+      qWarning() << "failed to remove" << path;
+}
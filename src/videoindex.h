@@ -24,6 +24,7 @@ class Media;
 typedef QVector<Media> MediaGroup;
 
 class IndexParams;
+class QFile;
 
 /**
  * @class VideoIndex
@@ -65,3 +66,82 @@ class VideoIndex
   bool save_v1(SimpleIO& io) const;
   bool load_v1(SimpleIO& io);
 };
+
+/**
+ * @class VideoHashStore
+ * @brief Packed copy of every .vdx file, for loading many videos quickly
+ *
+ * Building the search tree would otherwise open and parse one .vdx
+ * per video. The .vdx files remain the source of truth; any video
+ * missing from the store (or with a bad record) is loaded from its .vdx.
+ *
+ * There are two append-only files in the video directory:
+ *   - segment: records of {mediaId, count} frames[count] hashes[count]
+ *   - offsets: {mediaId, count, offset} of each record in the segment
+ *
+ * Database::add() appends to them (the last record for an id wins) and
+ * Database::vacuum() rewrites them without removed items.
+ */
+class VideoHashStore
+{
+  Q_DISABLE_COPY_MOVE(VideoHashStore);
+
+ public:
+  /// Pointers into the mapped segment, valid until close()
+  struct Entry
+  {
+    const int* frames = nullptr;
+    const dcthash_t* hashes = nullptr;
+    uint32_t count = 0;
+  };
+
+  VideoHashStore() {}
+  ~VideoHashStore() { close(); }
+
+  /// map the store in dirPath, false if it is missing or unreadable
+  bool open(const QString& dirPath);
+  void close();
+
+  bool isOpen() const { return _mapped != nullptr; }
+
+  /// number of records in the offset table
+  size_t count() const { return _offsets.size(); }
+
+  size_t memoryUsage() const { return sizeof(*this) + VECTOR_SIZE(_offsets); }
+
+  /// get the record for mediaId, false if it is not in the store
+  bool find(mediaid_t mediaId, Entry& entry) const;
+
+  /**
+   * Append the index of each video in media
+   * @note if the store is missing or unreadable, it is rebuilt instead,
+   *       so the .vdx files for media must already be saved
+   */
+  static void append(const QString& dirPath, const MediaGroup& media);
+
+  /// Rewrite the store from the .vdx files in dirPath
+  static void rebuild(const QString& dirPath);
+
+  /// Remove the store, it is recreated by the next append()
+  static void remove(const QString& dirPath);
+
+ private:
+  struct Offset
+  {
+    mediaid_t mediaId;
+    uint32_t count;
+    uint64_t offset; // from start of segment payload
+  };
+
+  /// write one record to each file, throws QString
+  static void writeRecord(QFile& segment,
+                          QFile& offsets,
+                          qint64 payloadStart,
+                          mediaid_t mediaId,
+                          const VideoIndex& index);
+
+  QFile* _mapped = nullptr;
+  const uchar* _segment = nullptr;
+  uint64_t _segmentLen = 0;
+  std::vector<Offset> _offsets; // sorted by mediaId
+};
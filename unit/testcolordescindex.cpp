@@ -1,6 +1,8 @@
 
 #include "testindexbase.h"
 #include "colordescindex.h"
+#include "database.h"
+#include "scanner.h"
 
 #include <QtTest/QtTest>
 
@@ -18,14 +20,51 @@ class TestColorDescIndex : public TestIndexBase {
   void testDefaults() { baseTestDefaults(new ColorDescIndex); }
   void testEmpty() { baseTestEmpty(new ColorDescIndex); }
   void testLoad() { baseTestLoad(_params); }
+  void testCacheFile() { baseTestCacheFile(new ColorDescIndex, _params, {"colordesc.cache"}); }
+  void testFindNearest();
   void testAddRemove() { baseTestAddRemove(_params, 40); }
   void testMemoryUsage();
 };
 
+void TestColorDescIndex::testFindNearest() {
+  // the pruned search must get the same scores as the best of find()
+  const int k = 5;
+  for (const QString& path : _database->indexedFiles()) {
+    Media needle = _scanner->processImageFile(path).media;
+    if (needle.colorDescriptor().numColors <= 0) continue;
+
+    QVector<Index::Match> all = _index->find(needle, _params);
+    std::sort(all.begin(), all.end());
+
+    QVector<Index::Match> nearest;
+    QVERIFY(_index->findNearest(needle, k, _params, nearest));
+    QCOMPARE(nearest.count(), std::min(k, int(all.count())));
+    for (int i = 0; i < nearest.count(); ++i) QCOMPARE(nearest[i].score, all[i].score);
+  }
+}
+
 void TestColorDescIndex::testMemoryUsage() {
-  // descriptor size plus media id size
-  QCOMPARE(_index->memoryUsage(),
-           (sizeof(ColorDescriptor) + 4) * size_t(_index->count()));
+  // descriptor size plus media id size, plus the search buckets
+  auto* index = static_cast<ColorDescIndex*>(_index);
+  const size_t num = size_t(index->_count);
+  size_t bytes = (sizeof(ColorDescriptor) + 4) * num;
+
+  size_t bucketed = 0;
+  for (const auto& b : index->_buckets) {
+    bucketed += b.index.size();
+    bytes += b.index.capacity() * sizeof(uint32_t);
+    bytes += b.colors.capacity() * sizeof(std::vector<float>);
+    for (const auto& c : b.colors) {
+      QCOMPARE(c.size(), b.index.size());
+      bytes += c.capacity() * sizeof(float);
+    }
+    for (const auto& c : b.box) {
+      QCOMPARE(c.size(), b.index.size());
+      bytes += c.capacity() * sizeof(float);
+    }
+  }
+  QVERIFY(bucketed > 0 && bucketed <= num);
+  QCOMPARE(index->memoryUsage(), bytes);
 }
 
 QTEST_MAIN(TestColorDescIndex)
@@ -21,6 +21,9 @@ class TestCvFeaturesIndex : public TestIndexBase {
   void testLoad() { baseTestLoad(_params); }
   void testAddRemove() { baseTestAddRemove(_params, 40); };
   void testMemoryUsage() { QVERIFY(_index->memoryUsage() > 0); }
+
+  // the lsh tables are rebuilt, which may change the nearest neighbors
+  void testCompact() { baseTestCompact(_params, false); }
 };
 
 QTEST_MAIN(TestCvFeaturesIndex)
@@ -1,6 +1,8 @@
 
 #include "testindexbase.h"
+#include "database.h"
 #include "dctfeaturesindex.h"
+#include "scanner.h"
 
 #include <QtTest/QtTest>
 
@@ -18,10 +20,28 @@ class TestDctFeaturesIndex : public TestIndexBase {
   void testDefaults() { baseTestDefaults(new DctFeaturesIndex); }
   void testEmpty() { baseTestEmpty(new DctFeaturesIndex); }
   void testLoad() { baseTestLoad(_params); }
+  void testCacheFile() {
+    baseTestCacheFile(new DctFeaturesIndex, _params, {"dctfeatures.cache", "dctfeatures.hashes"});
+  }
+  void testFindById();
+  void testMaxThresh() { baseTestMaxThresh(_params); }
   void testAddRemove() { baseTestAddRemove(_params, 40); }
   void testMemoryUsage();
 };
 
+void TestDctFeaturesIndex::testFindById() {
+  // needle without hashes gets them from the index, results must be the same
+  for (const QString& path : _database->indexedFiles()) {
+    const Media m = _database->mediaWithPath(path);
+    QVERIFY(m.keyPointHashes().size() == 0);
+
+    Media needle = _scanner->processImageFile(path).media;
+    needle.setId(m.id());
+
+    QCOMPARE(sortedIds(_index->find(m, _params)), sortedIds(_index->find(needle, _params)));
+  }
+}
+
 void TestDctFeaturesIndex::testMemoryUsage() {
   QVERIFY(_index->memoryUsage() > 0);
 }
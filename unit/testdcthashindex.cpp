@@ -1,6 +1,8 @@
 
 #include "testindexbase.h"
+#include "database.h"
 #include "dcthashindex.h"
+#include "tree/dcttree.h"
 
 #include <QtTest/QtTest>
 
@@ -20,13 +22,107 @@ class TestDctHashIndex : public TestIndexBase {
   void testDefaults() { baseTestDefaults(new DctHashIndex); }
   void testEmpty() { baseTestEmpty(new DctHashIndex); }
   void testLoad() { baseTestLoad(_params); }
+  void testCacheFile() { baseTestCacheFile(new DctHashIndex, _params, {"dcthash.cache"}); }
+  void testFindAll();
+  void testFindNearest();
+  void testFindShard();
+  void testMaxThresh() { baseTestMaxThresh(_params); }
   void testAddRemove() { baseTestAddRemove(_params, 40); }
   void testMemoryUsage();
+  void testCompact() { baseTestCompact(_params, true); }
 };
 
+void TestDctHashIndex::testFindAll() {
+  // a missing hash is in the haystack, but has no results as a needle;
+  // the other hash is near it so the needles can be compared
+  MediaGroup needles;
+  for (const QString& path : _database->indexedFiles())
+    needles.append(_database->mediaWithPath(path));
+
+  MediaGroup extra{Media("zero.jpg", Media::TypeImage, 64, 64, "", 0),
+                   Media("one.jpg", Media::TypeImage, 64, 64, "", 3)};
+  extra[0].setId(1000001);
+  extra[1].setId(1000002);
+  _index->add(extra);
+  needles.append(extra);
+
+  // self-join must find the same things as find() on each item
+  QHash<uint32_t, QVector<Index::Match>> joined;
+  QVERIFY(_index->findAll(_params, joined));
+  QVERIFY(joined.count() >= 40);
+  QVERIFY(!joined.contains(1000001));
+
+  auto sorted = [](QVector<Index::Match> matches) {
+    QVector<QPair<int, uint32_t>> list;
+    for (auto& m : std::as_const(matches)) list.append({m.score, m.mediaId});
+    std::sort(list.begin(), list.end());
+    return list;
+  };
+
+  for (const Media& m : std::as_const(needles))
+    QCOMPARE(sorted(joined.value(uint32_t(m.id()))), sorted(_index->find(m, _params)));
+
+  QCOMPARE(joined.value(1000002).count(), 2); // itself and the zero hash
+
+  _index->remove({extra[0].id(), extra[1].id()});
+}
+
+void TestDctHashIndex::testFindNearest() {
+  // k nearest must have the same scores as the best k of find()
+  SearchParams params = _params;
+  params.dctThresh = 20;
+  const int k = 3;
+
+  for (const QString& path : _database->indexedFiles()) {
+    const Media m = _database->mediaWithPath(path);
+
+    QVector<Index::Match> nearest;
+    QVERIFY(_index->findNearest(m, k, params, nearest));
+
+    QVector<Index::Match> all = _index->find(m, params);
+    std::sort(all.begin(), all.end());
+    QCOMPARE(nearest.count(), std::min(k, int(all.count())));
+    for (int i = 0; i < nearest.count(); ++i) QCOMPARE(nearest[i].score, all[i].score);
+  }
+}
+
+void TestDctHashIndex::testFindShard() {
+  // all shards together must find the same things as find()
+  const int numShards = 3;
+  for (const QString& path : _database->indexedFiles()) {
+    const Media m = _database->mediaWithPath(path);
+
+    QVector<Index::Match> all;
+    for (int shard = 0; shard < numShards; ++shard) {
+      QVector<Index::Match> matches;
+      QVERIFY(_index->findShard(m, _params, shard, numShards, matches));
+      all.append(matches);
+    }
+    QCOMPARE(sortedIds(all), sortedIds(_index->find(m, _params)));
+  }
+}
+
 void TestDctHashIndex::testMemoryUsage() {
-  // 8 bytes per hash, plus 4 bytes index
-  QCOMPARE(_index->memoryUsage(), (size_t)(8 + 4) * _index->count());
+  // heap arrays, 8 bytes per hash plus 4 bytes index, plus the tree
+  auto* index = static_cast<DctHashIndex*>(_index);
+  QVERIFY(!index->_mapped);
+  const size_t heap = malloc_size(index->_hashes) + malloc_size(index->_mediaId);
+  QVERIFY(heap >= (size_t)(8 + 4) * index->count());
+  QCOMPARE(index->memoryUsage(), heap + index->_tree->memoryUsage());
+
+  // another instance maps the arrays from a fresh cache file
+  _database->saveIndices();
+  auto* mapped = new DctHashIndex;
+  {
+    Database db(_database->path());
+    db.addIndex(mapped);
+    db.setup();
+    db.similar(_params);
+    QVERIFY(mapped->_mapped);
+    QCOMPARE(mapped->memoryUsage(),
+             (size_t)(8 + 4) * mapped->count() + mapped->_tree->memoryUsage());
+  }
+  delete mapped;
 }
 
 QTEST_MAIN(TestDctHashIndex)
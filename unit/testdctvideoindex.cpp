@@ -31,6 +31,7 @@ class TestDctVideoIndex : public TestIndexBase {
   void testAddRemove() { baseTestAddRemove(_params, numVideos); }
   void testMemoryUsage();
   void testLoad();
+  void testTreeCache();
 };
 
 void TestDctVideoIndex::testMemoryUsage() {
@@ -77,5 +78,33 @@ void TestDctVideoIndex::testLoad() {
   }
 }
 
+void TestDctVideoIndex::testTreeCache() {
+  const QString path = qq("%1/video-%2-%3.tree")
+                           .arg(_database->cachePath())
+                           .arg(_params.videoRadix)
+                           .arg(_params.skipFrames);
+  QFile::remove(path);
+
+  const int expected = _database->similar(_params).count();
+
+  // first instance builds the tree and writes it on exit,
+  // the second reads it and does not write it again
+  QDateTime written;
+  for (int i = 0; i < 2; ++i) {
+    auto* index = new DctVideoIndex;
+    {
+      Database db(_database->path());
+      db.addIndex(index);
+      db.setup();
+      QCOMPARE(db.similar(_params).count(), expected);
+    }
+    delete index;
+
+    QVERIFY(QFileInfo::exists(path));
+    if (i == 0) written = QFileInfo(path).lastModified();
+    QCOMPARE(QFileInfo(path).lastModified(), written);
+  }
+}
+
 QTEST_MAIN(TestDctVideoIndex)
 #include "testdctvideoindex.moc"
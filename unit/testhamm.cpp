@@ -0,0 +1,109 @@
+#include <QtTest/QtTest>
+
+#include "hamm.h"
+
+#include <random>
+
+// SIMD kernels checked against scalar code
+class TestHamm : public QObject {
+  Q_OBJECT
+
+ private Q_SLOTS:
+  void cleanup() { hammSetKernel(nullptr); }
+
+  void testScanKernels_data();
+  void testScanKernels();
+  void testGatherKernels_data() { testScanKernels_data(); }
+  void testGatherKernels();
+};
+
+void TestHamm::testScanKernels_data() {
+  QTest::addColumn<QString>("kernel");
+  for (const char* kernel : {"scalar", "avx2", "avx512"}) QTest::newRow(kernel) << kernel;
+}
+
+void TestHamm::testScanKernels() {
+  QFETCH(QString, kernel);
+  if (!hammSetKernel(qPrintable(kernel))) QSKIP("kernel not supported by this cpu");
+  QCOMPARE(QString(hamm64ScanKernel()), kernel);
+
+  std::mt19937_64 rng(1);
+  std::vector<uint64_t> hashes(1024 + 16);
+  for (auto& h : hashes) h = rng();
+
+  // every tail length, and one that is not 8-byte aligned
+  std::vector<size_t> lengths;
+  for (size_t i = 0; i <= 33; ++i) lengths.push_back(i);
+  lengths.push_back(1000);
+  lengths.push_back(1023);
+
+  for (size_t offset : {0, 1}) {
+    const uint64_t* haystack = hashes.data() + offset;
+    for (size_t count : lengths)
+      for (int threshold : {0, 1, 5, 20, 32, 33, 64, 65}) {
+        // near the needle so the small thresholds match something, including the tail
+        const uint64_t target = rng();
+        for (size_t i = 0; i < count; i += 3)
+          hashes[offset + i] = target ^ (rng() & rng() & rng() & rng());
+
+        std::vector<HammScanMatch> expected;
+        for (size_t i = 0; i < count; ++i) {
+          const int d = hamm64(target, haystack[i]);
+          if (d < threshold) expected.push_back({uint32_t(i), d});
+        }
+
+        std::vector<HammScanMatch> matches;
+        hamm64Scan(target, haystack, count, threshold, matches);
+
+        QCOMPARE(matches.size(), expected.size());
+        for (size_t i = 0; i < matches.size(); ++i) {
+          QCOMPARE(matches[i].index, expected[i].index);
+          QCOMPARE(matches[i].distance, expected[i].distance);
+        }
+      }
+  }
+}
+
+void TestHamm::testGatherKernels() {
+  QFETCH(QString, kernel);
+  if (!hammSetKernel(qPrintable(kernel))) QSKIP("kernel not supported by this cpu");
+
+  // small blocks, so the rows of one call are in different blocks
+  const int blockShift = 4;
+  const size_t numRows = 1024 + 16;
+  std::mt19937_64 rng(2);
+  std::vector<uint8_t> matrix(numRows * 32);
+  for (auto& b : matrix) b = uint8_t(rng());
+  std::vector<const uint8_t*> blocks;
+  for (size_t i = 0; i < numRows; i += size_t(1) << blockShift)
+    blocks.push_back(matrix.data() + i * 32);
+
+  // unaligned needle
+  std::vector<uint8_t> needle(33);
+  for (auto& b : needle) b = uint8_t(rng());
+
+  // every tail length that is not a multiple of 4 rows
+  std::vector<size_t> lengths;
+  for (size_t i = 0; i <= 33; ++i) lengths.push_back(i);
+  lengths.push_back(1000);
+  lengths.push_back(1023);
+
+  for (size_t count : lengths) {
+    std::vector<uint32_t> rows(count);
+    for (auto& r : rows) r = uint32_t(rng() % numRows);
+
+    std::vector<int> expected(count);
+    for (size_t i = 0; i < count; ++i)
+      expected[i] = hamm256(needle.data() + 1, matrix.data() + rows[i] * 32);
+
+    std::vector<int> distances(count + 1, -1); // must not write past count
+    hamm256Gather(needle.data() + 1, blocks.data(), blockShift, rows.data(), count,
+                  distances.data());
+    QCOMPARE(distances.back(), -1);
+    distances.pop_back();
+    QCOMPARE(distances, expected);
+  }
+}
+
+QTEST_MAIN(TestHamm)
+#include "testhamm.moc"
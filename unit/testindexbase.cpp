@@ -7,6 +7,13 @@
 #include "media.h"
 #include "scanner.h"
 
+QVector<uint32_t> TestIndexBase::sortedIds(const QVector<Index::Match>& matches) {
+  QVector<uint32_t> list;
+  for (auto& m : matches) list.append(m.mediaId);
+  std::sort(list.begin(), list.end());
+  return list;
+}
+
 void TestIndexBase::mediaProcessed(const Media& m) {
   //printf("TestIndexBase::fileAdded: %s\n", qPrintable(m.path()));
   QVERIFY(m.path() != "");
@@ -216,3 +223,92 @@ void TestIndexBase::baseTestAddRemove(const SearchParams& params, int expectedMa
   const MediaGroup h3 = _database->similarTo(processed[2], params);
   QVERIFY(Media::groupCompareByContents(b3, h3));
 }
+
+void TestIndexBase::baseTestCacheFile(Index* index, const SearchParams& params,
+                                      const QStringList& fileNames) {
+  // baseTestLoad() loaded from sql, which writes the cache
+  for (auto& fileName : fileNames)
+    QVERIFY(QFileInfo::exists(_database->cachePath() + "/" + fileName));
+
+  // another instance should load from the cache and find the same things
+  {
+    Database db(_database->path());
+    db.addIndex(index);
+    db.setup();
+    QCOMPARE(db.similar(params).count(), _database->similar(params).count());
+    QCOMPARE(index->count(), _index->count());
+
+    for (const QString& path : _database->indexedFiles()) {
+      const Media m = _database->mediaWithPath(path);
+      QCOMPARE(sortedIds(index->find(m, params)), sortedIds(_index->find(m, params)));
+    }
+  }
+  delete index;
+}
+
+void TestIndexBase::baseTestMaxThresh(const SearchParams& params) {
+  // maxThresh must find the same as raising the threshold until
+  // there are more than minMatches, like it used to
+  SearchParams p = params;
+  p.minMatches = 5;
+  p.maxMatches = 1000;
+  p.maxThresh = p.dctThresh + 15;
+
+  auto sorted = [](QVector<QPair<int, int>> list) {
+    std::sort(list.begin(), list.end());
+    return list;
+  };
+
+  for (const QString& path : _database->indexedFiles()) {
+    const Media needle = _database->mediaWithPath(path);
+
+    SearchParams tmp = p;
+    QVector<Index::Match> matches = _index->find(needle, tmp);
+    while (matches.count() <= p.minMatches && tmp.dctThresh < p.maxThresh) {
+      tmp.dctThresh++;
+      matches = _index->find(needle, tmp);
+    }
+
+    // filterMatch() rejects the group if there are too few, including the needle
+    QVector<QPair<int, int>> expected;
+    if (matches.count() + 1 > p.minMatches)
+      for (auto& m : std::as_const(matches)) expected.append({int(m.mediaId), m.score});
+
+    QVector<QPair<int, int>> actual;
+    for (auto& m : _database->similarTo(needle, p)) actual.append({m.id(), m.score()});
+
+    QCOMPARE(sorted(actual), sorted(expected));
+  }
+}
+
+void TestIndexBase::baseTestCompact(const SearchParams& params, bool exact) {
+  QVector<Media> survivors;
+  QVector<int> removed;
+  QHash<uint32_t, QVector<uint32_t>> before;
+  for (const QString& path : _database->indexedFiles()) {
+    const Media m = _database->mediaWithPath(path);
+    before[uint32_t(m.id())] = sortedIds(_index->find(m, params));
+    if (removed.count() <= survivors.count())
+      removed.append(m.id());
+    else
+      survivors.append(m);
+  }
+
+  // half of the index is more than CompactPercent, remove() compacts it
+  const int count = _index->count();
+  _index->remove(removed);
+  QCOMPARE(_index->memoryWasted(), size_t(0));
+  QVERIFY(_index->count() < count);
+
+  // survivors find themselves under the same id, and never the removed
+  for (const Media& m : std::as_const(survivors)) {
+    const QVector<uint32_t> after = sortedIds(_index->find(m, params));
+    for (int id : std::as_const(removed)) QVERIFY(!after.contains(uint32_t(id)));
+
+    QVector<uint32_t> expected = before[uint32_t(m.id())];
+    expected.removeIf([&removed](uint32_t id) { return removed.contains(int(id)); });
+
+    if (expected.contains(uint32_t(m.id()))) QVERIFY(after.contains(uint32_t(m.id())));
+    if (exact) QCOMPARE(after, expected);
+  }
+}
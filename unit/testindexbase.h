@@ -1,8 +1,9 @@
 #pragma once
 
+#include "index.h"
+
 class Scanner;
 class Database;
-class Index;
 class Media;
 class SearchParams;
 typedef QVector<Media> MediaGroup;
@@ -15,12 +16,19 @@ private Q_SLOTS:
     void mediaProcessed(const Media& m);
 
 protected:
+    /// media ids of the matches, sorted, for comparing results
+    static QVector<uint32_t> sortedIds(const QVector<Index::Match>& matches);
+
     void baseInitTestCase(Index* index, const QString& dataSet);
     void baseCleanupTestCase();
     void baseTestDefaults(Index* index);
     void baseTestEmpty(Index* index);
     void baseTestLoad(const SearchParams& params);
     void baseTestAddRemove(const SearchParams& params, int expectedMatches);
+    void baseTestMaxThresh(const SearchParams& params);
+    void baseTestCompact(const SearchParams& params, bool exact);
+    void baseTestCacheFile(Index* index, const SearchParams& params,
+                           const QStringList& fileNames);
 
     QString _dataDir;
     Database* _database;
@@ -0,0 +1,208 @@
+#include <QtTest/QtTest>
+
+#include "tree/lsh.h"
+
+#include <random>
+
+// approximate search checked against an exhaustive scan
+class TestLsh : public QObject {
+  Q_OBJECT
+
+ private Q_SLOTS:
+  void testKnnSearch();
+  void testDuplicates();
+  void testAppend();
+};
+
+// descriptor matrix in blocks of 2^BlockShift rows, like cv::Mat in cvfeaturesindex
+struct Descriptors {
+  std::vector<std::vector<uint8_t>> data;
+  std::vector<const uint8_t*> blocks;
+  size_t count = 0;
+
+  const uint8_t* row(size_t i) const {
+    return data[i >> OrbLsh::BlockShift].data() +
+           (i & ((size_t(1) << OrbLsh::BlockShift) - 1)) * OrbLsh::DescBytes;
+  }
+
+  void append(std::mt19937_64& rng, size_t numRows) {
+    const size_t blockRows = size_t(1) << OrbLsh::BlockShift;
+    for (size_t i = 0; i < numRows; ++i, ++count) {
+      if (count % blockRows == 0) {
+        data.emplace_back(blockRows * OrbLsh::DescBytes);
+        blocks.push_back(data.back().data());
+      }
+      uint8_t* r = const_cast<uint8_t*>(row(count));
+      for (int j = 0; j < OrbLsh::DescBytes; j += 8) {
+        const uint64_t bits = rng();
+        memcpy(r + j, &bits, sizeof(bits));
+      }
+    }
+  }
+};
+
+// copy of a row with some random bits flipped
+static std::vector<uint8_t> nearRow(std::mt19937_64& rng, const Descriptors& desc, size_t i,
+                                    int maxFlips) {
+  std::vector<uint8_t> query(desc.row(i), desc.row(i) + OrbLsh::DescBytes);
+  const int flips = int(rng() % uint64_t(maxFlips + 1));
+  for (int j = 0; j < flips; ++j) {
+    const int bit = int(rng() % (OrbLsh::DescBytes * 8));
+    query[size_t(bit >> 3)] ^= uint8_t(1 << (bit & 7));
+  }
+  return query;
+}
+
+// k nearest (distance, row) of every row, ties by row number
+static std::vector<OrbLsh::Match> exhaustive(const Descriptors& desc, const uint8_t* query,
+                                             int k, int maxDistance) {
+  std::vector<OrbLsh::Match> all;
+  for (size_t i = 0; i < desc.count; ++i) {
+    const int d = hamm256(query, desc.row(i));
+    if (d < maxDistance) all.push_back({uint32_t(i), d});
+  }
+  std::sort(all.begin(), all.end(), [](auto& a, auto& b) {
+    return a.distance < b.distance || (a.distance == b.distance && a.index < b.index);
+  });
+  all.resize(std::min(all.size(), size_t(k)));
+  return all;
+}
+
+// every result is a distinct row with the right distance, in ascending order,
+// and unused results are at the end
+static void verifyResults(const Descriptors& desc, const uint8_t* query,
+                          const OrbLsh::Match* top, int k, int maxDistance) {
+  QSet<uint32_t> found;
+  for (int i = 0; i < k; ++i) {
+    if (top[i].index == UINT32_MAX) {
+      for (int j = i; j < k; ++j) QCOMPARE(top[j].index, UINT32_MAX);
+      break;
+    }
+    QVERIFY(top[i].index < desc.count);
+    QVERIFY(!found.contains(top[i].index));
+    found.insert(top[i].index);
+    QCOMPARE(top[i].distance, hamm256(query, desc.row(top[i].index)));
+    QVERIFY(top[i].distance < maxDistance);
+    if (i > 0) QVERIFY(top[i - 1].distance <= top[i].distance);
+  }
+}
+
+void TestLsh::testKnnSearch() {
+  // more than one block of rows
+  std::mt19937_64 rng(1);
+  Descriptors desc;
+  desc.append(rng, 100000);
+
+  OrbLsh lsh;
+  lsh.build(desc.blocks.data(), desc.count);
+  QCOMPARE(lsh.size(), desc.count);
+
+  const int k = 4, maxDistance = 64, numQueries = 500;
+  std::vector<uint8_t> queries;
+  for (int i = 0; i < numQueries; ++i) {
+    const auto query = nearRow(rng, desc, rng() % desc.count, 24);
+    queries.insert(queries.end(), query.begin(), query.end());
+  }
+
+  std::vector<OrbLsh::Match> matches;
+  lsh.knnSearch(desc.blocks.data(), queries.data(), numQueries, k, maxDistance, matches);
+  QCOMPARE(matches.size(), size_t(numQueries * k));
+
+  int recalled = 0;
+  for (int q = 0; q < numQueries; ++q) {
+    const uint8_t* query = queries.data() + q * OrbLsh::DescBytes;
+    const OrbLsh::Match* top = matches.data() + q * k;
+    verifyResults(desc, query, top, k, maxDistance);
+
+    // can't beat the exhaustive search, usually finds its nearest
+    const auto expected = exhaustive(desc, query, k, maxDistance);
+    for (size_t i = 0; i < expected.size(); ++i)
+      QVERIFY(top[i].index == UINT32_MAX || top[i].distance >= expected[i].distance);
+    if (!expected.empty() && top[0].distance == expected[0].distance) recalled++;
+  }
+  QVERIFY(recalled >= numQueries * 95 / 100);
+}
+
+void TestLsh::testDuplicates() {
+  // the same row is in the probed buckets of every table, but is found once
+  std::mt19937_64 rng(2);
+  Descriptors desc;
+  desc.append(rng, 5000);
+
+  OrbLsh lsh;
+  lsh.build(desc.blocks.data(), desc.count);
+
+  const int k = 8, maxDistance = 257, numQueries = 100;
+  std::vector<uint8_t> queries;
+  std::vector<uint32_t> rows;
+  for (int i = 0; i < numQueries; ++i) {
+    rows.push_back(uint32_t(rng() % desc.count));
+    const auto query = nearRow(rng, desc, rows.back(), 0);
+    queries.insert(queries.end(), query.begin(), query.end());
+  }
+
+  std::vector<OrbLsh::Match> matches;
+  lsh.knnSearch(desc.blocks.data(), queries.data(), numQueries, k, maxDistance, matches);
+
+  for (int q = 0; q < numQueries; ++q) {
+    const OrbLsh::Match* top = matches.data() + q * k;
+    verifyResults(desc, queries.data() + q * OrbLsh::DescBytes, top, k, maxDistance);
+    QCOMPARE(top[0].index, rows[size_t(q)]);
+    QCOMPARE(top[0].distance, 0);
+    QVERIFY(top[k - 1].index != UINT32_MAX);
+  }
+}
+
+void TestLsh::testAppend() {
+  // rows after build() are scanned, so their neighbors are always found
+  std::mt19937_64 rng(3);
+  Descriptors desc;
+  desc.append(rng, 60000);
+
+  OrbLsh lsh;
+  lsh.build(desc.blocks.data(), desc.count);
+
+  // the tail crosses into the next block
+  const size_t numIndexed = desc.count;
+  desc.append(rng, 10000);
+  lsh.append(desc.blocks.data(), desc.count);
+  QCOMPARE(lsh.size(), desc.count);
+
+  const int k = 3, maxDistance = 64, numQueries = 300;
+  std::vector<uint8_t> queries;
+  std::vector<uint32_t> rows;
+  for (int i = 0; i < numQueries; ++i) {
+    rows.push_back(uint32_t(numIndexed + rng() % (desc.count - numIndexed)));
+    const auto query = nearRow(rng, desc, rows.back(), 24);
+    queries.insert(queries.end(), query.begin(), query.end());
+  }
+
+  std::vector<OrbLsh::Match> matches;
+  lsh.knnSearch(desc.blocks.data(), queries.data(), numQueries, k, maxDistance, matches);
+
+  for (int q = 0; q < numQueries; ++q) {
+    const uint8_t* query = queries.data() + q * OrbLsh::DescBytes;
+    const OrbLsh::Match* top = matches.data() + q * k;
+    verifyResults(desc, query, top, k, maxDistance);
+
+    const auto expected = exhaustive(desc, query, 1, maxDistance);
+    QCOMPARE(expected.size(), size_t(1));
+    QCOMPARE(expected[0].index, rows[size_t(q)]);
+    QCOMPARE(top[0].index, expected[0].index);
+    QCOMPARE(top[0].distance, expected[0].distance);
+  }
+
+  // too many appended rows rebuilds the tables, which have the same rows
+  desc.append(rng, 20000);
+  lsh.append(desc.blocks.data(), desc.count);
+  QCOMPARE(lsh.size(), desc.count);
+
+  const size_t last = desc.count - 1;
+  const auto query = nearRow(rng, desc, last, 0);
+  lsh.knnSearch(desc.blocks.data(), query.data(), 1, 1, maxDistance, matches);
+  QCOMPARE(matches[0].index, uint32_t(last));
+  QCOMPARE(matches[0].distance, 0);
+}
+
+QTEST_MAIN(TestLsh)
+#include "testlsh.moc"
@@ -0,0 +1,348 @@
+#include <QtTest/QtTest>
+
+#include "tree/dcttree.h"
+#include "tree/hammingtree.h"
+#include "tree/mih.h"
+#include "tree/radix.h"
+#include "tree/vptree.h"
+
+#include <random>
+
+// search trees checked against brute force
+class TestTree : public QObject {
+  Q_OBJECT
+
+ private Q_SLOTS:
+  void testDctTreeUpdates();
+  void testMultiIndexHash();
+  void testStats();
+  void testRadixProbe();
+  void testRadixBuild();
+};
+
+// clusters of similar hashes, so a small threshold finds more than the needle
+static void randomClusters(int numClusters, int clusterSize, int maxFlips, uint64_t seed,
+                           std::vector<uint64_t>& hashes) {
+  std::mt19937_64 rng(seed);
+  for (int i = 0; i < numClusters; ++i) {
+    const uint64_t center = rng();
+    for (int j = 0; j < clusterSize; ++j) {
+      uint64_t hash = center;
+      const int flips = int(rng() % uint64_t(maxFlips + 1));
+      for (int k = 0; k < flips; ++k) hash ^= uint64_t(1) << (rng() % 64);
+      hashes.push_back(hash);
+    }
+  }
+}
+
+// (id, distance) sorted, for comparing results
+static QVector<QPair<uint32_t, int>> sorted(const QVector<Index::Match>& matches) {
+  QVector<QPair<uint32_t, int>> list;
+  for (auto& m : matches) list.append({m.mediaId, m.score});
+  std::sort(list.begin(), list.end());
+  return list;
+}
+
+void TestTree::testDctTreeUpdates() {
+  std::vector<uint64_t> hashes;
+  randomClusters(100, 10, 8, 1, hashes);
+
+  std::vector<uint32_t> ids;
+  for (size_t i = 0; i < hashes.size(); ++i) ids.push_back(uint32_t(i + 1));
+
+  DctTree tree;
+  tree.setRebuildFraction(0.1f);
+  tree.create(hashes.data(), ids.data(), int(hashes.size()));
+  QVERIFY(!tree.needsRebuild());
+
+  // what the tree should have after the updates
+  QMap<uint32_t, uint64_t> live;
+  for (size_t i = 0; i < hashes.size(); ++i) live[ids[i]] = hashes[i];
+
+  // near-duplicates of existing values go to the append buffer
+  std::vector<uint64_t> addedHashes;
+  std::vector<uint32_t> addedIds;
+  for (int i = 0; i < 30; ++i) {
+    addedHashes.push_back(hashes[size_t(i * 7)] ^ (uint64_t(1) << i));
+    addedIds.push_back(uint32_t(2001 + i));
+  }
+  tree.insert(addedHashes.data(), addedIds.data(), int(addedIds.size()));
+  QVERIFY(!tree.needsRebuild());
+
+  // remove half of the added values, a few tree values, and ids the
+  // tree never had; only the tree values count towards a rebuild
+  QSet<int> removed;
+  for (int i = 0; i < 15; ++i) removed.insert(2001 + i);
+  for (int i = 1; i <= 50; ++i) removed.insert(i * 3);
+  for (int i = 0; i < 500; ++i) removed.insert(5001 + i);
+  tree.remove(removed);
+  QVERIFY(!tree.needsRebuild());
+
+  for (size_t i = 15; i < addedIds.size(); ++i) live[addedIds[i]] = addedHashes[i];
+  for (int id : removed) live.remove(uint32_t(id));
+
+  // removing the same things again changes nothing
+  tree.remove(removed);
+  QVERIFY(!tree.needsRebuild());
+
+  // re-added ids are found with their new hash
+  std::vector<uint64_t> readdedHashes;
+  std::vector<uint32_t> readdedIds;
+  for (int i = 1; i <= 10; ++i) {
+    readdedHashes.push_back(hashes[size_t(i * 11)] ^ 3);
+    readdedIds.push_back(uint32_t(i * 3));
+    live[uint32_t(i * 3)] = readdedHashes.back();
+  }
+  tree.insert(readdedHashes.data(), readdedIds.data(), int(readdedIds.size()));
+  QVERIFY(!tree.needsRebuild());
+
+  const int threshold = 10;
+  for (size_t i = 0; i < hashes.size(); i += 3) {
+    const uint64_t target = hashes[i] ^ 1;
+
+    QVector<Index::Match> expected;
+    for (auto it = live.begin(); it != live.end(); ++it) {
+      const int distance = hamm64(target, it.value());
+      if (distance < threshold) expected.append(Index::Match(it.key(), distance));
+    }
+
+    QCOMPARE(sorted(tree.search(target, threshold)), sorted(expected));
+
+    QVector<Index::Match> shards;
+    for (int shard = 0; shard < 3; ++shard) shards += tree.search(target, threshold, shard, 3);
+    QCOMPARE(sorted(shards), sorted(expected));
+
+    const int k = 4;
+    QVector<Index::Match> nearest = tree.nearest(target, k, threshold);
+    std::sort(expected.begin(), expected.end());
+    QCOMPARE(nearest.count(), std::min(k, int(expected.count())));
+    for (int j = 0; j < nearest.count(); ++j) QCOMPARE(nearest[j].score, expected[j].score);
+  }
+}
+
+void TestTree::testMultiIndexHash() {
+  typedef MultiIndexHash_t<uint32_t> MultiIndexHash;
+
+  // sizes give 3..8 tables
+  for (int numClusters : {1, 20, 2000, 20000}) {
+    std::vector<uint64_t> hashes;
+    randomClusters(numClusters, 5, 12, uint64_t(numClusters), hashes);
+
+    std::vector<MultiIndexHash::Value> values;
+    for (size_t i = 0; i < hashes.size(); ++i) values.push_back({uint32_t(i), hashes[i]});
+
+    MultiIndexHash tree;
+    tree.create(values);
+    QCOMPARE(tree.size(), hashes.size());
+
+    std::mt19937_64 rng(2);
+    for (int threshold = 1; threshold <= 16; ++threshold)
+      for (int i = 0; i < 50; ++i) {
+        const uint64_t target = hashes[rng() % hashes.size()] ^ (rng() & rng() & rng());
+
+        std::vector<HammScanMatch> expected;
+        hamm64Scan(target, hashes.data(), hashes.size(), threshold, expected);
+
+        std::vector<MultiIndexHash::Match> matches;
+        tree.search(target, threshold, matches);
+
+        // same values, each one found once
+        std::sort(matches.begin(), matches.end(), [](auto& a, auto& b) {
+          return a.value.index < b.value.index;
+        });
+        QCOMPARE(matches.size(), expected.size());
+        for (size_t j = 0; j < matches.size(); ++j) {
+          QCOMPARE(matches[j].value.index, expected[j].index);
+          QCOMPARE(matches[j].value.hash, hashes[expected[j].index]);
+          QCOMPARE(matches[j].distance, expected[j].distance);
+        }
+      }
+  }
+}
+
+// vptree value, min()/max() are the sentinels it needs
+struct VpHash {
+  uint64_t hash = 0;
+  static VpHash min() { return VpHash(); }
+  static VpHash max() { return VpHash{UINT64_MAX}; }
+};
+static int vpDistance(VpHash a, VpHash b) { return hamm64(a.hash, b.hash); }
+
+void TestTree::testStats() {
+  std::vector<uint64_t> hashes;
+  randomClusters(1000, 10, 8, 3, hashes);
+  const size_t valueSize = sizeof(uint64_t) + sizeof(uint32_t);
+
+  // vptree memory is the nodes and leaf values, which write() stores as-is
+  {
+    typedef VpTree<VpHash, int, vpDistance> Tree;
+    std::vector<VpHash> values;
+    for (uint64_t hash : hashes) values.push_back({hash});
+    Tree tree;
+    tree.create(values);
+
+    QBuffer buf;
+    QVERIFY(buf.open(QIODevice::WriteOnly));
+    tree.write(buf);
+
+    const Tree::Stats st = tree.stats();
+    QCOMPARE(st.numValues, int(hashes.size()));
+    QCOMPARE(st.slack, size_t(0));
+    QCOMPARE(st.memory, sizeof(Tree) + size_t(buf.size()) - 2 * sizeof(uint64_t));
+  }
+
+  // hamming tree leaves are on the heap, or in the cache file after map()
+  {
+    typedef HammingTree_t<uint32_t> HammingTree;
+    std::vector<HammingTree::Value> values;
+    for (size_t i = 0; i < hashes.size(); ++i) values.push_back({uint32_t(i + 1), hashes[i]});
+    HammingTree tree;
+    tree.insert(values);
+
+    const HammingTree::Stats heap = tree.stats();
+    QCOMPARE(heap.numValues, int(hashes.size()));
+    QCOMPARE(heap.mapped, size_t(0));
+    QVERIFY(heap.memory - heap.slack > sizeof(HammingTree) + hashes.size() * valueSize);
+
+    QTemporaryDir tmp;
+    QVERIFY(tmp.isValid());
+    const QString path = tmp.path() + "/tree.cache";
+    writeFileAtomically(path, [&tree](QFile& f) { tree.write(f); });
+
+    HammingTree mapped;
+    QVERIFY(mapped.map(path));
+    const HammingTree::Stats st = mapped.stats();
+    QCOMPARE(st.numNodes, heap.numNodes);
+    QCOMPARE(st.numValues, heap.numValues);
+    QCOMPARE(st.mapped, hashes.size() * valueSize);
+    QCOMPARE(st.slack, size_t(0));
+
+    // only the nodes are left on the heap
+    QCOMPARE(st.memory + st.mapped, heap.memory - heap.slack);
+  }
+
+  // radix map has no slack whether it was built or inserted
+  {
+    typedef RadixMap_t<uint32_t> RadixMap;
+    const uint radix = 12;
+    std::vector<RadixMap::Value> values;
+    for (size_t i = 0; i < hashes.size(); ++i) values.push_back({uint32_t(i), hashes[i]});
+
+    const size_t expected = sizeof(RadixMap) + ((size_t(1) << radix) + 1) * sizeof(uint32_t) +
+                            hashes.size() * valueSize;
+
+    RadixMap inserted(radix);
+    inserted.insert(values);
+    QCOMPARE(inserted.stats().memory, expected);
+    QCOMPARE(inserted.stats().slack, size_t(0));
+
+    RadixMap built(radix);
+    built.build(
+        1, [&values](int, std::vector<RadixMap::Value>& part) { part = values; },
+        std::less<uint32_t>());
+    QCOMPARE(built.stats().memory, expected);
+    QCOMPARE(built.stats().slack, size_t(0));
+  }
+}
+
+void TestTree::testRadixProbe() {
+  typedef RadixMap_t<uint32_t> RadixMap;
+
+  std::vector<uint64_t> hashes;
+  randomClusters(2000, 5, 12, 4, hashes);
+
+  std::vector<RadixMap::Value> values;
+  for (size_t i = 0; i < hashes.size(); ++i) values.push_back({uint32_t(i), hashes[i]});
+  RadixMap map(8);
+  map.insert(values);
+
+  // number of radix bits that differ
+  auto bucketDistance = [&map](uint64_t a, uint64_t b) {
+    return hamm64(uint64_t(map.indexOf(a)), uint64_t(map.indexOf(b)));
+  };
+
+  auto search = [&map](uint64_t target, int threshold, int probeRadius) {
+    std::vector<RadixMap::Match> matches;
+    map.search(target, RadixMap::distance_t(threshold), matches, probeRadius);
+    QVector<QPair<uint32_t, int>> list;
+    for (auto& m : matches) list.append({m.value.index, int(m.distance)});
+    std::sort(list.begin(), list.end());
+    return list;
+  };
+
+  std::mt19937_64 rng(5);
+  int recovered = 0; // matches outside the query bucket
+  for (int threshold : {1, 2, 5, 9, 13})
+    for (int probeRadius = 0; probeRadius <= 4; ++probeRadius)
+      for (int i = 0; i < 50; ++i) {
+        const uint64_t target = hashes[rng() % hashes.size()] ^ (rng() & rng() & rng());
+
+        // a bucket r bits away has nothing closer than r, so probes stop at threshold-1
+        const int radius = std::min(probeRadius, threshold - 1);
+        QVector<QPair<uint32_t, int>> expected;
+        for (size_t j = 0; j < hashes.size(); ++j) {
+          const int distance = hamm64(target, hashes[j]);
+          if (distance < threshold && bucketDistance(target, hashes[j]) <= radius)
+            expected.append({uint32_t(j), distance});
+        }
+
+        const auto matches = search(target, threshold, probeRadius);
+        QCOMPARE(matches, expected);
+
+        for (auto& m : matches)
+          if (bucketDistance(target, hashes[m.first]) > 0) recovered++;
+      }
+  QVERIFY(recovered > 0);
+
+  // threshold-1 probes are enough to find every match, exactly once, even
+  // one that differs from the query only in threshold-1 radix bits
+  for (int threshold : {1, 2, 4, 7}) {
+    const size_t needle = rng() % hashes.size();
+    const uint64_t target = hashes[needle] ^ (((uint64_t(1) << (threshold - 1)) - 1) << 1);
+    QCOMPARE(bucketDistance(target, hashes[needle]), threshold - 1);
+
+    QVector<QPair<uint32_t, int>> expected;
+    for (size_t j = 0; j < hashes.size(); ++j) {
+      const int distance = hamm64(target, hashes[j]);
+      if (distance < threshold) expected.append({uint32_t(j), distance});
+    }
+    QVERIFY(expected.contains({uint32_t(needle), threshold - 1}));
+    QCOMPARE(search(target, threshold, threshold - 1), expected);
+    QCOMPARE(search(target, threshold, int(map.radix())), expected);
+  }
+}
+
+void TestTree::testRadixBuild() {
+  typedef RadixMap_t<uint32_t> RadixMap;
+
+  // parts of random sizes, some empty; indices increase by part, then
+  // position, so ordering by index is the order insert() sees them
+  std::mt19937_64 rng(6);
+  std::vector<std::vector<RadixMap::Value>> parts(37);
+  uint32_t index = 0;
+  for (auto& part : parts) {
+    const size_t count = rng() % 4 ? rng() % 2000 : 0;
+    for (size_t i = 0; i < count; ++i) part.push_back({index++, rng()});
+  }
+
+  for (uint radix : {1, 6, 12}) {
+    RadixMap inserted(radix);
+    for (auto& part : parts) inserted.insert(part);
+
+    RadixMap built(radix);
+    built.build(
+        int(parts.size()),
+        [&parts](int i, std::vector<RadixMap::Value>& values) {
+          values.insert(values.end(), parts[size_t(i)].begin(), parts[size_t(i)].end());
+        },
+        std::less<uint32_t>());
+
+    QCOMPARE(built.size(), size_t(index));
+    QVERIFY(built._offsets == inserted._offsets);
+    QVERIFY(built._hashes == inserted._hashes);
+    QVERIFY(built._indices == inserted._indices);
+  }
+}
+
+QTEST_MAIN(TestTree)
+#include "testtree.moc"
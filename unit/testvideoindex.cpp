@@ -18,6 +18,8 @@ class TestVideoIndex : public QObject {
   void testLoad();
   void testSave();
 
+  void testHashStore();
+
  private:
   QString _dataDir;
 };
@@ -257,5 +259,105 @@ void TestVideoIndex::testSave() {
   QFile::remove(path);
 }
 
+void TestVideoIndex::testHashStore() {
+  QTemporaryDir tmp;
+  QVERIFY(tmp.isValid());
+  const QString dir = tmp.path();
+
+  auto makeIndex = [](int seed, int len) {
+    VideoIndex v;
+    for (int i = 0; i < len; ++i) {
+      v.frames.push_back(i * 3);
+      v.hashes.push_back(dcthash_t(seed) * 1000 + i);
+    }
+    return v;
+  };
+
+  auto verify = [](const VideoHashStore& store, mediaid_t id, const VideoIndex& v) {
+    VideoHashStore::Entry e;
+    if (!store.find(id, e)) return false;
+    if (e.count != v.frames.size()) return false;
+    for (uint32_t i = 0; i < e.count; ++i)
+      if (e.frames[i] != v.frames[i] || e.hashes[i] != v.hashes[i]) return false;
+    return true;
+  };
+
+  // build from .vdx, odd lengths check alignment of the hashes
+  const VideoIndex v1 = makeIndex(1, 5), v2 = makeIndex(2, 8);
+  v1.save(qq("%1/1.vdx").arg(dir));
+  v2.save(qq("%1/2.vdx").arg(dir));
+  VideoIndex().save(qq("%1/3.vdx").arg(dir));
+  v1.save(qq("%1/resume-abc.vdx").arg(dir));
+
+  VideoHashStore store;
+  QVERIFY(!store.open(dir));
+
+  VideoHashStore::rebuild(dir);
+  QVERIFY(store.open(dir));
+  QCOMPARE(store.count(), size_t(2));
+  QVERIFY(verify(store, 1, v1));
+  QVERIFY(verify(store, 2, v2));
+
+  VideoHashStore::Entry e;
+  QVERIFY(!store.find(3, e));
+  QVERIFY(!store.find(4, e));
+
+  // appended records are not seen until reopened, last record for an id wins
+  const VideoIndex v4 = makeIndex(4, 7), v2b = makeIndex(5, 3);
+  MediaGroup media;
+  media.append(Media("4.mp4", Media::TypeVideo));
+  media.last().setId(4);
+  media.last().setVideoIndex(v4);
+  media.append(Media("2.mp4", Media::TypeVideo));
+  media.last().setId(2);
+  media.last().setVideoIndex(v2b);
+  VideoHashStore::append(dir, media);
+  QVERIFY(!store.find(4, e));
+  QVERIFY(verify(store, 2, v2));
+
+  QVERIFY(store.open(dir));
+  QCOMPARE(store.count(), size_t(3));
+  QVERIFY(verify(store, 1, v1));
+  QVERIFY(verify(store, 2, v2b));
+  QVERIFY(verify(store, 4, v4));
+  store.close();
+
+  // interrupted append, partial offset is dropped and the next append works
+  {
+    QFile f(dir + "/hashes.idx");
+    QVERIFY(f.open(QFile::Append));
+    QCOMPARE(f.write("xyz", 3), qint64(3));
+  }
+  QVERIFY(store.open(dir));
+  QCOMPARE(store.count(), size_t(3));
+  store.close();
+
+  media.remove(1);
+  media[0].setId(5);
+  VideoHashStore::append(dir, media);
+  QVERIFY(store.open(dir));
+  QCOMPARE(store.count(), size_t(4));
+  QVERIFY(verify(store, 5, v4));
+  store.close();
+
+  // truncated segment, records past the end are not found
+  {
+    QFile f(dir + "/hashes.seg");
+    QVERIFY(f.resize(f.size() - 8));
+  }
+  QVERIFY(store.open(dir));
+  QVERIFY(verify(store, 1, v1));
+  QVERIFY(!store.find(5, e));
+  store.close();
+
+  // missing store is rebuilt from .vdx on append
+  VideoHashStore::remove(dir);
+  QVERIFY(!store.open(dir));
+  VideoHashStore::append(dir, media);
+  QVERIFY(store.open(dir));
+  QCOMPARE(store.count(), size_t(2));
+  QVERIFY(verify(store, 2, v2));
+}
+
 QTEST_MAIN(TestVideoIndex)
 #include "testvideoindex.moc"